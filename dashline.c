@@ -11,9 +11,12 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <float.h>
 #include <math.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <limits.h>
 
 #include <allegro5/allegro.h>
 #include <allegro5/allegro_font.h>
@@ -34,7 +37,6 @@
 #define HOME_Y      0
 
 #define RAD_PER_CIRCLE  ((float)2 * M_PI)
-#define DASH_PER_CIRCLE 30
 #define PIX_PER_DASH    10
 #define LINE_WIDTH      1
 //#define TEXTURE_LINE_WIDTH 1
@@ -43,6 +45,40 @@
 #define STARTING_TEXTURE_MASK   0x8000
 #define RASTER_BITS    8
 #define STARTING_RASTER_MASK   0x80
+#define DEFAULT_QUEUE_SIZE  1024    // render thread command ring slots, a power of 2
+#define DEFAULT_FRAME_RATE  60      // frames per second
+#define FRAME_HISTORY       256     // recent frame times kept for statistics, a power of 2
+#define FRAMES_IN_FLIGHT    2       // frames queued for the render thread before ticks are skipped
+#define TEST_RUNS           5       // draws per scene when timing a test, the best is kept
+#define TEST_BUDGET_MARGIN  2.0     // budget written by dashline -G, times the measured time
+#define TEST_BUDGET_MIN_MS  5.0     // smallest budget, shorter times are timer and scheduling noise
+#define TEST_SHADER_TOLERANCE   0.05    // share of the pixels the CPU lights that the shader may draw differently
+#define TEXT_FIRST_CHAR     32      // first printable character in the glyph atlas
+#define TEXT_SOLID_CELL     127     // atlas cell after the last printable character, filled solid
+#define TEXT_ATLAS_COLS     16      // glyph cells per atlas row
+#define SCENE_PALETTE_SIZE  256     // colours of a compact scene, indexed by a byte
+#define ARENA_BLOCK_SIZE    (1 << 20)   // bytes the scene arena takes from malloc at a time
+#define POOL_CHUNK_RECS     4096    // records per pool chunk
+#define INDEXED_COLORS      256     // palette entries of an indexed framebuffer
+#define DEMO_PART_OBJECTS   1000    // random objects built by each worker thread with -p
+#define SCHED_BAND_ROWS     16      // rows of a fill drawn as one unit by the scheduler
+#define SCHED_RASTER_BYTES  1024    // raster bytes drawn as one unit by the scheduler
+#define CAPTURE_BUFFERS     4       // frames a capture pool holds while the encoder catches up
+#define SCENE_FILE_MAGIC    0x454e4353  // "SCNE" read as a little endian uint32
+#define SCENE_FILE_VERSION  1
+#define SCENE_FILE_SECTIONS 8       // record sections in a scene file, indexed by enum GTYPE
+#define SHM_MAGIC           0x4d485344  // "DSHM" read as a little endian uint32
+#define SHM_VERSION         1
+#define TRACE_FILE_MAGIC    0x43525444  // "DTRC" read as a little endian uint32
+#define TRACE_FILE_VERSION  2       // version 2 adds dap_update_raster, polygons and contexts
+#define TRACE_MAX_OBJECTS   4096    // objects a trace can tell apart, calls on more are dropped
+#define TRACE_MAX_ARGS      4
+#define RASTER_DIFF_GAP     8       // unchanged bytes between two changed runs that are redrawn as one
+#define CIRCLE_TABLE_SIZE   2048    // points of the shared unit circle table, a power of 2
+#define GEOM_CACHE_BITS     12      // derived geometry memos per drawing thread, log 2
+#define GEOM_PARTS          8       // generations taken by a setter, the ones after the first name the sides of a rectangle
+#define CIRCLE_MIN_DASHES   4       // dashes of the smallest dashed circle, even
+#define CIRCLE_SEG_PIXELS   4       // length of the segments a dash is drawn with
 
 // aliases
 #define LINE_NONE   BORDER_NONE
@@ -50,6 +86,11 @@
 #define LINE_DASH   BORDER_DASH
 #define LINE_PATTERN    BORDER_PATTERN
 
+// 16.16 fixed point coordinates
+#define FIX_SHIFT   16
+#define FIX_ONE     (1 << FIX_SHIFT)
+#define FIX_LIMIT   32767.0f    // largest magnitude of a coordinate that fits
+
 enum GBORDER {
     BORDER_NONE,
     BORDER_SOLID,
@@ -71,9 +112,19 @@ enum GTYPE {
     TYPE_CIRCLE,
     TYPE_RECTANGLE,
     TYPE_RASTER,
+    TYPE_TEXT,
+    TYPE_POLYGON,
     TYPE_MAX,
 };
 
+enum GCOP {
+    COP_NORMAL,         // pattern set bits in foreground, clear bits in background
+    COP_INVERT,         // pattern set bits in background, clear bits in foreground
+    COP_OVERLAY,        // pattern set bits in foreground, clear bits are not written
+    COP_ERASE,          // pattern set bits in background, clear bits are not written
+    COP_MAX,
+};
+
 typedef struct gclr {
     ALLEGRO_COLOR fg;  // foreground color
     ALLEGRO_COLOR bg;  // background color
@@ -87,37 +138,67 @@ typedef struct gs {
     int fill;           // valid values are in enum GFILL
     uint16_t pattern;   // hash pattern
     bool clip;          // if true, clip if not viewable, otherwise wrap
+    int width;          // stroke width in pixels of lines and borders, 0 and 1 draw one pixel lines
 } GSTYLE;
 
+// geometry is held in 16.16 fixed point from the dap_set_* setters through to the
+// drawing kernels, so the pixels drawn do not depend on the compiler or the FPU
+typedef int32_t GFIXED;
+
 typedef struct gc{
-    float x;            // circle parameters
-    float y;
-    float radius;
+    GFIXED x;           // circle parameters
+    GFIXED y;
+    GFIXED radius;
 } GCIRCLE;
 
 typedef struct gr{
-    float x0;           // rectangle parameters
-    float y0;
-    float x1;
-    float y1;
+    GFIXED x0;          // rectangle parameters
+    GFIXED y0;
+    GFIXED x1;
+    GFIXED y1;
 } GRECTANGLE;
 
 typedef struct gl{
-    float x0;           // line parameters
-    float y0;
-    float x1;
-    float y1;
+    GFIXED x0;          // line parameters
+    GFIXED y0;
+    GFIXED x1;
+    GFIXED y1;
 } GLINE;
 
 typedef struct grast {
-    float x;
-    float y;
+    GFIXED x;
+    GFIXED y;
     int width;
     int fd;             // file descriptor of raster file
     size_t  fdlength;   // file length
     uint8_t *rdataptr;  // pointer to raster data array in memory
+    size_t  offset;     // byte offset of rdataptr in the whole raster, 0 unless drawing part of it
+    struct dload *load; // background load in progress, see dap_load_raster_file
+    bool owned;         // rdataptr is a mapping of fdlength bytes the object unmaps
+    float sx;           // scale set by dap_set_raster_transform
+    float sy;
+    float angle;        // turn in radians about the top left corner
+    bool affine;        // false draws the raster 1:1
 } GRASTER;
 
+typedef struct gtxt {
+    GFIXED x;           // top left of the first character
+    GFIXED y;
+    int scale;          // glyph scale, whole pixels
+    char *str;          // string, not copied, must stay valid until drawn
+} GTEXT;
+
+typedef struct gpoly {
+    GFIXED x;           // origin the points are relative to
+    GFIXED y;
+    int n;              // number of points
+    float *pts;         // x, y pairs, not copied, must stay valid until drawn
+} GPOLYGON;
+
+// drawing kernel, one specialisation per shape, fill or border style and color op
+struct gro;
+typedef void (*DAP_KERNEL)(struct gro *go);
+
 typedef struct gro {
     int     gtype;      // Valid values are defined in the GTYPE enum
     GCOLOR  gc;
@@ -128,17 +209,474 @@ typedef struct gro {
         GLINE   gline;
         GRASTER grast;
         GRECTANGLE   grect;
+        GTEXT   gtext;
+        GPOLYGON gpoly;
     };
 
+    DAP_KERNEL fillk;   // fill kernel, bound by the dap_set_* setters
+    DAP_KERNEL borderk; // border kernel, bound by the dap_set_* setters
+    uint64_t gen;       // generation, renewed by the dap_set_* setters, 0 if not memoized
+
 } GRAPH_OBJ;
 
 GRAPH_OBJ   g;
 
+// previous raster data kept by dap_update_raster
+typedef struct drdiff {
+    uint8_t *prev;      // copy of the data last drawn
+    size_t len;
+    size_t nbytes;      // bytes redrawn by the last update
+    uint32_t nruns;     // runs redrawn by the last update
+} DAP_RASTER_DIFF;
+
+enum DAP_CMD_OP {
+    CMD_NONE,
+    CMD_FILL,           // run the fill kernel of the object
+    CMD_BORDER,         // run the border kernel of the object
+    CMD_CLEAR,          // clear the display to color
+    CMD_FLIP,           // flip the display
+    CMD_COMPOSE,        // paint the changed windows and composite them onto the display
+    CMD_BATCH_BEGIN,    // gather dashed circle borders
+    CMD_BATCH_END,      // draw the gathered dashed circle borders
+    CMD_CAPTURE,        // snapshot the frame for the capture encoder
+    CMD_VIEW,           // set the view of the commands that follow
+    CMD_FREEZE,         // draw a frozen group
+    CMD_MAX,
+};
+
+// frame pacer, see dap_frame_due and dap_flip_frame
+typedef struct dframe {
+    double period;      // target frame period in seconds
+    double deadline;    // deadline of the frame being drawn, drawing thread only
+    uint32_t nsubmitted;    // frames drawn, drawing thread only
+    uint32_t nskipped;  // timer ticks skipped, drawing thread only
+    uint32_t npresented;    // frames flipped, written by the flipping thread
+    uint32_t nmissed;   // frames flipped after their deadline, flipping thread only
+    double last;        // time of the last flip, flipping thread only
+    double times[FRAME_HISTORY];    // recent frame times in seconds, flipping thread only
+} DAP_FRAME_PACER;
+
+typedef struct dfstat {
+    uint32_t frames;    // frames flipped
+    uint32_t missed;    // frames flipped after their deadline
+    uint32_t skipped;   // timer ticks skipped
+    double p50;         // recent frame time percentiles in seconds
+    double p95;
+    double p99;
+    double max;
+} DAP_FRAME_STATS;
+
+// job of a progressive rendering scheduler, drawn a unit at a time
+typedef struct dsjob {
+    GRAPH_OBJ obj;      // copy of the object drawn
+    GRAPH_OBJ *src;     // raster still loading, adopted before the first unit, otherwise NULL
+    int op;             // CMD_FILL or CMD_BORDER
+    bool banded;        // fill drawn in bands of rows
+    int64_t next;       // first row or raster byte not yet drawn
+    int64_t end;
+} DAP_SCHED_JOB;
+
+// progressive rendering scheduler, see dap_sched_run
+typedef struct dsched {
+    DAP_SCHED_JOB *jobs;    // jobs not yet drawn are head to njobs - 1
+    int head;
+    int njobs;
+    int size;
+    int64_t nadded;     // jobs added, the ticket of the next job
+    int64_t ndone;      // jobs drawn, in the order added
+    int nunits;         // units drawn by the last dap_sched_run
+} DAP_SCHED;
+
+// group of objects drawn from one vertex and index buffer, see dap_freeze_draw
+typedef struct dfreeze {
+    GRAPH_OBJ **objs;   // members, in drawing order
+    uint64_t *gens;     // generation of each member when recorded
+    float **pts;        // points of each polygon member when recorded, NULL for other members
+    int nobjs;
+    int size;
+    ALLEGRO_VERTEX *vtx;    // recorded triangles, kept to record again and to draw from memory
+    int *idx;
+    int nvtx, vtx_size;
+    int nidx, idx_size;
+    ALLEGRO_VERTEX_BUFFER *vb;  // the triangles on the display, NULL if drawn from memory
+    ALLEGRO_INDEX_BUFFER *ib;
+    bool stale;         // a member was added since recording
+    bool failed;        // out of memory while recording
+    bool indexed;       // recorded with the colours of an indexed framebuffer
+    uint32_t nbuilds;   // times recorded
+} DAP_FREEZE;
+
+// window, an offscreen surface composited onto the display by dap_compose
+typedef struct dwin {
+    int x, y;           // origin on the display
+    int w, h;           // size in window pixels
+    int scale;          // display pixels per window pixel
+    bool visible;
+    ALLEGRO_COLOR fg;   // foreground colour for the paint function
+    ALLEGRO_COLOR bg;   // background colour, the surface is cleared to it before painting
+    void (*paint)(struct dwin *win, void *arg);     // draws the contents relative to the window
+    void *arg;
+    ALLEGRO_BITMAP *bmp;    // cached contents, compositing thread only
+    int dirty;          // true when the contents must be painted again, accessed atomically
+    uint32_t npaints;   // times painted, compositing thread only
+} DAP_WINDOW;
+
+// pan and zoom of a context, see dap_ctx_set_view
+typedef struct dview {
+    float x, y;         // target position of the object origin
+    float zoom;         // target pixels per object unit
+} DAP_VIEW;
+
+// drawing context, see dap_ctx_create
+typedef struct dctx {
+    ALLEGRO_BITMAP *target; // surface drawn to at submit time, NULL for the thread's target
+    DAP_VIEW view;          // view the commands are drawn with
+    GRAPH_OBJ defaults;     // colours and style new objects start from, see dap_ctx_object
+    struct dcmd *cmds;      // recorded commands
+    size_t ncmds;
+    size_t size;
+    uint32_t ndropped;      // commands dropped when the buffer could not grow
+    uint32_t id;            // number of the context in a trace, from 1 in order of creation
+} DAP_CTX;
+
+// 8 bit indexed framebuffer, see dap_indexed_create
+typedef struct dindexed {
+    int w, h;
+    int ncolors;        // palette entries in use
+    ALLEGRO_BITMAP *index;  // palette index of each pixel, single channel memory bitmap
+    ALLEGRO_BITMAP *argb;   // expanded frame, drawn by dap_indexed_present
+    ALLEGRO_COLOR palette[INDEXED_COLORS];  // colour each entry is displayed with
+    ALLEGRO_COLOR keys[INDEXED_COLORS];     // colour each entry was taken for, never changes
+    uint32_t lut[INDEXED_COLORS];   // palette as ARGB 8888 pixels
+} DAP_INDEXED;
+
+// drop policy of a capture pool when every buffer is taken
+enum CAPTURE_DROP {
+    CAPTURE_DROP_NEWEST,    // skip the new capture
+    CAPTURE_DROP_OLDEST,    // reuse the buffer of the oldest capture not yet encoding
+};
+
+// capture waiting to be encoded
+typedef struct dcapjob {
+    int buf;            // pool buffer holding the pixels
+    uint32_t n;         // capture number, used in the file name
+} DAP_CAPTURE_JOB;
+
+// frame capture pool and its encoder thread, see dap_capture_create
+typedef struct dcapture {
+    char *pattern;      // printf pattern of the file names
+    int policy;         // enum CAPTURE_DROP
+    int nbufs;
+    ALLEGRO_BITMAP **bufs;  // memory bitmap buffers
+    int *free;          // free buffer indices, guarded by mutex like the fields below
+    int nfree;
+    DAP_CAPTURE_JOB *jobs;  // ring of queued captures, oldest at head
+    int head;
+    int njobs;
+    uint32_t next;      // number of the next capture
+    uint32_t nsaved;
+    uint32_t ndropped;
+    uint32_t nfailed;
+    ALLEGRO_THREAD *thread;
+    ALLEGRO_MUTEX *mutex;
+    ALLEGRO_COND *cond;
+} DAP_CAPTURE;
+
+// draw command, a copy of the object taken when the command was submitted
+// raster data is not copied, it must stay mapped until the command is drawn
+typedef struct dcmd {
+    int op;             // valid values are in enum DAP_CMD_OP
+    ALLEGRO_COLOR color;    // clear color
+    DAP_FRAME_PACER *pacer; // flip, pacer to record the frame in or NULL
+    double deadline;    // flip, deadline of the frame
+    DAP_WINDOW **wins;  // compose, windows in stacking order, bottom first
+    int nwins;
+    DAP_CAPTURE *capture;   // capture, pool to snapshot the frame into
+    DAP_VIEW view;      // view, the identity ends the view
+    DAP_FREEZE *freeze; // frozen group to draw
+    GRAPH_OBJ obj;
+} DAP_CMD;
+
+typedef struct dslot {
+    uint32_t seq;       // slot sequence number, accessed atomically
+    DAP_CMD cmd;
+} DAP_SLOT;
+
+// bounded lock-free command ring, any number of threads submit and the render thread drains it
+typedef struct dqueue {
+    DAP_SLOT *slots;
+    uint32_t mask;      // number of slots - 1
+    uint32_t head __attribute__((aligned(64)));    // next slot to submit to, shared by submitting threads
+    uint32_t tail __attribute__((aligned(64)));    // next slot to draw, render thread only
+    int sleeping __attribute__((aligned(64)));     // true while the render thread waits for commands
+    ALLEGRO_DISPLAY *display;
+    ALLEGRO_THREAD *thread;
+    ALLEGRO_MUTEX *mutex;
+    ALLEGRO_COND *cond;
+    uint64_t ncmds;     // commands drawn, render thread only
+    uint64_t nflips;    // frames flipped, render thread only
+} DAP_QUEUE;
+
+// compact record style bits
+#define CSTYLE_BORDER_MASK  0x03    // enum GBORDER
+#define CSTYLE_FILL_SHIFT   2
+#define CSTYLE_FILL_MASK    0x0C    // enum GFILL
+#define CSTYLE_CLIP         0x10
+#define CSTYLE_INVERT       0x20
+#define CSTYLE_OVERLAY      0x40
+#define CSTYLE_ERASE        0x80
+
+// compact records, whole pixel coordinates, colours are scene palette indexes
+typedef struct dcline {
+    int16_t x0, y0, x1, y1;
+    uint16_t pattern;
+    uint8_t style;      // CSTYLE_* bits
+    uint8_t fg, bg;
+} DAP_CLINE;
+
+typedef struct dcrect {
+    int16_t x0, y0, x1, y1;
+    uint16_t pattern;
+    uint8_t style;
+    uint8_t fg, bg;
+} DAP_CRECT;
+
+typedef struct dccirc {
+    int16_t x, y, radius;
+    uint16_t pattern;
+    uint8_t style;
+    uint8_t fg, bg;
+} DAP_CCIRCLE;
+
+typedef struct dcrast {
+    int16_t x, y;
+    uint16_t width;     // raster width in pixels
+    uint8_t style;
+    uint8_t fg, bg;
+    uint32_t length;    // raster data bytes
+    uint64_t data;      // raster data, an offset from the start of a scene file or an address
+} DAP_CRASTER;
+
+// arena block, records are carved from it and only freed with the whole arena
+typedef struct dblock {
+    struct dblock *next;
+    uint8_t data[] __attribute__((aligned(16)));
+} DAP_BLOCK;
+
+typedef struct darena {
+    DAP_BLOCK *first;   // blocks, in allocation order
+    DAP_BLOCK *cur;     // block being carved
+    size_t used;        // bytes carved from cur
+    size_t nblocks;
+} DAP_ARENA;
+
+// chunk of records of one type, contiguous in an arena block
+typedef struct dchunk {
+    struct dchunk *next;
+    uint32_t n;         // records in the chunk
+    uint8_t recs[] __attribute__((aligned(8)));
+} DAP_CHUNK;
+
+// records of one type
+typedef struct dpool {
+    size_t size;        // record size, 0 if the type has no compact record
+    size_t count;
+    DAP_CHUNK *first;
+    DAP_CHUNK *last;
+} DAP_POOL;
+
+// scene of compact records, one pool per object type
+typedef struct dcscene {
+    DAP_ARENA arena;
+    DAP_POOL pools[TYPE_MAX];
+    ALLEGRO_COLOR palette[SCENE_PALETTE_SIZE];
+    int ncolors;
+} DAP_SCENE;
+
+// scene file header, at offset 0, native little endian
+// sections are indexed by enum GTYPE, offsets are from the start of the file
+typedef struct dfsect {
+    uint32_t offset;    // 16 byte aligned
+    uint32_t count;
+    uint32_t size;      // record size, must match the record of this build
+    uint32_t reserved;
+} DAP_FILE_SECTION;
+
+typedef struct dfhdr {
+    uint32_t magic;     // SCENE_FILE_MAGIC
+    uint32_t version;   // SCENE_FILE_VERSION
+    uint32_t length;    // file length
+    uint32_t palette;   // offset of SCENE_PALETTE_SIZE ALLEGRO_COLORs
+    DAP_FILE_SECTION sections[SCENE_FILE_SECTIONS];
+} DAP_FILE_HEADER;
+
+// mapped scene file
+typedef struct dsfile {
+    uint8_t *base;
+    size_t length;
+    DAP_FILE_HEADER *hdr;
+} DAP_SCENE_FILE;
+
+// traced calls, the argument types of each are in trace_calls
+// new calls go at the end, so traces of earlier versions replay unchanged
+enum DAP_TRACE_CALL {
+    TRACE_SET_GRAPH_TYPE,
+    TRACE_SET_GRAPH_COLOR,
+    TRACE_SET_GRAPH_COLOR_MODE,
+    TRACE_SET_GRAPH_STYLE_PATTERN,
+    TRACE_SET_GRAPH_STYLE_CLIP,
+    TRACE_SET_GRAPH_STYLE_FILL,
+    TRACE_SET_GRAPH_STYLE_BORDER,
+    TRACE_SET_GRAPH_STYLE,
+    TRACE_SET_CIRCLE,
+    TRACE_SET_RECTANGLE,
+    TRACE_SET_LINE,
+    TRACE_SET_RASTER_DATA,  // also records dap_set_raster_file, with the mapped data
+    TRACE_SET_TEXT,
+    TRACE_SET_TEXT_SCALE,
+    TRACE_DRAW_RASTER,
+    TRACE_DRAW_LINE,
+    TRACE_DRAW_RECTANGLE_FILL,
+    TRACE_DRAW_CIRCLE_FILL,
+    TRACE_DRAW_CIRCLE_BORDER,
+    TRACE_DRAW_RECTANGLE_BORDER,
+    TRACE_DRAW_TEXT,
+    TRACE_CLEAR,
+    TRACE_FLIP,
+    TRACE_CIRCLE_BATCH_BEGIN,
+    TRACE_CIRCLE_BATCH_END,
+    TRACE_SET_GRAPH_STYLE_WIDTH,
+    TRACE_SET_RASTER_TRANSFORM,
+    TRACE_UPDATE_RASTER,
+    TRACE_SET_POLYGON,
+    TRACE_DRAW_POLYGON,
+    TRACE_CTX_OBJECT,       // the dap_ctx_* calls name their context by DAP_CTX id
+    TRACE_CTX_DRAW,         // a dap_ctx_draw_* call, recorded with the TRACE_DRAW_* call it stands for
+    TRACE_CTX_CLEAR,
+    TRACE_CTX_SET_VIEW,
+    TRACE_CTX_SUBMIT,
+    TRACE_MAX,
+};
+
+// trace file record, followed by len bytes of arguments
+typedef struct dtrec {
+    uint16_t call;      // valid values are in enum DAP_TRACE_CALL
+    uint16_t obj;       // object id, 0 for calls without an object
+    uint32_t len;
+    uint64_t time;      // nanoseconds since the trace started
+} DAP_TRACE_REC;
+
+// trace recorder
+typedef struct dtrace {
+    FILE *f;
+    double start;
+    uint64_t ncalls;
+    uint64_t ndropped;  // calls on objects past TRACE_MAX_OBJECTS
+    uint32_t nobjs;
+    GRAPH_OBJ *objs[2 * TRACE_MAX_OBJECTS];    // open addressed object table
+    uint16_t ids[2 * TRACE_MAX_OBJECTS];
+} DAP_TRACE;
+
+// active trace recorder, NULL when not tracing
+static DAP_TRACE *trace_rec;
+
+// record a call when tracing, the arguments are those of the traced function
+#define TRACE(call, go, ...) do { if (trace_rec != NULL) { trace_call(call, go, ##__VA_ARGS__); } } while (0)
+
+// record a draw call when tracing, in a context it is replayed when the context is submitted
+#define TRACE_DRAW(ctx, call, go) do { if (trace_rec != NULL) { \
+    if ((ctx) == NULL) { trace_call(call, go); } else { trace_call(TRACE_CTX_DRAW, go, (int)(ctx)->id, call); } \
+} } while (0)
+
 // prototypes
 int dap_open_raster_file(GRAPH_OBJ *go, char *filename);
+static void raster_cancel(GRAPH_OBJ *go);
 void dap_draw_line(GRAPH_OBJ *go);
+static void bind_kernels(GRAPH_OBJ *go);
+static void geom_changed(GRAPH_OBJ *go);
+static void thread_buffers_keep(void);
+static void draw_or_queue(GRAPH_OBJ *go, int op);
+static void ctx_draw(DAP_CTX *ctx, GRAPH_OBJ *go, int op);
+static void frame_presented(DAP_FRAME_PACER *fp, double deadline);
+static void compose_windows(DAP_WINDOW **wins, int n);
+static void circle_batch(bool on);
+static __thread bool view_on;               // a view other than the identity is set on the thread
+static bool view_identity(DAP_VIEW *v);
+static void view_set(DAP_VIEW *v);
+static void view_use(bool vector);
+static void view_draw(GRAPH_OBJ *go, int op);
+void dap_freeze_draw(DAP_FREEZE *fz);
+static __thread DAP_FREEZE *freeze_rec;     // frozen group the kernels of the thread record into, or NULL
+static void freeze_quad(ALLEGRO_VERTEX *a, ALLEGRO_VERTEX *b, ALLEGRO_VERTEX *c, ALLEGRO_VERTEX *d);
+static void freeze_line(float x0, float y0, float x1, float y1, ALLEGRO_COLOR c);
+static void freeze_pixel(int x, int y, ALLEGRO_COLOR c);
+static void freeze_circle(float x, float y, float r, ALLEGRO_COLOR c);
+static int capture_frame(DAP_CAPTURE *cap);
+void dap_capture_destroy(DAP_CAPTURE *cap);
+static void trace_call(int call, GRAPH_OBJ *go, ...);
+static void trace_ctx_submit(DAP_CTX **ctxs, int n);
+void dap_clear(ALLEGRO_COLOR c);
+void dap_flip(void);
+void dap_circle_batch_begin(void);
+void dap_circle_batch_end(void);
+void dap_draw_polygon(GRAPH_OBJ *go);
+void dap_ctx_draw_line(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_rectangle_fill(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_circle_fill(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_circle_border(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_rectangle_border(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_circle(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_rectangle(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_text(DAP_CTX *ctx, GRAPH_OBJ *go);
+void dap_ctx_draw_polygon(DAP_CTX *ctx, GRAPH_OBJ *go);
+int dap_ctx_draw_raster(DAP_CTX *ctx, GRAPH_OBJ *go);
+static ALLEGRO_COLOR indexed_color(ALLEGRO_COLOR c);
+static __thread DAP_INDEXED *indexed_target;    // indexed framebuffer the thread draws into, or NULL
+void dap_indexed_destroy(DAP_INDEXED *ix);
+
+
+
+// convert float to fixed point, rounding to nearest
+// magnitudes past FIX_LIMIT are clamped to it, so they never wrap
+static inline GFIXED fix_from_float(float f) {
+
+    f = f < FIX_LIMIT ? f : FIX_LIMIT;
+    f = f > -FIX_LIMIT ? f : -FIX_LIMIT;
+    return (GFIXED)lrintf(f * (float)FIX_ONE);
+}
+
+// convert fixed point to float
+static inline float fix_to_float(GFIXED f) {
+    return (float)f / (float)FIX_ONE;
+}
+
+// integer part of a fixed point value, rounded towards minus infinity
+static inline int fix_to_int(int64_t f) {
+    return (int)(f >> FIX_SHIFT);
+}
+
+// integer square root, floor(sqrt(v))
+// the square root of a 32.32 fixed point value is a 16.16 fixed point value
+static uint32_t isqrt64(uint64_t v) {
 
+    uint64_t r = 0;
+    uint64_t b = (uint64_t)1 << 62;
 
+    while (b > v) {
+        b >>= 2;
+    }
+    while (b != 0) {
+        if (v >= r + b) {
+            v -= r + b;
+            r = (r >> 1) + b;
+        }
+        else {
+            r >>= 1;
+        }
+        b >>= 2;
+    }
+    return (uint32_t)r;
+}
 
 // texture mask
 uint16_t texture_mask(GRAPH_OBJ *go, float x, float y) {
@@ -150,23 +688,46 @@ void dap_set_graph_type(GRAPH_OBJ *go, int gt) {
 
     assert(go != NULL);
     assert(gt < TYPE_MAX);
+    TRACE(TRACE_SET_GRAPH_TYPE, go, gt);
+    if (gt != go->gtype) {
+        raster_cancel(go);
+    }
     go->gtype = gt;
+    geom_changed(go);
+    bind_kernels(go);
 }
 
 // set graphics colors
 void dap_set_graph_color(GRAPH_OBJ *go, bool invert, ALLEGRO_COLOR fgc, ALLEGRO_COLOR bgc) {
 
     assert(go != NULL);
+    TRACE(TRACE_SET_GRAPH_COLOR, go, invert, fgc, bgc);
     go->gc.invert = invert;
     memcpy(&go->gc.fg, &fgc, sizeof(ALLEGRO_COLOR));
     memcpy(&go->gc.bg, &bgc, sizeof(ALLEGRO_COLOR));
+    geom_changed(go);
+    bind_kernels(go);
+}
+
+// set graphics color write mode
+// overlay writes only the foreground color, erase writes only the background color
+void dap_set_graph_color_mode(GRAPH_OBJ *go, bool overlay, bool erase) {
+
+    assert(go != NULL);
+    TRACE(TRACE_SET_GRAPH_COLOR_MODE, go, overlay, erase);
+    go->gc.overlay = overlay;
+    go->gc.erase = erase;
+    geom_changed(go);
+    bind_kernels(go);
 }
 
 // set graphic style hash pattern
 void dap_set_graph_style_pattern(GRAPH_OBJ *go, uint16_t pattern) {
 
     assert(go != NULL);
+    TRACE(TRACE_SET_GRAPH_STYLE_PATTERN, go, pattern);
     go->gs.pattern = pattern;
+    geom_changed(go);
 }
 
 // get graphic style hash pattern
@@ -180,7 +741,9 @@ uint16_t dap_get_graph_style_pattern(GRAPH_OBJ *go) {
 void dap_set_graph_style_clip(GRAPH_OBJ *go, bool clip) {
 
     assert(go != NULL);
+    TRACE(TRACE_SET_GRAPH_STYLE_CLIP, go, clip);
     go->gs.clip = clip;
+    geom_changed(go);
 }
 
 // set graphic style fill, type of fill for circle and rectangles
@@ -188,7 +751,10 @@ void dap_set_graph_style_fill(GRAPH_OBJ *go, int filltype) {
 
     assert(go != NULL);
     assert(filltype < FILL_MAX);
+    TRACE(TRACE_SET_GRAPH_STYLE_FILL, go, filltype);
     go->gs.fill = filltype;
+    geom_changed(go);
+    bind_kernels(go);
 }
 
 // set graphic style border, type of border for circle and rectangles
@@ -196,7 +762,22 @@ void dap_set_graph_style_border(GRAPH_OBJ *go, int bordertype) {
 
     assert(go != NULL);
     assert(bordertype < BORDER_MAX);
+    TRACE(TRACE_SET_GRAPH_STYLE_BORDER, go, bordertype);
     go->gs.border = bordertype;
+    geom_changed(go);
+    bind_kernels(go);
+}
+
+// set graphic style stroke width in pixels, of lines and of circle, rectangle and polygon borders
+// widths of 0 and 1 draw the one pixel lines
+void dap_set_graph_style_width(GRAPH_OBJ *go, int width) {
+
+    assert(go != NULL);
+    assert(width >= 0);
+    TRACE(TRACE_SET_GRAPH_STYLE_WIDTH, go, width);
+    go->gs.width = width;
+    geom_changed(go);
+    bind_kernels(go);
 }
 
 // set graphic style
@@ -205,42 +786,57 @@ void dap_set_graph_style(GRAPH_OBJ *go, int gb, int gf, uint16_t pattern) {
     assert(go != NULL);
     assert(gf < FILL_MAX);
     assert(gb < BORDER_MAX);
+    TRACE(TRACE_SET_GRAPH_STYLE, go, gb, gf, pattern);
 
     go->gs.border = (int)gb;
     go->gs.fill = (int)gf;
     go->gs.pattern = pattern;
+    bind_kernels(go);
+    geom_changed(go);
 }
 
 // set circle
 void dap_set_circle(GRAPH_OBJ *go, float x, float y, float r) {
 
     assert(go != NULL);
-    go->gcirc.x = x;
-    go->gcirc.y = y;
-    go->gcirc.radius = r;
+    TRACE(TRACE_SET_CIRCLE, go, x, y, r);
+    raster_cancel(go);
+    go->gcirc.x = fix_from_float(x);
+    go->gcirc.y = fix_from_float(y);
+    go->gcirc.radius = fix_from_float(r);
     go->gtype = TYPE_CIRCLE;
+    bind_kernels(go);
+    geom_changed(go);
 }
 
 // set rectangle
 void dap_set_rectangle(GRAPH_OBJ *go, float x0, float y0, float x1, float y1) {
 
     assert(go != NULL);
-    go->grect.x0 = x0;
-    go->grect.y0 = y0;
-    go->grect.x1 = x1;
-    go->grect.y1 = y1;
+    TRACE(TRACE_SET_RECTANGLE, go, x0, y0, x1, y1);
+    raster_cancel(go);
+    go->grect.x0 = fix_from_float(x0);
+    go->grect.y0 = fix_from_float(y0);
+    go->grect.x1 = fix_from_float(x1);
+    go->grect.y1 = fix_from_float(y1);
     go->gtype = TYPE_RECTANGLE;
+    bind_kernels(go);
+    geom_changed(go);
 }
 
 // set line
 void dap_set_line(GRAPH_OBJ *go, float x0, float y0, float x1, float y1) {
 
     assert(go != NULL);
-    go->gline.x0 = x0;
-    go->gline.y0 = y0;
-    go->gline.x1 = x1;
-    go->gline.y1 = y1;
+    TRACE(TRACE_SET_LINE, go, x0, y0, x1, y1);
+    raster_cancel(go);
+    go->gline.x0 = fix_from_float(x0);
+    go->gline.y0 = fix_from_float(y0);
+    go->gline.x1 = fix_from_float(x1);
+    go->gline.y1 = fix_from_float(y1);
     go->gtype = TYPE_LINE;
+    bind_kernels(go);
+    geom_changed(go);
 }
 
 // set raster file
@@ -252,13 +848,23 @@ int dap_set_raster_file(GRAPH_OBJ *go, char *filename, float x0, float y0, int w
     assert(filename != NULL);
     int r;
 
+    raster_cancel(go);
     go->gtype = TYPE_RASTER;
-    go->grast.x = x0;
-    go->grast.y = y0;
+    go->grast.x = fix_from_float(x0);
+    go->grast.y = fix_from_float(y0);
     go->grast.width = width; // width of screen
-
-    // open file and map into memory
+    go->grast.offset = 0;
+    go->grast.load = NULL;
+    go->grast.owned = false;
+    go->grast.affine = false;
+    geom_changed(go);
+    bind_kernels(go);
+
+    // open file and map into memory, traced as the mapped data so a replay needs no file
     r = dap_open_raster_file(go, filename);
+    if (r == 0) {
+        TRACE(TRACE_SET_RASTER_DATA, go, x0, y0, width, go->grast.rdataptr, go->grast.fdlength);
+    }
     return r;
 }
 
@@ -270,892 +876,7853 @@ void dap_set_raster_data(GRAPH_OBJ *go, float x0, float y0, int width, uint8_t *
     assert(rptr != NULL);
     assert(len > 0);
     assert(width > 0);
+    TRACE(TRACE_SET_RASTER_DATA, go, x0, y0, width, rptr, len);
 
+    raster_cancel(go);
     go->gtype = TYPE_RASTER;
+    go->grast.fd = -1;
     go->grast.rdataptr = rptr;
     go->grast.fdlength = len;
-    go->grast.x = x0;
-    go->grast.y = y0;
+    go->grast.x = fix_from_float(x0);
+    go->grast.y = fix_from_float(y0);
     go->grast.width = width;
+    go->grast.offset = 0;
+    go->grast.load = NULL;
+    go->grast.owned = false;
+    go->grast.affine = false;
+    geom_changed(go);
+    bind_kernels(go);
 }
 
-// draws a vertical line using pixel primatives, to facilitate wrapping and clipping
-// helper function for drawing vertical bars
-void draw_vert_line(float x, float y0, float y1, ALLEGRO_COLOR fg) {
+// set raster transform, the raster is scaled by sx and sy then turned by angle radians
+// about its top left corner, rows still wrap at the width given when the raster was set
+// a raster is drawn 1:1 from dap_set_raster_data or dap_set_raster_file until this is called
+void dap_set_raster_transform(GRAPH_OBJ *go, float sx, float sy, float angle) {
 
-    int i, dy;
+    assert(go != NULL);
+    assert(go->gtype == TYPE_RASTER);
+    assert(sx > 0 && sy > 0);
+    TRACE(TRACE_SET_RASTER_TRANSFORM, go, sx, sy, angle);
+
+    go->grast.sx = sx;
+    go->grast.sy = sy;
+    go->grast.angle = angle;
+    go->grast.affine = sx != 1 || sy != 1 || angle != 0;
+    geom_changed(go);
+    bind_kernels(go);
+}
 
-    if (y1 > y0) {
-        dy = (int)(y1 - y0);
-        for (i = 0; i < dy; i++) {
-            al_draw_pixel(x, y0+i, fg);
-        }
-    }
-    else if (y1 < y0) {
-        dy = (int)(y0 - y1);
-        for (i = 0; i < dy; i++) {
-            al_draw_pixel(x, y1+i, fg);
-        }
-    }
+// set text
+// the string is not copied, it must stay valid until the text is drawn
+void dap_set_text(GRAPH_OBJ *go, float x, float y, char *str) {
+
+    assert(go != NULL);
+    assert(str != NULL);
+    TRACE(TRACE_SET_TEXT, go, x, y, str);
+    raster_cancel(go);
+
+    go->gtext.x = fix_from_float(x);
+    go->gtext.y = fix_from_float(y);
+    go->gtext.scale = 1;
+    go->gtext.str = str;
+    go->gtype = TYPE_TEXT;
+    bind_kernels(go);
+    geom_changed(go);
 }
 
-// fill circle with vertical bars
-void circle_fill_vertbar(GRAPH_OBJ *go) {
+// set text scale, each glyph pixel is drawn scale pixels wide and high
+void dap_set_text_scale(GRAPH_OBJ *go, int scale) {
 
-    int i;
-    int n, m;
-    uint16_t tmask;
-    float posyt, posyb, posxs, posx, dy, r;
-
-    tmask = STARTING_TEXTURE_MASK;
-    r = go->gcirc.radius;
-    posyt = go->gcirc.y;
-    posyb = go->gcirc.y;
-    posxs = go->gcirc.x - r;
-    posx = posxs;
-    n = (int)(2 * r);
+    assert(go != NULL);
+    assert(scale > 0);
+    TRACE(TRACE_SET_TEXT_SCALE, go, scale);
+    go->gtext.scale = scale;
+    geom_changed(go);
+}
 
-    for (i = 0; i < n; i++) {
+// set polygon, n points at x, y plus the pairs in pts, closed from the last point to the first
+// the points are not copied, they must stay valid until the polygon is drawn
+void dap_set_polygon(GRAPH_OBJ *go, float x, float y, float *pts, int n) {
 
-        m = i % NUM_OF_TEXTURE_BITS;
-        if (m == 0) {
-            tmask = STARTING_TEXTURE_MASK;
-        }
+    assert(go != NULL);
+    assert(pts != NULL);
+    assert(n > 0);
+    TRACE(TRACE_SET_POLYGON, go, x, y, pts, (size_t)n * 2 * sizeof(float));
+    raster_cancel(go);
+
+    go->gpoly.x = fix_from_float(x);
+    go->gpoly.y = fix_from_float(y);
+    go->gpoly.n = n;
+    go->gpoly.pts = pts;
+    go->gtype = TYPE_POLYGON;
+    bind_kernels(go);
+    geom_changed(go);
+}
 
-        // calculate the start and end of a vertical line to use for texture
-        // circle equation: (x-x1)^2 + (y-y1)^2 = r^2
-        // x1, y1 is the center of the circle and r is the radius
-        // solve for y top and bottom for a series of x values
-        posyb = sqrtf(powf(r,2) - powf((posx - go->gcirc.x),2)) + go->gcirc.y;
-        posyt = go->gcirc.y - (posyb - go->gcirc.y);
-        dy = posyb - posyt;
+// Text
+//
+// Text objects are drawn from a glyph atlas: every printable ASCII glyph of
+// the builtin font rasterised once into a bitmap, plus one solid cell used for
+// the character backgrounds. A string becomes one textured triangle list,
+// a background quad and a glyph quad per character, drawn with a single
+// al_draw_prim call. There is one atlas for video targets and one for memory
+// targets, each built the first time text is drawn to that kind of target.
+// Contexts draw text on worker threads, so the font and the atlases are set
+// up under text_lock.
+
+static pthread_mutex_t text_lock = PTHREAD_MUTEX_INITIALIZER;
+static ALLEGRO_FONT *text_font;
+static ALLEGRO_BITMAP *text_atlas[2];   // indexed by true for memory bitmap targets, accessed atomically
+static int text_cell_w, text_cell_h;    // glyph cell size in pixels
+
+// initialise text drawing, call once after al_init
+// returns 0 if success, otherwise -1
+int dap_text_init(void) {
 
-        if (go->gs.pattern & tmask) {
-            if (dy > 0) {
-                draw_vert_line(posx, posyt, posyb, go->gc.fg);
-            }
+    int r = 0;
+
+    pthread_mutex_lock(&text_lock);
+    if (text_font == NULL) {
+        al_init_font_addon();
+        text_font = al_create_builtin_font();
+        if (text_font == NULL) {
+            r = -1;
         }
         else {
-            if (dy > 0) {
-                draw_vert_line(posx, posyt, posyb, go->gc.bg);
-            }
+            text_cell_w = al_get_text_width(text_font, "W");
+            text_cell_h = al_get_font_line_height(text_font);
         }
-
-        tmask = tmask >> 1;
-        posx = posxs + (float)i;
     }
+    pthread_mutex_unlock(&text_lock);
+    return r;
 }
 
-// fill circle with texture pattern
-void circle_fill_pattern(GRAPH_OBJ *go) {
+// atlas position of a glyph cell, the solid cell follows the printable glyphs
+static void text_cell(int c, float *u, float *v) {
 
-    int i, r;
-    int n, q;
-    uint16_t tmask;
-    float posyt, posyb, posxs, posx, posy, dy, rad;
+    int i = c - TEXT_FIRST_CHAR;
 
-    rad = go->gcirc.radius;
-    posyt = go->gcirc.y;
-    posyb = go->gcirc.y;
-    posxs = go->gcirc.x - rad;
-    posx = posxs;
-    n = (int)(2 * rad);
+    *u = (float)((i % TEXT_ATLAS_COLS) * text_cell_w);
+    *v = (float)((i / TEXT_ATLAS_COLS) * text_cell_h);
+}
 
-    for (i = 0; i <= n; i++) {
+// get the glyph atlas for the current target, building it the first time
+// returns NULL if there is no font or the atlas cannot be made
+static ALLEGRO_BITMAP *text_get_atlas(void) {
 
-        // calculate the start and end of a vertical line to use for texture
-        // circle equation: (x-x1)^2 + (y-y1)^2 = r^2
-        // x1, y1 is the center of the circle and r is the radius
-        // solve for y top and bottom for a series of x values
-        posyb = sqrtf(powf(rad,2) - powf((posx - go->gcirc.x),2)) + go->gcirc.y;
-        posyt = go->gcirc.y - (posyb - go->gcirc.y);
-        dy = posyb - posyt;
+    int c, flags, mem;
+    float u, v;
+    ALLEGRO_BITMAP *target, *atlas;
 
-        q = (int)(dy);
-        for (r = 0; r <= q; r++) {
+    target = al_get_target_bitmap();
+    mem = (al_get_bitmap_flags(target) & ALLEGRO_MEMORY_BITMAP) != 0;
+    atlas = __atomic_load_n(&text_atlas[mem], __ATOMIC_ACQUIRE);
+    if (atlas != NULL) {
+        return atlas;
+    }
 
-            posy = (float)r + posyt;
-            tmask = texture_mask(go, posx, posy);
+    // another thread may have built it while this one waited
+    pthread_mutex_lock(&text_lock);
+    if (text_font == NULL || text_atlas[mem] != NULL) {
+        atlas = text_atlas[mem];
+        pthread_mutex_unlock(&text_lock);
+        return atlas;
+    }
 
-            if (go->gs.pattern & tmask) {
-                al_draw_pixel(posx, posy, go->gc.fg);
-            }
-            else {
-                al_draw_pixel(posx, posy, go->gc.bg);
-            }
+    // white glyphs on a transparent background, tinted by the vertex colors
+    flags = al_get_new_bitmap_flags();
+    al_set_new_bitmap_flags(mem ? ALLEGRO_MEMORY_BITMAP : ALLEGRO_VIDEO_BITMAP);
+    atlas = al_create_bitmap(TEXT_ATLAS_COLS * text_cell_w,
+                             (TEXT_SOLID_CELL - TEXT_FIRST_CHAR) / TEXT_ATLAS_COLS * text_cell_h + text_cell_h);
+    al_set_new_bitmap_flags(flags);
+    if (atlas == NULL) {
+        pthread_mutex_unlock(&text_lock);
+        return NULL;
+    }
 
-        }
+    al_set_target_bitmap(atlas);
+    al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+    for (c = TEXT_FIRST_CHAR; c < TEXT_SOLID_CELL; c++) {
+        text_cell(c, &u, &v);
+        al_draw_glyph(text_font, al_map_rgb(255, 255, 255), u, v, c);
+    }
+    text_cell(TEXT_SOLID_CELL, &u, &v);
+    al_draw_filled_rectangle(u, v, u + text_cell_w, v + text_cell_h, al_map_rgb(255, 255, 255));
+    al_set_target_bitmap(target);
+
+    __atomic_store_n(&text_atlas[mem], atlas, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&text_lock);
+    return atlas;
+}
+
+// vertex buffer for text strings, grown as needed, one per drawing thread
+static __thread ALLEGRO_VERTEX *text_vtx;
+static __thread size_t text_vtx_size;
 
-        posx = posxs + (float)i;
+// get room for n text vertices
+static ALLEGRO_VERTEX *text_vertices(size_t n) {
 
+    ALLEGRO_VERTEX *v;
+
+    if (n > text_vtx_size) {
+        thread_buffers_keep();
+        v = realloc(text_vtx, n * sizeof(ALLEGRO_VERTEX));
+        if (v == NULL) {
+            return NULL;
+        }
+        text_vtx = v;
+        text_vtx_size = n;
     }
+    return text_vtx;
 }
 
-// fill circle with solid fill
-void circle_fill_solid(GRAPH_OBJ *go) {
+// add a textured quad, as two triangles, to a vertex list
+static ALLEGRO_VERTEX *text_quad(ALLEGRO_VERTEX *v, float x, float y, float w, float h,
+                                 float u, float t, float uw, float th, ALLEGRO_COLOR c) {
 
-    int i, r;
-    int n, q;
-    float posyt, posyb, posxs, posx, posy, dy, rad;
-
-    rad = go->gcirc.radius;
-    posyt = go->gcirc.y;
-    posyb = go->gcirc.y;
-    posxs = go->gcirc.x - rad;
-    posx = posxs;
-    n = (int)(2 * rad);
+    ALLEGRO_VERTEX q[4] = {
+        {x, y, 0, u, t, c},
+        {x + w, y, 0, u + uw, t, c},
+        {x + w, y + h, 0, u + uw, t + th, c},
+        {x, y + h, 0, u, t + th, c},
+    };
 
-    for (i = 0; i <= n; i++) {
+    v[0] = q[0];
+    v[1] = q[1];
+    v[2] = q[2];
+    v[3] = q[0];
+    v[4] = q[2];
+    v[5] = q[3];
+    return v + 6;
+}
 
-        // calculate the start and end of a vertical line to use for texture
-        // circle equation: (x-x1)^2 + (y-y1)^2 = r^2
-        // x1, y1 is the center of the circle and r is the radius
-        // solve for y top and bottom for a series of x values
-        posyb = sqrtf(powf(rad,2) - powf((posx - go->gcirc.x),2)) + go->gcirc.y;
-        posyt = go->gcirc.y - (posyb - go->gcirc.y);
-        dy = posyb - posyt;
+// Dashed circles
+//
+// Dashed circle borders are built as one line list from a shared table of
+// CIRCLE_TABLE_SIZE points on the unit circle, and drawn with one
+// al_draw_prim call. A circle gets one dash about every PIX_PER_DASH pixels
+// of its circumference, an even number so the dashes alternate all the way
+// round, and each dash is drawn as segments of about CIRCLE_SEG_PIXELS.
+// Between dap_circle_batch_begin and dap_circle_batch_end the dashed borders
+// of every circle are gathered and drawn in one call at the end, on top of
+// whatever was drawn in between.
+
+static float circle_cos[CIRCLE_TABLE_SIZE];
+static float circle_sin[CIRCLE_TABLE_SIZE];
+static pthread_once_t circle_once = PTHREAD_ONCE_INIT;
+
+// dashed circle vertices of a drawing thread, grown as needed
+static __thread ALLEGRO_VERTEX *dash_vtx;
+static __thread size_t dash_vtx_size;
+static __thread size_t dash_vtx_n;      // vertices waiting to be drawn
+static __thread bool dash_batch;        // true while gathering a batch
+
+// fill the unit circle table
+static void circle_table_init(void) {
 
-        q = (int)(dy);
-        for (r = 0; r <= q; r++) {
+    int i;
 
-            posy = (float)r + posyt;
-            al_draw_pixel(posx, posy, go->gc.fg);
-        }
-        posx = posxs + (float)i;
+    for (i = 0; i < CIRCLE_TABLE_SIZE; i++) {
+        circle_cos[i] = cosf(RAD_PER_CIRCLE * i / CIRCLE_TABLE_SIZE);
+        circle_sin[i] = sinf(RAD_PER_CIRCLE * i / CIRCLE_TABLE_SIZE);
     }
 }
 
+// get room for n more dashed circle vertices after those waiting
+static ALLEGRO_VERTEX *dash_vertices(size_t n) {
 
-// add vertical bar pattern to a rectangle
-void rect_fill_vertbar(GRAPH_OBJ *go) {
+    size_t size;
+    ALLEGRO_VERTEX *v;
 
-    int i;
-    int n, m;
-    uint16_t tmask;
-    float posx0, posy0, posy1;
+    if (dash_vtx_n + n > dash_vtx_size) {
+        size = (dash_vtx_n + n) * 2;
+        thread_buffers_keep();
+        v = realloc(dash_vtx, size * sizeof(ALLEGRO_VERTEX));
+        if (v == NULL) {
+            return NULL;
+        }
+        dash_vtx = v;
+        dash_vtx_size = size;
+    }
+    return dash_vtx + dash_vtx_n;
+}
 
-    tmask = STARTING_TEXTURE_MASK;
-    n = (int)(go->grect.x1 - go->grect.x0);
-    posx0 = go->grect.x0;
-    posy0 = go->grect.y0;
-    posy1 = go->grect.y1;
+// draw the waiting dashed circle vertices, or record them as lines into a frozen group
+static void dash_flush(void) {
 
-    for (i = 0; i < n; i++) {
+    size_t i;
 
-        m = i % NUM_OF_TEXTURE_BITS;
-        if (m == 0) {
-            tmask = STARTING_TEXTURE_MASK;
+    if (freeze_rec != NULL) {
+        for (i = 0; i + 1 < dash_vtx_n; i += 2) {
+            freeze_line(dash_vtx[i].x, dash_vtx[i].y, dash_vtx[i + 1].x, dash_vtx[i + 1].y, dash_vtx[i].color);
         }
+        dash_vtx_n = 0;
+    }
+    if (dash_vtx_n > 0) {
+        al_draw_prim(dash_vtx, NULL, NULL, 0, (int)dash_vtx_n, ALLEGRO_PRIM_LINE_LIST);
+        dash_vtx_n = 0;
+    }
+}
 
-        if (go->gs.pattern & tmask) {
-            draw_vert_line(posx0, posy0, posy1, go->gc.fg);
-        }
-        else {
-            draw_vert_line(posx0, posy0, posy1, go->gc.bg);
-        }
+// start or end gathering dashed circle borders on this thread
+static void circle_batch(bool on) {
 
-        tmask = tmask >> 1;
-        posx0 = go->grect.x0 + (float)i;
+    if (!on) {
+        dash_flush();
     }
+    dash_batch = on;
 }
 
-// add texture pattern to a rectangle
-void rect_fill_pattern(GRAPH_OBJ *go) {
+// Geometry memos
+//
+// The kernels derive geometry from an object before drawing it: the dash ends
+// of a line, the pixels of a patterned line, the rows of a filled circle and
+// the points of a circle border. Every setter gives the object a new
+// generation from a global counter, and the derived geometry is kept in a
+// table of each drawing thread keyed by generation and kind, so redrawing an
+// unchanged object skips the square roots and divisions. The table is keyed by
+// generation rather than held in the object because objects are copied into
+// contexts and queues and drawn on other threads; a copy has the same
+// geometry, so it hits the same memo. Objects filled in without the setters,
+// such as scene records, have generation 0 and are never memoized.
+//
+// The table is direct mapped: a memo whose slot is taken by another object is
+// simply derived again on its next draw. A thread allocates its table on its
+// first memoized draw, so threads that never draw pay nothing, and the table
+// and its buffers are freed with the other thread buffers when it exits.
+
+enum GEOM {
+    GEOM_LINE_DASH,         // dash ends of a line, x, y floats
+    GEOM_LINE_PATTERN,      // pixels of a patterned line, x, y and pattern index ints
+    GEOM_CIRCLE_ROWS,       // spans of a filled circle, y, x0 and x1 ints
+    GEOM_CIRCLE_PATTERN,    // pixels of a patterned circle border, x, top, bottom and their pattern indices
+    GEOM_CIRCLE_DASH,       // segment ends of a dashed circle border, x, y floats
+    GEOM_KINDS,
+};
 
-    int r, c, n, q;
-    uint16_t tmask;
-    float posx, posy;
+typedef struct dgeom {
+    uint64_t gen;       // generation of the object it was derived from, 0 if none
+    int kind;           // valid values are in enum GEOM
+    int n;              // items, dashes, pixels or rows
+    int k;              // segments per dash of a dashed circle
+    size_t size;        // bytes allocated at data
+    void *data;
+} DAP_GEOM;
 
-    n = (int)(go->grect.x1 - go->grect.x0);
-    q = (int)(go->grect.y1 - go->grect.y0);
+#define GEOM_SCRATCH    (1 << GEOM_CACHE_BITS)  // table entry used for objects of generation 0
 
-    posx = go->grect.x0;
-    posy = go->grect.y0;
+static uint64_t geom_generation;
+static __thread DAP_GEOM *geom_table;   // GEOM_SCRATCH + 1 entries, NULL until the first memoized draw
 
-    for (r = 0; r < q; r++) {
-        for (c = 0; c < n; c++) {
+// give an object a new generation, its memos are no longer found
+static void geom_changed(GRAPH_OBJ *go) {
+    go->gen = __atomic_add_fetch(&geom_generation, GEOM_PARTS, __ATOMIC_RELAXED);
+}
 
-            tmask = texture_mask(go, posx, posy);
-            if (go->gs.pattern & tmask) {
-                al_draw_pixel(posx, posy, go->gc.fg);
-            }
-            else {
-                al_draw_pixel(posx, posy, go->gc.bg);
-            }
+// free the memo table of the thread and the geometry it holds
+static void geom_table_free(void) {
 
-            posx = go->grect.x0 + (float)c;
-        }
-        posy = go->grect.y0 + (float)r;
+    int i;
+
+    if (geom_table == NULL) {
+        return;
     }
+    for (i = 0; i <= GEOM_SCRATCH; i++) {
+        free(geom_table[i].data);
+    }
+    free(geom_table);
+    geom_table = NULL;
 }
 
-// add solid fill to a rectangle
-void rect_fill_solid(GRAPH_OBJ *go) {
+// memo of kind for an object, valid if it returns true, otherwise e is to be rebuilt
+// e is NULL if the table of the thread could not be allocated
+static bool geom_find(GRAPH_OBJ *go, int kind, DAP_GEOM **e) {
 
-    int r, c, n, q;
-    float posx, posy;
+    uint64_t h;
 
-    n = (int)(go->grect.x1 - go->grect.x0);
-    q = (int)(go->grect.y1 - go->grect.y0);
+    if (geom_table == NULL) {
+        thread_buffers_keep();
+        geom_table = calloc(GEOM_SCRATCH + 1, sizeof(DAP_GEOM));
+        if (geom_table == NULL) {
+            *e = NULL;
+            return false;
+        }
+    }
+    if (go->gen == 0) {
+        *e = &geom_table[GEOM_SCRATCH];
+        return false;
+    }
+    h = (go->gen * GEOM_KINDS + (uint64_t)kind) * 0x9e3779b97f4a7c15ull;
+    *e = &geom_table[h >> (64 - GEOM_CACHE_BITS)];
+    return (*e)->gen == go->gen && (*e)->kind == kind;
+}
 
-    posx = go->grect.x0;
-    posy = go->grect.y0;
+// get room for len bytes of a memo being rebuilt, it is invalid until geom_keep
+// returns a pointer to the data, NULL if out of memory
+static void *geom_alloc(DAP_GEOM *e, size_t len) {
 
-    for (r = 0; r < q; r++) {
-        for (c = 0; c < n; c++) {
+    void *p;
 
-            al_draw_pixel(posx, posy, go->gc.fg);
-            posx = go->grect.x0 + (float)c;
+    if (e == NULL) {
+        return NULL;
+    }
+    e->gen = 0;
+    if (len > e->size) {
+        p = realloc(e->data, len);
+        if (p == NULL) {
+            return NULL;
         }
-        posy = go->grect.y0 + (float)r;
+        e->data = p;
+        e->size = len;
     }
+    return e->data;
 }
 
-// draw a straight line using a texture pattern
-void line_pattern(GRAPH_OBJ *go) {
+// mark a rebuilt memo as the geometry of an object
+static void geom_keep(GRAPH_OBJ *go, int kind, DAP_GEOM *e, int n, int k) {
 
-    assert(go != NULL);
-    int i;
-    float l, m;
-    float dx, dy, dxn, dyn;
-    float xs, ys, xe, ye;
-    float x0, y0, x1, y1;
-    uint16_t mask;
+    e->gen = go->gen;
+    e->kind = kind;
+    e->n = n;
+    e->k = k;
+}
 
-    x0 = go->gline.x0;
-    y0 = go->gline.y0;
-    x1 = go->gline.x1;
-    y1 = go->gline.y1;
-
-    // determine length of line
-    l = sqrtf(powf((x1 - x0), (float)2) + powf((y1 - y0), (float)2));
-
-    dy = y1 - y0;
-    dx = x1 - x0;
-    xs = x0;
-    ys = y0;
-    for (i = 0; i < (int)l; i++) {
-
-        if (dy == 0) {
-            // slope is zero
-            if (x1 > x0) {
-                xe = xs + 1;
-                ye = ys;
-            }
-            else {
-                xe = xs - 1;
-                ye = ys;
-            }
-        }
-        else if (dx == 0) {
-            // slope is infinite
-            if (y1 > y0) {
-                xe = xs;
-                ye = ys + 1;
-            }
-            else {
-                xe = xs;
-                ye = ys + 1;
-            }
-        }
-        else {
-            // slope is neither 0 or infinite
-            // knowing the slope and dash length, calculate the ending x and y points
-            m = (y1 -y0) / (x1 - x0);
-            dxn = (1 / sqrt(1 + (m * m)));
-            dyn = m * dxn;
-
-            if (x1 > x0) {
-                xe = xs + dxn;
-            }
-            else {
-                xe = xs - dxn;
-            }
+// Drawing kernels
+//
+// Each kernel below is written once as an always inlined template taking the
+// color op as a constant, and instantiated for every op with DEFINE_KERNELS.
+// The op is folded away in every instance, so the inner loops only index a
+// two entry color array and never test the object's style or color flags.
+// Object fields are read into locals before the loops start.
+//
+// A filled rectangle covers columns x0 to x1 - 1 and rows y0 to y1 - 1, each
+// once. Circles are filled a row at a time and are symmetric about the center,
+// so the column right of center is drawn like the one left of it. Vertical
+// bars take the top bit of the pattern in the first column. The pixel loops
+// these kernels replaced moved to the next column or row after drawing, so
+// they drew the first one twice, skipped the last and shifted the bars by a
+// column, and the demo differs from their output in those pixels.
+
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// true if the color op writes pixels where the pattern bit is clear
+#define COP_WRITES_OFF(op)  ((op) == COP_NORMAL || (op) == COP_INVERT)
+
+// color op of an object
+static int color_op(GCOLOR *gc) {
+
+    if (gc->erase) {
+        return COP_ERASE;
+    }
+    if (gc->overlay) {
+        return COP_OVERLAY;
+    }
+    if (gc->invert) {
+        return COP_INVERT;
+    }
+    return COP_NORMAL;
+}
 
-            if (y1 > y0) {
-                ye = ys + dyn;
-            }
-            else {
-                ye = ys - dyn;
-            }
-        }
+// colors written by a kernel, col[1] where the pattern bit is set, col[0] where it is clear
+KERNEL_INLINE void kernel_colors(GCOLOR *gc, const int op, ALLEGRO_COLOR col[2]) {
 
-        // draw
-        mask = texture_mask(go, xe, ye);
-        if (mask) {
-            al_draw_pixel(xe, ye, go->gc.fg);
-        }
-        else {
-            al_draw_pixel(xe, ye, go->gc.bg);
-        }
+    switch (op) {
+        case COP_INVERT:
+        col[1] = gc->bg;
+        col[0] = gc->fg;
+        break;
+
+        case COP_ERASE:
+        col[1] = gc->bg;
+        col[0] = gc->bg;
+        break;
 
-        // initialize for next segment calculation
-        xs = xe;
-        ys = ye;
+        default:
+        col[1] = gc->fg;
+        col[0] = gc->bg;
+        break;
     }
-}
 
-void line_dash(GRAPH_OBJ *go) {
+    // drawing into an indexed framebuffer, the colours become palette indices
+    if (indexed_target != NULL) {
+        col[0] = indexed_color(col[0]);
+        col[1] = indexed_color(col[1]);
+    }
+}
 
-    assert(go != NULL);
-    float pps;
-    float l, m;
-    float dx, dy, dxn, dyn;
-    float xs, ys, xe, ye;
-    float x0, y0, x1, y1;
-    int nl, i;
+// value, 0 or 1, of the pattern bit used for a pixel by the texture pattern
+KERNEL_INLINE int pattern_bit(uint16_t pattern, int xy) {
+    return (pattern >> ((unsigned)xy % NUM_OF_TEXTURE_BITS)) & 1;
+}
 
-    x0 = go->gline.x0;
-    y0 = go->gline.y0;
-    x1 = go->gline.x1;
-    y1 = go->gline.y1;
-
-    // determine length of line
-    l = sqrtf(powf((x1 - x0), (float)2) + powf((y1 - y0), (float)2));
-
-    // determine length of dash
-    nl = ((int)(l / PIX_PER_DASH));
-    if (nl % 2 == 0) {
-        // make it an odd number,
-        // so there is a solid dash at the start and end of the line
-        nl++;
-    }
-    pps = l / (float)nl;
-
-    dy = y1 - y0;
-    dx = x1 - x0;
-    xs = x0;
-    ys = y0;
-    for (i = 0; i < nl; i++) {
-
-        if (dy == 0) {
-            // slope is zero
-            if (x1 > x0) {
-                xe = xs + pps;
-                ye = ys;
-            }
-            else {
-                xe = xs - pps;
-                ye = ys;
-            }
-        }
-        else if (dx == 0) {
-            // slope is infinite
-            if (y1 > y0) {
-                xe = xs;
-                ye = ys + pps;
-            }
-            else {
-                xe = xs;
-                ye = ys + pps;
-            }
-        }
-        else {
-            // slope is neither 0 or infinite
-            // knowing the slope and dash length, calculate the ending x and y points
-            m = (y1 -y0) / (x1 - x0);
-            dxn = (pps / sqrt(1 + (m * m)));
-            dyn = m * dxn;
-
-            if (x1 > x0) {
-                xe = xs + dxn;
-            }
-            else {
-                xe = xs - dxn;
-            }
+// value, 0 or 1, of the pattern bit used for a column by the vertical bar pattern
+KERNEL_INLINE int vertbar_bit(uint16_t pattern, int col) {
+    return (pattern >> (NUM_OF_TEXTURE_BITS - 1 - (col % NUM_OF_TEXTURE_BITS))) & 1;
+}
 
-            if (y1 > y0) {
-                ye = ys + dyn;
-            }
-            else {
-                ye = ys - dyn;
-            }
-        }
+// plot one pattern pixel, writes the clear bit color only if the op allows it
+#define KERNEL_PIXEL(op, x, y, col, bit) \
+    do { \
+        int kb_ = (bit); \
+        if (freeze_rec != NULL && (COP_WRITES_OFF(op) || kb_)) { \
+            freeze_pixel((x), (y), (col)[kb_]); \
+        } \
+        else if (COP_WRITES_OFF(op) || kb_) { \
+            al_draw_pixel((float)(x), (float)(y), (col)[kb_]); \
+        } \
+    } while (0)
+
+// fill a vertical line of n pixels using pixel primatives, to facilitate wrapping and clipping
+KERNEL_INLINE void kernel_vert_line(int x, int y, int n, ALLEGRO_COLOR c) {
 
-        // draw a dash
-        if (i % 2 ==  0) {
-            // draw odd number segments with foreground color so
-            // start and end segments can be seen
-            al_draw_line(xs, ys, xe, ye, go->gc.fg, LINE_WIDTH);
-        }
-        else {
-            al_draw_line(xs, ys, xe, ye, go->gc.bg, LINE_WIDTH);
-        }
+    int i;
 
-        // initialize for next dash calculation
-        xs = xe;
-        ys = ye;
+    for (i = 0; i < n; i++) {
+        al_draw_pixel((float)x, (float)(y + i), c);
     }
 }
 
-// draw a solid line
-void line_solid(GRAPH_OBJ *go) {
+// half height of a circle column dx away from the center, -1 if outside the circle
+// circle equation: (x-x1)^2 + (y-y1)^2 = r^2
+// x1, y1 is the center of the circle and r is the radius
+KERNEL_INLINE int64_t kernel_circle_column(GFIXED rad, int64_t dx) {
 
-    assert(go != NULL);
-    float x0, y0, x1, y1;
+    int64_t h2;
 
-    x0 = go->gline.x0;
-    y0 = go->gline.y0;
-    x1 = go->gline.x1;
-    y1 = go->gline.y1;
+    h2 = (int64_t)rad * rad - dx * dx;
+    if (h2 < 0) {
+        return -1;
+    }
+    return (int64_t)isqrt64((uint64_t)h2);
+}
+
+// draw a line LINE_WIDTH wide, or record it into a frozen group
+KERNEL_INLINE void kernel_line(float x0, float y0, float x1, float y1, ALLEGRO_COLOR c) {
 
-    al_draw_line(x0, y0, x1, y1, go->gc.fg, LINE_WIDTH);
+    if (freeze_rec != NULL) {
+        freeze_line(x0, y0, x1, y1, c);
+    }
+    else {
+        al_draw_line(x0, y0, x1, y1, c, LINE_WIDTH);
+    }
 }
 
-// draw a rectangle with solid lines
-void rect_border_solid(GRAPH_OBJ *go) {
+// length of a line in fixed point
+// the squares are summed unsigned, halving both sides until each is below 2^31
+// so the sum fits, a line across the whole coordinate range loses a bit at most
+KERNEL_INLINE int64_t kernel_line_length(int64_t dx, int64_t dy) {
 
-    assert(go != NULL);
-    float x0,y0, x1, y1;
-    float w, h;
-    GRAPH_OBJ gl;
-
-    x0 = go->grect.x0;
-    y0 = go->grect.y0;
-    x1 = go->grect.x1;
-    y1 = go->grect.y1;
-    w = x1 - x0;
-    h = y1 - y0;
-
-    // rectangles are just four lines, so use the line functions with a local GRAPH_OBJ
-    dap_set_graph_color(&gl, go->gc.invert, go->gc.fg, go->gc.bg);
-    dap_set_graph_style_border(&gl, LINE_SOLID);
-    dap_set_line(&gl, x0, y0, x0 + w, y0);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0 + w, y0, x0 + w, y1);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0, y0, x0, y1);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0, y0 + h, x1, y1);
-    dap_draw_line(&gl);
-}
-
-// draw a rectangle with dash lines
-void rect_border_dash(GRAPH_OBJ *go) {
+    int s;
+    uint64_t ax, ay;
 
-    assert(go != NULL);
-    float x0,y0, x1, y1;
-    float w, h;
-    GRAPH_OBJ gl;
-
-    x0 = go->grect.x0;
-    y0 = go->grect.y0;
-    x1 = go->grect.x1;
-    y1 = go->grect.y1;
-    w = x1 - x0;
-    h = y1 - y0;
-
-    // rectangles are just four lines, so use the line functions with a local GRAPH_OBJ
-    dap_set_graph_color(&gl, go->gc.invert, go->gc.fg, go->gc.bg);
-    dap_set_graph_style_border(&gl, LINE_DASH);
-    dap_set_line(&gl, x0, y0, x0 + w, y0);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0 + w, y0, x0 + w, y1);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0, y0, x0, y1);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0, y0 + h, x1, y1);
-    dap_draw_line(&gl);
-}
-
-// draw a rectangle with using the pattern
-void rect_border_pattern(GRAPH_OBJ *go) {
+    ax = dx < 0 ? -(uint64_t)dx : (uint64_t)dx;
+    ay = dy < 0 ? -(uint64_t)dy : (uint64_t)dy;
+    for (s = 0; (ax | ay) >> 31 != 0; s++) {
+        ax >>= 1;
+        ay >>= 1;
+    }
+    return (int64_t)isqrt64(ax * ax + ay * ay) << s;
+}
 
-    assert(go != NULL);
-    float x0,y0, x1, y1;
-    float w, h;
-    uint16_t pattern;
-    GRAPH_OBJ gl;
-
-    x0 = go->grect.x0;
-    y0 = go->grect.y0;
-    x1 = go->grect.x1;
-    y1 = go->grect.y1;
-    w = x1 - x0;
-    h = y1 - y0;
-
-
-    // rectangles are just four lines, so use the line functions with a local GRAPH_OBJ
-    dap_set_graph_color(&gl, go->gc.invert, go->gc.fg, go->gc.bg);
-    pattern = dap_get_graph_style_pattern(go);
-    dap_set_graph_style_pattern(&gl, pattern);
-    dap_set_graph_style_border(&gl, LINE_PATTERN);
-    dap_set_line(&gl, x0, y0, x0 + w, y0);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0 + w, y0, x0 + w, y1);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0, y0, x0, y1);
-    dap_draw_line(&gl);
-    dap_set_line(&gl, x0, y0 + h, x1, y1);
-    dap_draw_line(&gl);
-}
-
-// draw a dashed circle
-void circle_border_dash(GRAPH_OBJ *go) {
+// Pattern shader
+//
+// With dap_shader_init the fill patterns and the border dashes and patterns
+// are decided per fragment by a GLSL shader instead of per pixel or per dash
+// on the CPU. Fills are drawn as solid spans and lines as one al_draw_line,
+// and the shader keeps or discards each fragment from its screen position,
+// or from its distance along the line for dashes. The shader is written for
+// GLSL 1.20 without integer bit operations, so it also builds on software GL
+// such as Mesa llvmpipe. Memory bitmap targets, used by the tests and trace
+// replay, are always drawn by the CPU kernels.
+
+// shader modes, the vertical bar and texture pattern modes match the fill styles
+enum SHADER_MODE {
+    SHADER_VERTBARS,    // pattern bit of x - phase
+    SHADER_PATTERN,     // pattern bit of x + y + phase
+    SHADER_DASH,        // dash index of the distance along the line
+};
 
-    assert(go != NULL);
-    int i;
-    float ds, dd;
-    float x, y, r;
+static const char *shader_vertex_source =
+    "#version 120\n"
+    "attribute vec4 " ALLEGRO_SHADER_VAR_POS ";\n"
+    "uniform mat4 " ALLEGRO_SHADER_VAR_PROJVIEW_MATRIX ";\n"
+    "varying vec2 pix;\n"
+    "void main() {\n"
+    "    pix = " ALLEGRO_SHADER_VAR_POS ".xy;\n"
+    "    gl_Position = " ALLEGRO_SHADER_VAR_PROJVIEW_MATRIX " * " ALLEGRO_SHADER_VAR_POS ";\n"
+    "}\n";
+
+// the 16 bit pattern is passed as a float and its bits read with floor and mod
+static const char *shader_pixel_source =
+    "#version 120\n"
+    "uniform int mode;\n"
+    "uniform float pattern;\n"
+    "uniform float phase;\n"
+    "uniform vec2 origin;\n"
+    "uniform vec2 dir;\n"
+    "uniform float dash_len;\n"
+    "uniform float dashes;\n"
+    "uniform bool write_off;\n"
+    "uniform vec4 color_on;\n"
+    "uniform vec4 color_off;\n"
+    "varying vec2 pix;\n"
+    "float pattern_bit(float s) {\n"
+    "    return mod(floor(pattern / exp2(mod(s, 16.0))), 2.0);\n"
+    "}\n"
+    "void main() {\n"
+    "    vec2 p = floor(pix);\n"
+    "    float b;\n"
+    "    if (mode == 0) {\n"
+    "        b = pattern_bit(p.x - phase);\n"
+    "    }\n"
+    "    else if (mode == 1) {\n"
+    "        b = pattern_bit(p.x + p.y + phase);\n"
+    "    }\n"
+    "    else {\n"
+    "        b = 1.0 - mod(clamp(floor(dot(pix - origin, dir) / dash_len), 0.0, dashes - 1.0), 2.0);\n"
+    "    }\n"
+    "    if (b < 0.5 && !write_off) {\n"
+    "        discard;\n"
+    "    }\n"
+    "    gl_FragColor = b < 0.5 ? color_off : color_on;\n"
+    "}\n";
+
+// shader of the display, NULL if the CPU kernels draw the patterns
+static ALLEGRO_SHADER *pattern_shader;
+
+// build the pattern shader for the current display
+// the display must have been created with ALLEGRO_OPENGL | ALLEGRO_PROGRAMMABLE_PIPELINE
+// call before any object is set up, objects bind the shader kernels when they are set
+// returns 0 if success, otherwise -1
+int dap_shader_init(void) {
 
-    x = go->gcirc.x;
-    y = go->gcirc.y;
-    r = go->gcirc.radius;
+    ALLEGRO_SHADER *s;
+
+    s = al_create_shader(ALLEGRO_SHADER_GLSL);
+    if (s == NULL) {
+        return -1;
+    }
+    if (!al_attach_shader_source(s, ALLEGRO_VERTEX_SHADER, shader_vertex_source) ||
+        !al_attach_shader_source(s, ALLEGRO_PIXEL_SHADER, shader_pixel_source) ||
+        !al_build_shader(s)) {
+        printf("%s\n", al_get_shader_log(s));
+        al_destroy_shader(s);
+        return -1;
+    }
+    pattern_shader = s;
+    return 0;
+}
 
-    dd = (float)RAD_PER_CIRCLE / (float)DASH_PER_CIRCLE;
+// destroy the pattern shader, objects set up after this use the CPU kernels again
+void dap_shader_destroy(void) {
 
-    for ( i = 0; i < DASH_PER_CIRCLE; i++) {
-        ds = i * dd;
-        if (i % 2 != 0) {
-            al_draw_arc(x, y, r, ds, dd, go->gc.fg, BORDER_LINE_WIDTH);
-        }
-        else {
-            al_draw_arc(x, y, r, ds, dd, go->gc.bg, BORDER_LINE_WIDTH);
-        }
+    if (pattern_shader != NULL) {
+        al_destroy_shader(pattern_shader);
+        pattern_shader = NULL;
     }
 }
 
-// draw a solid circle border
-void circle_border_solid(GRAPH_OBJ *go) {
+// use the pattern shader for the following draws to the target
+// returns false if the target can't use it, the caller then draws on the CPU
+static bool shader_begin(const int op, int mode, ALLEGRO_COLOR col[2]) {
 
-    assert(go != NULL);
-    float x, y, r;
+    ALLEGRO_BITMAP *target;
 
-    x = go->gcirc.x;
-    y = go->gcirc.y;
-    r = go->gcirc.radius;
-    al_draw_circle(x, y, r, go->gc.fg, BORDER_LINE_WIDTH);
+    target = al_get_target_bitmap();
+    if (pattern_shader == NULL || target == NULL ||
+        (al_get_bitmap_flags(target) & ALLEGRO_MEMORY_BITMAP) != 0 ||
+        !al_use_shader(pattern_shader)) {
+        return false;
+    }
+    al_set_shader_int("mode", mode);
+    al_set_shader_bool("write_off", COP_WRITES_OFF(op));
+    al_set_shader_float_vector("color_on", 4, &col[1].r, 1);
+    al_set_shader_float_vector("color_off", 4, &col[0].r, 1);
+    return true;
 }
 
-// draw a circular border using a texture pattern
-void circle_border_pattern(GRAPH_OBJ *go) {
+// set the pattern and its phase
+static void shader_pattern(uint16_t pattern, int phase) {
 
-    int i, n;
-    uint16_t tmask;
-    float posyt, posyb, posxs, posx, rad;
+    al_set_shader_float("pattern", pattern);
+    al_set_shader_float("phase", phase);
+}
 
-    rad = go->gcirc.radius;
-    posyt = go->gcirc.y;
-    posyb = go->gcirc.y;
-    posxs = go->gcirc.x - rad;
-    posx = posxs;
-    n = (int)(2 * rad);
+// set the dashes of a line from x0, y0 along the unit vector dx, dy
+static void shader_dash(float x0, float y0, float dx, float dy, float len, int dashes) {
 
-    for (i = 0; i <= n; i++) {
+    float v[2];
+
+    v[0] = x0;
+    v[1] = y0;
+    al_set_shader_float_vector("origin", 2, v, 1);
+    v[0] = dx;
+    v[1] = dy;
+    al_set_shader_float_vector("dir", 2, v, 1);
+    al_set_shader_float("dash_len", len);
+    al_set_shader_float("dashes", dashes);
+}
 
-        // calculate the start and end of a vertical line to use for texture
-        // circle equation: (x-x1)^2 + (y-y1)^2 = r^2
-        // x1, y1 is the center of the circle and r is the radius
-        // solve for y top and bottom for a series of x values
-        posyb = sqrtf(powf(rad,2) - powf((posx - go->gcirc.x),2)) + go->gcirc.y;
-        posyt = go->gcirc.y - (posyb - go->gcirc.y);
+// go back to the default shader
+static void shader_end(void) {
+    al_use_shader(NULL);
+}
 
-        // draw top half of circle
-        tmask = texture_mask(go, posx, posyt);
-        if (go->gs.pattern & tmask) {
-            al_draw_pixel(posx, posyt, go->gc.fg);
-        }
-        else {
-            al_draw_pixel(posx, posyt, go->gc.bg);
+// Spans
+//
+// Every filled shape is drawn as horizontal spans, one row of pixels from x0
+// up to x1. The pattern is applied a run at a time: the 16 pattern bits from
+// a pixel on are read as one word and the run of equal bits is found with a
+// count of trailing zeros, so a span is a few quads however long it is. The
+// quads of a shape are gathered in a vertex list and drawn with one
+// al_draw_prim call.
+
+// span quads of a drawing thread, grown as needed
+static __thread ALLEGRO_VERTEX *span_vtx;
+static __thread size_t span_vtx_size;
+static __thread size_t span_vtx_n;
+
+// band of a drawing thread the span fills are limited to, set by the scheduler for one unit
+static __thread int span_left = INT_MIN;
+static __thread int span_top = INT_MIN;
+static __thread int span_right = INT_MAX;
+static __thread int span_bottom = INT_MAX;
+
+// polygon edges of a drawing thread, grown as needed
+typedef struct dedge {
+    int64_t x0, y0;     // top end, fixed point
+    int64_t x1, y1;     // bottom end
+} DAP_EDGE;
+
+static __thread DAP_EDGE *poly_edges;
+static __thread int poly_edges_size;
+static __thread int64_t *poly_xs;
+
+// draw the gathered span quads
+static void span_flush(void) {
+
+    size_t i;
+
+    // recorded as quads, the corners are the first three vertices and the last
+    if (freeze_rec != NULL) {
+        for (i = 0; i + 5 < span_vtx_n; i += 6) {
+            freeze_quad(&span_vtx[i], &span_vtx[i + 1], &span_vtx[i + 2], &span_vtx[i + 5]);
         }
+        span_vtx_n = 0;
+    }
+    if (span_vtx_n > 0) {
+        al_draw_prim(span_vtx, NULL, NULL, 0, (int)span_vtx_n, ALLEGRO_PRIM_TRIANGLE_LIST);
+        span_vtx_n = 0;
+    }
+}
 
-        // draw bottom half of circle
-        tmask = texture_mask(go, posx, posyb);
-        if (go->gs.pattern & tmask) {
-            al_draw_pixel(posx, posyb, go->gc.fg);
+// add the quad of pixels x0 to x1 - 1 on rows y0 to y1 - 1
+static void span_box(int x0, int y0, int x1, int y1, ALLEGRO_COLOR c) {
+
+    size_t size;
+    ALLEGRO_VERTEX *v;
+
+    if (span_vtx_n + 6 > span_vtx_size) {
+        size = span_vtx_size ? span_vtx_size * 2 : 1536;
+        thread_buffers_keep();
+        v = realloc(span_vtx, size * sizeof(ALLEGRO_VERTEX));
+        if (v == NULL) {
+            // out of memory, draw what there is and start again
+            span_flush();
+            if (span_vtx_size == 0) {
+                return;
+            }
         }
         else {
-            al_draw_pixel(posx, posyb, go->gc.bg);
+            span_vtx = v;
+            span_vtx_size = size;
         }
-
-        posx = posxs + (float)i;
     }
+    v = span_vtx + span_vtx_n;
+    v[0] = (ALLEGRO_VERTEX){x0, y0, 0, 0, 0, c};
+    v[1] = (ALLEGRO_VERTEX){x1, y0, 0, 0, 0, c};
+    v[2] = (ALLEGRO_VERTEX){x1, y1, 0, 0, 0, c};
+    v[3] = v[0];
+    v[4] = v[2];
+    v[5] = (ALLEGRO_VERTEX){x0, y1, 0, 0, 0, c};
+    span_vtx_n += 6;
 }
 
-// get raster data
-// open file and memory map so it can be accessed as an array
-// returns 0 if success, otherwise -1
- int dap_open_raster_file(GRAPH_OBJ *go, char *filename) {
+// add the quad of pixels x0 to x1 - 1 on row y
+static void span_quad(int x0, int y, int x1, ALLEGRO_COLOR c) {
+    span_box(x0, y, x1, y + 1, c);
+}
 
-    assert(go != NULL);
-    assert(filename != NULL);
+// reverse the bits of a pattern, so vertical bars read lowest bit first like texture patterns
+static uint16_t pattern_reverse(uint16_t p) {
 
-    int r;
-    uint8_t *dataptr;
-    struct stat sb;
+    p = (p >> 1 & 0x5555) | (p & 0x5555) << 1;
+    p = (p >> 2 & 0x3333) | (p & 0x3333) << 2;
+    p = (p >> 4 & 0x0F0F) | (p & 0x0F0F) << 4;
+    return p >> 8 | p << 8;
+}
 
-    // open file and get stats (size)
-    go->grast.fd = open(filename, O_RDONLY, S_IRUSR | S_IWUSR);
-    assert(go->grast.fd != -1);
+// fill pixels x0 to x1 - 1 on row y
+// the pattern bit of pixel x is bit (x - phase) of the reversed pattern for vertical bars,
+// and bit (x + y + phase) of the pattern for texture patterns
+KERNEL_INLINE void kernel_span(const int op, const int fill, int y, int x0, int x1, int phase,
+                               uint16_t pattern, ALLEGRO_COLOR col[2]) {
 
-    r = fstat(go->grast.fd, &sb);
-    if (r == -1) {
-        go->grast.fdlength = 0;
-        return -1;
+    int x, n, b;
+    uint32_t w;
+
+    // the pattern is found from x itself, so the span can start anywhere in the band
+    x0 = x0 > span_left ? x0 : span_left;
+    x1 = x1 < span_right ? x1 : span_right;
+    if (x1 <= x0 || y < span_top || y >= span_bottom) {
+        return;
     }
-    else {
-        go->grast.fdlength = sb.st_size;
+    if (fill == FILL_SOLID) {
+        span_quad(x0, y, x1, col[1]);
+        return;
+    }
+    for (x = x0; x < x1; x += n) {
+        n = fill == FILL_VERTBARS ? x - phase : x + y + phase;
+        w = ((uint32_t)pattern | (uint32_t)pattern << 16) >> ((unsigned)n % NUM_OF_TEXTURE_BITS);
+        b = w & 1;
+        n = __builtin_ctz((b ? ~w : w) | 1u << NUM_OF_TEXTURE_BITS);
+        if (n > x1 - x) {
+            n = x1 - x;
+        }
+        if (COP_WRITES_OFF(op) || b) {
+            span_quad(x, y, x + n, col[b]);
+        }
     }
+}
 
-    // memory map file, return pointer to array of data bytes
-    dataptr = mmap(NULL, go->grast.fdlength, PROT_READ, MAP_PRIVATE, go->grast.fd, 0);
-    if (dataptr == NULL) {
-        go->grast.rdataptr = NULL;
-        return -1;
+// hand the pattern of a shaded fill to the shader
+// returns the fill style to draw the spans with, solid if the shader applies the pattern
+KERNEL_INLINE int shader_fill(const int op, const int fill, const int shaded, int phase,
+                              uint16_t pattern, ALLEGRO_COLOR col[2]) {
+
+    if (shaded && shader_begin(op, fill == FILL_VERTBARS ? SHADER_VERTBARS : SHADER_PATTERN, col)) {
+        shader_pattern(pattern, phase);
+        return FILL_SOLID;
     }
-    else {
+    return fill;
+}
+
+// end a shaded fill, fill is the style returned by shader_fill
+KERNEL_INLINE void shader_fill_end(const int fill, const int shaded) {
+
+    if (shaded && fill == FILL_SOLID) {
+        shader_end();
+    }
+}
+
+// fill a rectangle with spans
+KERNEL_INLINE void rect_fill_k(GRAPH_OBJ *go, const int op, int fill, const int shaded) {
+
+    int r, n, q, px, py, phase;
+    uint16_t pattern;
+    GFIXED y0, y1;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    pattern = fill == FILL_VERTBARS ? pattern_reverse(go->gs.pattern) : go->gs.pattern;
+    y0 = go->grect.y0 < go->grect.y1 ? go->grect.y0 : go->grect.y1;
+    y1 = go->grect.y0 < go->grect.y1 ? go->grect.y1 : go->grect.y0;
+    px = fix_to_int(go->grect.x0);
+    py = fix_to_int(y0);
+    n = fix_to_int((int64_t)go->grect.x1 - go->grect.x0);
+    q = fix_to_int((int64_t)y1 - y0);
+
+    // vertical bars start at the left edge, texture patterns on the x0 + y0 diagonal
+    phase = fill == FILL_VERTBARS ? px : fix_to_int((int64_t)go->grect.x0 + y0) - px - py;
+    fill = shader_fill(op, fill, shaded, phase, pattern, col);
+
+    // only the rows in the band
+    r = py < span_top ? span_top - py : 0;
+    q = (int64_t)span_bottom - py < q ? span_bottom - py : q;
+    for (; r < q; r++) {
+        kernel_span(op, fill, py + r, px, px + n, phase, pattern, col);
+    }
+    span_flush();
+    shader_fill_end(fill, shaded);
+}
+
+// span of row i of a filled circle, counted from its top, y, x0 and x1 past the end
+// returns false if the row is empty
+static inline bool circle_row(GFIXED cx, GFIXED cy, GFIXED rad, int i, int *p) {
+
+    int64_t dy, w;
+
+    // solve for the x extent of the row
+    dy = (int64_t)i * FIX_ONE - rad;
+    w = kernel_circle_column(rad, dy);
+    if (w < 0) {
+        return false;
+    }
+    p[0] = fix_to_int(cy + dy);
+    p[1] = fix_to_int(cx - w);
+    p[2] = fix_to_int(cx + w) + 1;
+    return true;
+}
+
+// spans of a filled circle, y, x0 and x1 past the end of each row, memoized
+// returns the spans, NULL if out of memory
+static int *circle_rows(GRAPH_OBJ *go, int *nr) {
+
+    int i, n, m;
+    int *p;
+    GFIXED cx, cy, rad;
+    DAP_GEOM *e;
+
+    if (geom_find(go, GEOM_CIRCLE_ROWS, &e)) {
+        *nr = e->n;
+        return e->data;
+    }
+    cx = go->gcirc.x;
+    cy = go->gcirc.y;
+    rad = go->gcirc.radius;
+    n = fix_to_int(2 * (int64_t)rad);
+    p = geom_alloc(e, (size_t)(n >= 0 ? n + 1 : 1) * 3 * sizeof(int));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    for (i = 0, m = 0; i <= n; i++) {
+        if (circle_row(cx, cy, rad, i, p + 3 * m)) {
+            m++;
+        }
+    }
+    geom_keep(go, GEOM_CIRCLE_ROWS, e, m, 0);
+    *nr = m;
+    return p;
+}
+
+// fill a circle with spans, one per row
+KERNEL_INLINE void circle_fill_k(GRAPH_OBJ *go, const int op, int fill, const int shaded) {
+
+    int i, n, m, top, phase, row[3];
+    int *p;
+    uint16_t pattern;
+    GFIXED cx, cy, rad;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    pattern = fill == FILL_VERTBARS ? pattern_reverse(go->gs.pattern) : go->gs.pattern;
+    cx = go->gcirc.x;
+    cy = go->gcirc.y;
+    rad = go->gcirc.radius;
+
+    // vertical bars start at the left of the circle, texture patterns on the center diagonal
+    phase = fill == FILL_VERTBARS ? fix_to_int((int64_t)cx - rad) :
+            fix_to_int((int64_t)cx + cy) - fix_to_int(cx) - fix_to_int(cy);
+
+    // a band of the scheduler solves its own rows only, the rows of a huge circle
+    // are not all built for its first band
+    if (span_top != INT_MIN || span_bottom != INT_MAX) {
+        top = fix_to_int((int64_t)cy - rad);
+        n = fix_to_int(2 * (int64_t)rad);
+        i = (int64_t)span_top - top > 0 ? (int)((int64_t)span_top - top) : 0;
+        m = (int64_t)span_bottom - top <= n ? (int)((int64_t)span_bottom - top) : n + 1;
+        fill = shader_fill(op, fill, shaded, phase, pattern, col);
+        for (; i < m; i++) {
+            if (circle_row(cx, cy, rad, i, row)) {
+                kernel_span(op, fill, row[0], row[1], row[2], phase, pattern, col);
+            }
+        }
+        span_flush();
+        shader_fill_end(fill, shaded);
+        return;
+    }
+
+    p = circle_rows(go, &n);
+    if (p == NULL) {
+        return;
+    }
+    fill = shader_fill(op, fill, shaded, phase, pattern, col);
+    for (i = 0; i < n; i++, p += 3) {
+        kernel_span(op, fill, p[0], p[1], p[2], phase, pattern, col);
+    }
+    span_flush();
+    shader_fill_end(fill, shaded);
+}
+
+// get room for n polygon edges and crossings
+static int poly_buffers(int n) {
+
+    DAP_EDGE *e;
+    int64_t *xs;
+
+    if (n > poly_edges_size) {
+        thread_buffers_keep();
+        e = realloc(poly_edges, n * sizeof(DAP_EDGE));
+        if (e == NULL) {
+            return -1;
+        }
+        poly_edges = e;
+        xs = realloc(poly_xs, n * sizeof(int64_t));
+        if (xs == NULL) {
+            return -1;
+        }
+        poly_xs = xs;
+        poly_edges_size = n;
+    }
+    return 0;
+}
+
+// compare polygon edges by their top for qsort
+static int cmp_edge(const void *a, const void *b) {
+
+    int64_t ya = ((const DAP_EDGE *)a)->y0;
+    int64_t yb = ((const DAP_EDGE *)b)->y0;
+    return (ya > yb) - (ya < yb);
+}
+
+// fill a polygon with spans from an edge table, even-odd rule, pixels whose centers are inside
+KERNEL_INLINE void polygon_fill_k(GRAPH_OBJ *go, const int op, int fill, const int shaded) {
+
+    int i, j, n, ne, first, last, y, ytop, ybot, nx, phase;
+    int64_t yc, xa, xb, x;
+    uint16_t pattern;
+    float *pts;
+    DAP_EDGE *e;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    pattern = fill == FILL_VERTBARS ? pattern_reverse(go->gs.pattern) : go->gs.pattern;
+    n = go->gpoly.n;
+    pts = go->gpoly.pts;
+    if (n < 3 || poly_buffers(n) == -1) {
+        return;
+    }
+
+    // edge table, every non horizontal edge top end first, sorted by top
+    ne = 0;
+    xa = INT64_MAX;
+    for (i = 0; i < n; i++) {
+        j = i + 1 < n ? i + 1 : 0;
+        e = &poly_edges[ne];
+        e->x0 = (int64_t)go->gpoly.x + fix_from_float(pts[2 * i]);
+        e->y0 = (int64_t)go->gpoly.y + fix_from_float(pts[2 * i + 1]);
+        e->x1 = (int64_t)go->gpoly.x + fix_from_float(pts[2 * j]);
+        e->y1 = (int64_t)go->gpoly.y + fix_from_float(pts[2 * j + 1]);
+        xa = e->x0 < xa ? e->x0 : xa;
+        if (e->y0 == e->y1) {
+            continue;
+        }
+        if (e->y0 > e->y1) {
+            x = e->x0; e->x0 = e->x1; e->x1 = x;
+            x = e->y0; e->y0 = e->y1; e->y1 = x;
+        }
+        ne++;
+    }
+    if (ne == 0) {
+        return;
+    }
+    qsort(poly_edges, ne, sizeof(DAP_EDGE), cmp_edge);
+
+    // vertical bars start at the left of the polygon, texture patterns at the origin
+    phase = fill == FILL_VERTBARS ? fix_to_int(xa) : 0;
+    fill = shader_fill(op, fill, shaded, phase, pattern, col);
+
+    // rows whose pixel centers are between the top and bottom edges
+    ytop = fix_to_int(poly_edges[0].y0 + FIX_ONE / 2 - 1);
+    ybot = ytop;
+    for (i = 0; i < ne; i++) {
+        y = fix_to_int(poly_edges[i].y1 + FIX_ONE / 2 - 1);
+        ybot = y > ybot ? y : ybot;
+    }
+
+    // only the rows in the band
+    ytop = ytop > span_top ? ytop : span_top;
+    ybot = ybot < span_bottom ? ybot : span_bottom;
+
+    // active edges are first to last - 1, edges end below a row or start further down
+    first = 0;
+    last = 0;
+    for (y = ytop; y < ybot; y++) {
+        yc = (int64_t)y * FIX_ONE + FIX_ONE / 2;
+        while (last < ne && poly_edges[last].y0 <= yc) {
+            last++;
+        }
+        while (first < last && poly_edges[first].y1 <= yc) {
+            first++;
+        }
+
+        // crossings of the active edges with the row center, sorted
+        nx = 0;
+        for (i = first; i < last; i++) {
+            e = &poly_edges[i];
+            if (e->y1 <= yc || e->y0 > yc) {
+                continue;
+            }
+            x = e->x0 + (e->x1 - e->x0) * (yc - e->y0) / (e->y1 - e->y0);
+            for (j = nx; j > 0 && poly_xs[j - 1] > x; j--) {
+                poly_xs[j] = poly_xs[j - 1];
+            }
+            poly_xs[j] = x;
+            nx++;
+        }
+
+        // pixels whose centers are between each pair of crossings
+        for (i = 0; i + 1 < nx; i += 2) {
+            xa = fix_to_int(poly_xs[i] + FIX_ONE / 2 - 1);
+            xb = fix_to_int(poly_xs[i + 1] + FIX_ONE / 2 - 1);
+            kernel_span(op, fill, y, (int)xa, (int)xb, phase, pattern, col);
+        }
+    }
+    span_flush();
+    shader_fill_end(fill, shaded);
+}
+
+// instantiate the span fills for each fill style, drawn on the CPU or shaded
+#define SPAN_FILL_K(name, shape, fill, shaded) \
+KERNEL_INLINE void name(GRAPH_OBJ *go, const int op) { \
+    shape(go, op, fill, shaded); \
+}
+
+SPAN_FILL_K(rect_fill_solid_k, rect_fill_k, FILL_SOLID, false)
+SPAN_FILL_K(rect_fill_vertbar_k, rect_fill_k, FILL_VERTBARS, false)
+SPAN_FILL_K(rect_fill_pattern_k, rect_fill_k, FILL_PATTERN, false)
+SPAN_FILL_K(circle_fill_solid_k, circle_fill_k, FILL_SOLID, false)
+SPAN_FILL_K(circle_fill_vertbar_k, circle_fill_k, FILL_VERTBARS, false)
+SPAN_FILL_K(circle_fill_pattern_k, circle_fill_k, FILL_PATTERN, false)
+SPAN_FILL_K(polygon_fill_solid_k, polygon_fill_k, FILL_SOLID, false)
+SPAN_FILL_K(polygon_fill_vertbar_k, polygon_fill_k, FILL_VERTBARS, false)
+SPAN_FILL_K(polygon_fill_pattern_k, polygon_fill_k, FILL_PATTERN, false)
+SPAN_FILL_K(rect_fill_vertbar_shader_k, rect_fill_k, FILL_VERTBARS, true)
+SPAN_FILL_K(rect_fill_pattern_shader_k, rect_fill_k, FILL_PATTERN, true)
+SPAN_FILL_K(circle_fill_vertbar_shader_k, circle_fill_k, FILL_VERTBARS, true)
+SPAN_FILL_K(circle_fill_pattern_shader_k, circle_fill_k, FILL_PATTERN, true)
+SPAN_FILL_K(polygon_fill_vertbar_shader_k, polygon_fill_k, FILL_VERTBARS, true)
+SPAN_FILL_K(polygon_fill_pattern_shader_k, polygon_fill_k, FILL_PATTERN, true)
+
+// draw a solid line
+KERNEL_INLINE void line_solid_k(GRAPH_OBJ *go, const int op) {
+
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    kernel_line(fix_to_float(go->gline.x0), fix_to_float(go->gline.y0),
+                fix_to_float(go->gline.x1), fix_to_float(go->gline.y1), col[1]);
+}
+
+// dash ends of a line, nl dashes are nl + 1 points, memoized
+// the number of dashes is odd, so there is a solid dash at the start and end of the line
+// returns the points, NULL if the line has no length or out of memory
+static float *line_dashes(GRAPH_OBJ *go, int *nl) {
+
+    int n, i;
+    int64_t l, dx, dy;
+    GFIXED x0, y0;
+    float *p;
+    DAP_GEOM *e;
+
+    if (geom_find(go, GEOM_LINE_DASH, &e)) {
+        *nl = e->n;
+        return e->data;
+    }
+    x0 = go->gline.x0;
+    y0 = go->gline.y0;
+    dx = (int64_t)go->gline.x1 - x0;
+    dy = (int64_t)go->gline.y1 - y0;
+
+    // determine length of line and number of dashes
+    l = kernel_line_length(dx, dy);
+    if (l == 0) {
+        return NULL;
+    }
+    n = (int)(l / ((int64_t)PIX_PER_DASH * FIX_ONE)) | 1;
+    p = geom_alloc(e, (size_t)(n + 1) * 2 * sizeof(float));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    // dash ends are computed from the start of the line, so no error accumulates
+    for (i = 0; i <= n; i++) {
+        p[2 * i] = fix_to_float((GFIXED)(x0 + dx * i / n));
+        p[2 * i + 1] = fix_to_float((GFIXED)(y0 + dy * i / n));
+    }
+    geom_keep(go, GEOM_LINE_DASH, e, n, 0);
+    *nl = n;
+    return p;
+}
+
+// draw a dashed line
+// dashes with an even index use the set bit color, so start and end segments can be seen
+KERNEL_INLINE void line_dash_k(GRAPH_OBJ *go, const int op) {
+
+    int nl, i;
+    float *p;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    p = line_dashes(go, &nl);
+    if (p == NULL) {
+        return;
+    }
+    for (i = 0; i < nl; i++, p += 2) {
+        if (COP_WRITES_OFF(op) || (i & 1) == 0) {
+            kernel_line(p[0], p[1], p[2], p[3], col[(i & 1) ^ 1]);
+        }
+    }
+}
+
+// pixels of a patterned line, x, y and the pattern index of each, memoized
+// returns the pixels, NULL if the line has no length or out of memory
+static int *line_pixels(GRAPH_OBJ *go, int *np) {
+
+    int n, i;
+    int64_t l, sx, sy, xe, ye;
+    int *p;
+    GFIXED x0, y0;
+    DAP_GEOM *e;
+
+    if (geom_find(go, GEOM_LINE_PATTERN, &e)) {
+        *np = e->n;
+        return e->data;
+    }
+    x0 = go->gline.x0;
+    y0 = go->gline.y0;
+    sx = (int64_t)go->gline.x1 - x0;
+    sy = (int64_t)go->gline.y1 - y0;
+
+    // one pixel per unit of length, sx and sy become the fixed point unit step
+    l = kernel_line_length(sx, sy);
+    if (l == 0) {
+        return NULL;
+    }
+    n = fix_to_int(l);
+    sx = sx * FIX_ONE / l;
+    sy = sy * FIX_ONE / l;
+    p = geom_alloc(e, (size_t)(n > 0 ? n : 1) * 3 * sizeof(int));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    for (i = 1; i <= n; i++) {
+        xe = x0 + sx * i;
+        ye = y0 + sy * i;
+        p[3 * i - 3] = fix_to_int(xe);
+        p[3 * i - 2] = fix_to_int(ye);
+        p[3 * i - 1] = fix_to_int(xe + ye);
+    }
+    geom_keep(go, GEOM_LINE_PATTERN, e, n, 0);
+    *np = n;
+    return p;
+}
+
+// draw a straight line using a texture pattern
+KERNEL_INLINE void line_pattern_k(GRAPH_OBJ *go, const int op) {
+
+    int n, i;
+    int *p;
+    uint16_t pattern;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    pattern = go->gs.pattern;
+    p = line_pixels(go, &n);
+    if (p == NULL) {
+        return;
+    }
+    for (i = 0; i < n; i++, p += 3) {
+        KERNEL_PIXEL(op, p[0], p[1], col, pattern_bit(pattern, p[2]));
+    }
+}
+
+// draw a dashed line as one line, the shader picks the dash of each fragment
+KERNEL_INLINE void line_dash_shader_k(GRAPH_OBJ *go, const int op) {
+
+    int nl;
+    int64_t l, dx, dy;
+    float fl;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    dx = (int64_t)go->gline.x1 - go->gline.x0;
+    dy = (int64_t)go->gline.y1 - go->gline.y0;
+    l = kernel_line_length(dx, dy);
+    if (l == 0 || !shader_begin(op, SHADER_DASH, col)) {
+        line_dash_k(go, op);
+        return;
+    }
+
+    // same number of dashes as line_dash_k, the first and last use the set bit color
+    nl = (int)(l / ((int64_t)PIX_PER_DASH * FIX_ONE)) | 1;
+    fl = fix_to_float((GFIXED)l);
+    shader_dash(fix_to_float(go->gline.x0), fix_to_float(go->gline.y0),
+                fix_to_float((GFIXED)dx) / fl, fix_to_float((GFIXED)dy) / fl, fl / nl, nl);
+    al_draw_line(fix_to_float(go->gline.x0), fix_to_float(go->gline.y0),
+                 fix_to_float(go->gline.x1), fix_to_float(go->gline.y1), col[1], LINE_WIDTH);
+    shader_end();
+}
+
+// draw a patterned line as one line, the shader picks the pattern bit of each fragment
+KERNEL_INLINE void line_pattern_shader_k(GRAPH_OBJ *go, const int op) {
+
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    if (!shader_begin(op, SHADER_PATTERN, col)) {
+        line_pattern_k(go, op);
+        return;
+    }
+    shader_pattern(go->gs.pattern, 0);
+    al_draw_line(fix_to_float(go->gline.x0), fix_to_float(go->gline.y0),
+                 fix_to_float(go->gline.x1), fix_to_float(go->gline.y1), col[1], LINE_WIDTH);
+    shader_end();
+}
+
+// draw a rectangle border as four lines, using the line kernel for the border style
+// each side is memoized under its own generation after the rectangle's
+#define RECT_BORDER_K(name, linek) \
+KERNEL_INLINE void name(GRAPH_OBJ *go, const int op) { \
+    GRAPH_OBJ gl = *go; \
+    GFIXED x0 = go->grect.x0, y0 = go->grect.y0; \
+    GFIXED x1 = go->grect.x1, y1 = go->grect.y1; \
+    gl.gtype = TYPE_LINE; \
+    gl.gline = (GLINE){x0, y0, x1, y0}; \
+    gl.gen = go->gen ? go->gen + 1 : 0; \
+    linek(&gl, op); \
+    gl.gline = (GLINE){x1, y0, x1, y1}; \
+    gl.gen = go->gen ? go->gen + 2 : 0; \
+    linek(&gl, op); \
+    gl.gline = (GLINE){x0, y0, x0, y1}; \
+    gl.gen = go->gen ? go->gen + 3 : 0; \
+    linek(&gl, op); \
+    gl.gline = (GLINE){x0, y1, x1, y1}; \
+    gl.gen = go->gen ? go->gen + 4 : 0; \
+    linek(&gl, op); \
+}
+
+RECT_BORDER_K(rect_border_solid_k, line_solid_k)
+RECT_BORDER_K(rect_border_dash_k, line_dash_k)
+RECT_BORDER_K(rect_border_pattern_k, line_pattern_k)
+RECT_BORDER_K(rect_border_dash_shader_k, line_dash_shader_k)
+RECT_BORDER_K(rect_border_pattern_shader_k, line_pattern_shader_k)
+
+// draw a polygon border as its closed chain of lines, using the line kernel for the border style
+// the points are not copied and may change without a setter, so the sides are not memoized
+#define POLYGON_BORDER_K(name, linek) \
+KERNEL_INLINE void name(GRAPH_OBJ *go, const int op) { \
+    int i, j; \
+    float *p = go->gpoly.pts; \
+    GRAPH_OBJ gl = *go; \
+    gl.gtype = TYPE_LINE; \
+    gl.gen = 0; \
+    for (i = 0; i < go->gpoly.n; i++) { \
+        j = i + 1 < go->gpoly.n ? i + 1 : 0; \
+        gl.gline = (GLINE){go->gpoly.x + fix_from_float(p[2 * i]), \
+                           go->gpoly.y + fix_from_float(p[2 * i + 1]), \
+                           go->gpoly.x + fix_from_float(p[2 * j]), \
+                           go->gpoly.y + fix_from_float(p[2 * j + 1])}; \
+        linek(&gl, op); \
+    } \
+}
+
+POLYGON_BORDER_K(polygon_border_solid_k, line_solid_k)
+POLYGON_BORDER_K(polygon_border_dash_k, line_dash_k)
+POLYGON_BORDER_K(polygon_border_pattern_k, line_pattern_k)
+POLYGON_BORDER_K(polygon_border_dash_shader_k, line_dash_shader_k)
+POLYGON_BORDER_K(polygon_border_pattern_shader_k, line_pattern_shader_k)
+
+// draw a solid circle border
+KERNEL_INLINE void circle_border_solid_k(GRAPH_OBJ *go, const int op) {
+
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    if (freeze_rec != NULL) {
+        freeze_circle(fix_to_float(go->gcirc.x), fix_to_float(go->gcirc.y), fix_to_float(go->gcirc.radius), col[1]);
+        return;
+    }
+    al_draw_circle(fix_to_float(go->gcirc.x), fix_to_float(go->gcirc.y), fix_to_float(go->gcirc.radius),
+                   col[1], BORDER_LINE_WIDTH);
+}
+
+// dashes of a dashed circle border of radius r
+// an even number n of dashes of about PIX_PER_DASH, of k segments each
+static void circle_dash_count(float r, int *nd, int *ks) {
+
+    int n, k;
+
+    n = (int)lrintf(RAD_PER_CIRCLE * r / PIX_PER_DASH) & ~1;
+    n = n < CIRCLE_MIN_DASHES ? CIRCLE_MIN_DASHES : n > CIRCLE_TABLE_SIZE / 2 ? CIRCLE_TABLE_SIZE / 2 : n;
+    k = (int)ceilf((float)PIX_PER_DASH / CIRCLE_SEG_PIXELS);
+    k = n * k > CIRCLE_TABLE_SIZE ? CIRCLE_TABLE_SIZE / n : k;
+    *nd = n;
+    *ks = k;
+}
+
+// segment ends of a dashed circle border, n dashes of k segments, memoized
+// returns the x, y pairs, two per segment, NULL if out of memory
+static float *circle_dashes(GRAPH_OBJ *go, int *nd, int *ks) {
+
+    int i, n, k, m, a, b;
+    float x, y, r;
+    float *p;
+    DAP_GEOM *e;
+
+    if (geom_find(go, GEOM_CIRCLE_DASH, &e)) {
+        *nd = e->n;
+        *ks = e->k;
+        return e->data;
+    }
+    pthread_once(&circle_once, circle_table_init);
+    x = fix_to_float(go->gcirc.x);
+    y = fix_to_float(go->gcirc.y);
+    r = fix_to_float(go->gcirc.radius);
+    circle_dash_count(r, &n, &k);
+    m = n * k;
+    p = geom_alloc(e, (size_t)m * 4 * sizeof(float));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < m; i++) {
+        a = i * CIRCLE_TABLE_SIZE / m;
+        b = ((i + 1) * CIRCLE_TABLE_SIZE / m) & (CIRCLE_TABLE_SIZE - 1);
+        p[4 * i] = x + r * circle_cos[a];
+        p[4 * i + 1] = y + r * circle_sin[a];
+        p[4 * i + 2] = x + r * circle_cos[b];
+        p[4 * i + 3] = y + r * circle_sin[b];
+    }
+    geom_keep(go, GEOM_CIRCLE_DASH, e, n, k);
+    *nd = n;
+    *ks = k;
+    return p;
+}
+
+// draw a dashed circle, dashes with an odd index use the set bit color
+KERNEL_INLINE void circle_border_dash_k(GRAPH_OBJ *go, const int op) {
+
+    int i, j, n, k;
+    float *p;
+    bool off;
+    ALLEGRO_COLOR c, col[2];
+    ALLEGRO_VERTEX *v;
+
+    kernel_colors(&go->gc, op, col);
+    off = COP_WRITES_OFF(op);
+    p = circle_dashes(go, &n, &k);
+    if (p == NULL) {
+        return;
+    }
+
+    v = dash_vertices((size_t)(off ? n : n / 2) * k * 2);
+    if (v == NULL) {
+        return;
+    }
+    for (i = 0; i < n; i++, p += 4 * k) {
+        if (!(i & 1) && !off) {
+            continue;
+        }
+        c = col[i & 1];
+        for (j = 0; j < k; j++) {
+            *v++ = (ALLEGRO_VERTEX){p[4 * j], p[4 * j + 1], 0, 0, 0, c};
+            *v++ = (ALLEGRO_VERTEX){p[4 * j + 2], p[4 * j + 3], 0, 0, 0, c};
+        }
+    }
+    dash_vtx_n = v - dash_vtx;
+    if (!dash_batch) {
+        dash_flush();
+    }
+}
+
+// pixels of a patterned circle border, a column at a time, memoized
+// x, the top and bottom y and the pattern indices of the top and bottom pixel
+// returns the columns, NULL if out of memory
+static int *circle_columns(GRAPH_OBJ *go, int *nc) {
+
+    int i, n, m;
+    int64_t x, h;
+    int *p;
+    GFIXED cx, cy, rad;
+    DAP_GEOM *e;
+
+    if (geom_find(go, GEOM_CIRCLE_PATTERN, &e)) {
+        *nc = e->n;
+        return e->data;
+    }
+    cx = go->gcirc.x;
+    cy = go->gcirc.y;
+    rad = go->gcirc.radius;
+    n = fix_to_int(2 * (int64_t)rad);
+    p = geom_alloc(e, (size_t)(n >= 0 ? n + 1 : 1) * 5 * sizeof(int));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    for (i = 0, m = 0; i <= n; i++) {
+
+        x = (int64_t)i * FIX_ONE - rad;
+        h = kernel_circle_column(rad, x);
+        if (h < 0) {
+            continue;
+        }
+        p[5 * m] = fix_to_int(cx + x);
+        p[5 * m + 1] = fix_to_int(cy - h);
+        p[5 * m + 2] = fix_to_int(cy + h);
+        p[5 * m + 3] = fix_to_int(cx + x + cy - h);
+        p[5 * m + 4] = fix_to_int(cx + x + cy + h);
+        m++;
+    }
+    geom_keep(go, GEOM_CIRCLE_PATTERN, e, m, 0);
+    *nc = m;
+    return p;
+}
+
+// draw a circular border using a texture pattern
+KERNEL_INLINE void circle_border_pattern_k(GRAPH_OBJ *go, const int op) {
+
+    int i, n;
+    int *p;
+    uint16_t pattern;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    pattern = go->gs.pattern;
+    p = circle_columns(go, &n);
+    if (p == NULL) {
+        return;
+    }
+
+    // top and bottom half of circle
+    for (i = 0; i < n; i++, p += 5) {
+        KERNEL_PIXEL(op, p[0], p[1], col, pattern_bit(pattern, p[3]));
+        KERNEL_PIXEL(op, p[0], p[2], col, pattern_bit(pattern, p[4]));
+    }
+}
+
+// Thick strokes
+//
+// Lines and borders wider than one pixel are drawn as triangle strips, a pair
+// of vertices either side of the stroke at every step along it, and a whole
+// shape is one al_draw_prim call. The dashes and pattern bits are decided on
+// the CPU as for one pixel lines and make runs of one colour along the
+// stroke. Each run is a piece of the same strip, joined to the one before by
+// repeating a vertex of each, so the triangles in between have no area. The
+// sides of rectangles and polygons are lengthened by half the width so the
+// corners are filled.
+
+// stroke strip of a drawing thread, grown as needed
+static __thread ALLEGRO_VERTEX *strip_vtx;
+static __thread size_t strip_vtx_size;
+static __thread size_t strip_vtx_n;
+static __thread bool strip_gap = true;      // the next pair starts a new piece
+static __thread ALLEGRO_VERTEX strip_last[2];   // last pair recorded into a frozen group
+
+// start a new piece of the strip, not joined to the last pair
+static void strip_break(void) {
+    strip_gap = true;
+}
+
+// add a pair of vertices across the stroke, o on one side and i on the other
+static void strip_pair(float ox, float oy, float ix, float iy, ALLEGRO_COLOR c) {
+
+    size_t size;
+    ALLEGRO_VERTEX *v, p[2];
+
+    p[0] = (ALLEGRO_VERTEX){ox, oy, 0, 0, 0, c};
+    p[1] = (ALLEGRO_VERTEX){ix, iy, 0, 0, 0, c};
+
+    // recorded as the quad from the last pair of the piece
+    if (freeze_rec != NULL) {
+        if (!strip_gap) {
+            freeze_quad(&strip_last[0], &strip_last[1], &p[1], &p[0]);
+        }
+        strip_last[0] = p[0];
+        strip_last[1] = p[1];
+        strip_gap = false;
+        return;
+    }
+
+    if (strip_vtx_n + 4 > strip_vtx_size) {
+        size = strip_vtx_size ? strip_vtx_size * 2 : 1024;
+        thread_buffers_keep();
+        v = realloc(strip_vtx, size * sizeof(ALLEGRO_VERTEX));
+        if (v == NULL) {
+            // out of memory, the piece starts again from the next pair
+            strip_gap = true;
+            return;
+        }
+        strip_vtx = v;
+        strip_vtx_size = size;
+    }
+
+    // a piece has an even number of vertices, so the join keeps the next one on an even index
+    v = strip_vtx + strip_vtx_n;
+    if (strip_gap && strip_vtx_n > 0) {
+        v[0] = v[-1];
+        v[1] = p[0];
+        v += 2;
+    }
+    v[0] = p[0];
+    v[1] = p[1];
+    strip_vtx_n = v + 2 - strip_vtx;
+    strip_gap = false;
+}
+
+// draw the strip
+static void strip_flush(void) {
+
+    if (strip_vtx_n >= 4) {
+        al_draw_prim(strip_vtx, NULL, NULL, 0, (int)strip_vtx_n, ALLEGRO_PRIM_TRIANGLE_STRIP);
+    }
+    strip_vtx_n = 0;
+    strip_gap = true;
+}
+
+// add a run of a straight stroke from t0 to t1 pixels along ux, uy from x, y, h pixels either side
+static void strip_run(float x, float y, float ux, float uy, float h, float t0, float t1, ALLEGRO_COLOR c) {
+
+    float nx = -uy * h, ny = ux * h;
+
+    strip_break();
+    strip_pair(x + ux * t0 + nx, y + uy * t0 + ny, x + ux * t0 - nx, y + uy * t0 - ny, c);
+    strip_pair(x + ux * t1 + nx, y + uy * t1 + ny, x + ux * t1 - nx, y + uy * t1 - ny, c);
+}
+
+// add an arc of a stroke of radius r, h pixels either side, from step a0 to a1 of m round the circle
+static void strip_arc(float x, float y, float r, float h, int a0, int a1, int m, ALLEGRO_COLOR c) {
+
+    int j, a;
+    float ro = r + h, ri = r > h ? r - h : 0;
+
+    strip_break();
+    for (j = a0; j <= a1; j++) {
+        a = (int)((int64_t)j * CIRCLE_TABLE_SIZE / m) & (CIRCLE_TABLE_SIZE - 1);
+        strip_pair(x + ro * circle_cos[a], y + ro * circle_sin[a],
+                   x + ri * circle_cos[a], y + ri * circle_sin[a], c);
+    }
+}
+
+// add the runs of a thick line, ext pixels longer at each end
+// the dashes and pattern bits are those of line_dash_k and line_pattern_k
+KERNEL_INLINE void thick_line(GRAPH_OBJ *go, const int op, const int border, float ext) {
+
+    int i, j, n, b;
+    int *p;
+    int64_t dx, dy, lf;
+    float x0, y0, l, ux, uy, h;
+    uint16_t pattern;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    dx = (int64_t)go->gline.x1 - go->gline.x0;
+    dy = (int64_t)go->gline.y1 - go->gline.y0;
+    lf = kernel_line_length(dx, dy);
+    if (lf == 0) {
+        return;
+    }
+    x0 = fix_to_float(go->gline.x0);
+    y0 = fix_to_float(go->gline.y0);
+    l = fix_to_float((GFIXED)lf);
+    ux = fix_to_float((GFIXED)dx) / l;
+    uy = fix_to_float((GFIXED)dy) / l;
+    h = 0.5f * go->gs.width;
+
+    switch (border) {
+        case BORDER_SOLID:
+        strip_run(x0, y0, ux, uy, h, -ext, l + ext, col[1]);
+        break;
+
+        case BORDER_DASH:
+        n = (int)(lf / ((int64_t)PIX_PER_DASH * FIX_ONE)) | 1;
+        for (i = 0; i < n; i++) {
+            if (COP_WRITES_OFF(op) || (i & 1) == 0) {
+                strip_run(x0, y0, ux, uy, h, i == 0 ? -ext : l * i / n,
+                          i == n - 1 ? l + ext : l * (i + 1) / n, col[(i & 1) ^ 1]);
+            }
+        }
+        break;
+
+        case BORDER_PATTERN:
+        // pixel i of the line is about i to i + 1 along it
+        p = line_pixels(go, &n);
+        if (p == NULL) {
+            return;
+        }
+        pattern = go->gs.pattern;
+        for (i = 0; i < n; i = j) {
+            b = pattern_bit(pattern, p[3 * i + 2]);
+            for (j = i + 1; j < n && pattern_bit(pattern, p[3 * j + 2]) == b; j++) {
+            }
+            if (COP_WRITES_OFF(op) || b) {
+                strip_run(x0, y0, ux, uy, h, i == 0 ? -ext : i, j == n ? l + ext : j, col[b]);
+            }
+        }
+        break;
+    }
+}
+
+// draw a thick line
+KERNEL_INLINE void line_thick_k(GRAPH_OBJ *go, const int op, const int border) {
+
+    thick_line(go, op, border, 0);
+    strip_flush();
+}
+
+// draw a thick rectangle border, a solid one as a single frame
+KERNEL_INLINE void rect_thick_k(GRAPH_OBJ *go, const int op, const int border) {
+
+    float h, x0, y0, x1, y1, mx, my;
+    GFIXED fx0 = go->grect.x0, fy0 = go->grect.y0;
+    GFIXED fx1 = go->grect.x1, fy1 = go->grect.y1;
+    GRAPH_OBJ gl = *go;
+    ALLEGRO_COLOR col[2];
+
+    h = 0.5f * go->gs.width;
+    if (border == BORDER_SOLID) {
+        kernel_colors(&go->gc, op, col);
+        x0 = fix_to_float(fx0 < fx1 ? fx0 : fx1);
+        y0 = fix_to_float(fy0 < fy1 ? fy0 : fy1);
+        x1 = fix_to_float(fx0 < fx1 ? fx1 : fx0);
+        y1 = fix_to_float(fy0 < fy1 ? fy1 : fy0);
+
+        // the inner corners meet in the middle of a rectangle narrower than the stroke
+        mx = 0.5f * (x0 + x1);
+        my = 0.5f * (y0 + y1);
+        strip_break();
+        strip_pair(x0 - h, y0 - h, fminf(x0 + h, mx), fminf(y0 + h, my), col[1]);
+        strip_pair(x1 + h, y0 - h, fmaxf(x1 - h, mx), fminf(y0 + h, my), col[1]);
+        strip_pair(x1 + h, y1 + h, fmaxf(x1 - h, mx), fmaxf(y1 - h, my), col[1]);
+        strip_pair(x0 - h, y1 + h, fminf(x0 + h, mx), fmaxf(y1 - h, my), col[1]);
+        strip_pair(x0 - h, y0 - h, fminf(x0 + h, mx), fminf(y0 + h, my), col[1]);
+        strip_flush();
+        return;
+    }
+
+    // sides as for RECT_BORDER_K, memoized under the same generations
+    gl.gtype = TYPE_LINE;
+    gl.gline = (GLINE){fx0, fy0, fx1, fy0};
+    gl.gen = go->gen ? go->gen + 1 : 0;
+    thick_line(&gl, op, border, h);
+    gl.gline = (GLINE){fx1, fy0, fx1, fy1};
+    gl.gen = go->gen ? go->gen + 2 : 0;
+    thick_line(&gl, op, border, h);
+    gl.gline = (GLINE){fx0, fy0, fx0, fy1};
+    gl.gen = go->gen ? go->gen + 3 : 0;
+    thick_line(&gl, op, border, h);
+    gl.gline = (GLINE){fx0, fy1, fx1, fy1};
+    gl.gen = go->gen ? go->gen + 4 : 0;
+    thick_line(&gl, op, border, h);
+    strip_flush();
+}
+
+// draw a thick polygon border, the sides are not memoized as for POLYGON_BORDER_K
+KERNEL_INLINE void polygon_thick_k(GRAPH_OBJ *go, const int op, const int border) {
+
+    int i, j;
+    float *p = go->gpoly.pts;
+    GRAPH_OBJ gl = *go;
+
+    gl.gtype = TYPE_LINE;
+    gl.gen = 0;
+    for (i = 0; i < go->gpoly.n; i++) {
+        j = i + 1 < go->gpoly.n ? i + 1 : 0;
+        gl.gline = (GLINE){go->gpoly.x + fix_from_float(p[2 * i]),
+                           go->gpoly.y + fix_from_float(p[2 * i + 1]),
+                           go->gpoly.x + fix_from_float(p[2 * j]),
+                           go->gpoly.y + fix_from_float(p[2 * j + 1])};
+        thick_line(&gl, op, border, 0.5f * go->gs.width);
+    }
+    strip_flush();
+}
+
+// pattern bit of step i of m round a circle, from the pixel under the middle of the stroke
+KERNEL_INLINE int circle_step_bit(uint16_t pattern, float x, float y, float r, int i, int m) {
+
+    int a = (int)((int64_t)i * CIRCLE_TABLE_SIZE / m);
+
+    return pattern_bit(pattern, (int)floorf(x + r * circle_cos[a]) + (int)floorf(y + r * circle_sin[a]));
+}
+
+// draw a thick circle border
+// dashes are those of circle_border_dash_k, the pattern is taken about a pixel at a time round the circle
+KERNEL_INLINE void circle_thick_k(GRAPH_OBJ *go, const int op, const int border) {
+
+    int i, j, n, k, m, b;
+    float x, y, r, h;
+    uint16_t pattern;
+    ALLEGRO_COLOR col[2];
+
+    pthread_once(&circle_once, circle_table_init);
+    kernel_colors(&go->gc, op, col);
+    x = fix_to_float(go->gcirc.x);
+    y = fix_to_float(go->gcirc.y);
+    r = fix_to_float(go->gcirc.radius);
+    h = 0.5f * go->gs.width;
+
+    switch (border) {
+        case BORDER_SOLID:
+        m = (int)ceilf(RAD_PER_CIRCLE * (r + h) / CIRCLE_SEG_PIXELS);
+        m = m < CIRCLE_MIN_DASHES ? CIRCLE_MIN_DASHES : m > CIRCLE_TABLE_SIZE ? CIRCLE_TABLE_SIZE : m;
+        strip_arc(x, y, r, h, 0, m, m, col[1]);
+        break;
+
+        case BORDER_DASH:
+        circle_dash_count(r, &n, &k);
+        for (i = 0; i < n; i++) {
+            if (COP_WRITES_OFF(op) || (i & 1)) {
+                strip_arc(x, y, r, h, i * k, (i + 1) * k, n * k, col[i & 1]);
+            }
+        }
+        break;
+
+        case BORDER_PATTERN:
+        m = (int)ceilf(RAD_PER_CIRCLE * r);
+        m = m < CIRCLE_MIN_DASHES ? CIRCLE_MIN_DASHES : m > CIRCLE_TABLE_SIZE ? CIRCLE_TABLE_SIZE : m;
+        pattern = go->gs.pattern;
+        for (i = 0; i < m; i = j) {
+            b = circle_step_bit(pattern, x, y, r, i, m);
+            for (j = i + 1; j < m && circle_step_bit(pattern, x, y, r, j, m) == b; j++) {
+            }
+            if (COP_WRITES_OFF(op) || b) {
+                strip_arc(x, y, r, h, i, j, m, col[b]);
+            }
+        }
+        break;
+    }
+    strip_flush();
+}
+
+// instantiate the thick strokes for each border style
+#define THICK_K(name, shape, border) \
+KERNEL_INLINE void name(GRAPH_OBJ *go, const int op) { \
+    shape(go, op, border); \
+}
+
+THICK_K(line_thick_solid_k, line_thick_k, BORDER_SOLID)
+THICK_K(line_thick_dash_k, line_thick_k, BORDER_DASH)
+THICK_K(line_thick_pattern_k, line_thick_k, BORDER_PATTERN)
+THICK_K(rect_thick_solid_k, rect_thick_k, BORDER_SOLID)
+THICK_K(rect_thick_dash_k, rect_thick_k, BORDER_DASH)
+THICK_K(rect_thick_pattern_k, rect_thick_k, BORDER_PATTERN)
+THICK_K(circle_thick_solid_k, circle_thick_k, BORDER_SOLID)
+THICK_K(circle_thick_dash_k, circle_thick_k, BORDER_DASH)
+THICK_K(circle_thick_pattern_k, circle_thick_k, BORDER_PATTERN)
+THICK_K(polygon_thick_solid_k, polygon_thick_k, BORDER_SOLID)
+THICK_K(polygon_thick_dash_k, polygon_thick_k, BORDER_DASH)
+THICK_K(polygon_thick_pattern_k, polygon_thick_k, BORDER_PATTERN)
+
+// draw raster pattern, one bit per pixel, wrapping at the raster width
+KERNEL_INLINE void raster_k(GRAPH_OBJ *go, const int op) {
+
+    int b, x, width, posx, posy;
+    size_t i, len, k, span;
+    uint8_t pattern;
+    uint8_t *ptr;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    ptr = go->grast.rdataptr;
+    len = go->grast.fdlength;
+    x = fix_to_int(go->grast.x);
+    width = go->grast.width;
+
+    // start at the pixel of the first byte, rows are width - x pixels long
+    span = width - x > 0 ? width - x : 1;
+    k = go->grast.offset * RASTER_BITS;
+    posx = x + (int)(k % span);
+    posy = fix_to_int(go->grast.y) + (int)(k / span);
+
+    for (i = 0; i < len; i++) {
+        pattern = ptr[i];
+        for (b = RASTER_BITS - 1; b >= 0; b--) {
+            KERNEL_PIXEL(op, posx, posy, col, (pattern >> b) & 1);
+            posx++;
+            if (posx >= width) {
+                posx = x;
+                posy++;
+            }
+        }
+    }
+}
+
+// Raster transforms
+//
+// dap_set_raster_transform scales a raster and turns it about its top left
+// corner. The packed source bits are sampled where they lie, they are never
+// expanded to 32 bit pixels first: the target pixels the raster covers are
+// walked a row at a time, each is mapped back into the source, and the runs
+// of one colour become span quads, drawn with one al_draw_prim call as for
+// the fills. Zooming in takes the nearest source pixel. Zooming out counts
+// the set bits in the box of source pixels under the target pixel and the
+// majority decides its colour, so the picture does not shimmer as the scale
+// changes. Whole scales without a turn are walked in the source instead,
+// a byte of equal bits at a time, and each run is one quad sx wide and sy high.
+
+// bit k of packed raster data, the most significant bit of a byte first
+KERNEL_INLINE int raster_bit(const uint8_t *p, int64_t k) {
+    return (p[k >> 3] >> (7 - (k & 7))) & 1;
+}
+
+// length of the run of bits equal to bit k, from k up to at most end
+KERNEL_INLINE int64_t raster_run(const uint8_t *p, int64_t k, int64_t end) {
+
+    int64_t j = k;
+    uint32_t w, same = raster_bit(p, k) ? 0xFF : 0;
+
+    // the bits from j to the end of its byte that differ from bit k, at the top of w
+    while (j < end) {
+        w = ((p[j >> 3] ^ same) << (j & 7)) & 0xFF;
+        if (w != 0) {
+            j += __builtin_clz(w) - 24;
+            break;
+        }
+        j = (j | 7) + 1;
+    }
+    return (j < end ? j : end) - k;
+}
+
+// number of set bits from a up to b
+KERNEL_INLINE int64_t raster_count(const uint8_t *p, int64_t a, int64_t b) {
+
+    int m;
+    int64_t n = 0;
+    uint32_t w;
+
+    while (a < b) {
+        m = 8 - (int)(a & 7);
+        m = b - a < m ? (int)(b - a) : m;
+        w = ((uint32_t)p[a >> 3] << (a & 7)) & 0xFF;
+        n += __builtin_popcount(w >> (8 - m));
+        a += m;
+    }
+    return n;
+}
+
+// bit of the target pixel whose centre maps to u, v in a raster span pixels wide
+// bits k0 up to k1 are in p, with box the fu by fv source pixels around u, v are counted
+// returns the bit, -1 if the pixel is outside the raster
+KERNEL_INLINE int raster_sample(const uint8_t *p, int64_t k0, int64_t k1, int span,
+                                float u, float v, float fu, float fv, const int box) {
+
+    int64_t iu, iv, u0, u1, v0, v1, a, b, n = 0, set = 0;
+
+    if (!box) {
+        iu = (int64_t)floorf(u);
+        iv = (int64_t)floorf(v);
+        if (iu < 0 || iu >= span || iv < 0) {
+            return -1;
+        }
+        a = iv * span + iu;
+        return a >= k0 && a < k1 ? raster_bit(p, a - k0) : -1;
+    }
+
+    // the source pixels with their centres in the box, at least one each way
+    u0 = (int64_t)ceilf(u - 0.5f * fu - 0.5f);
+    u1 = (int64_t)ceilf(u + 0.5f * fu - 0.5f);
+    u1 = u1 > u0 ? u1 : u0 + 1;
+    v0 = (int64_t)ceilf(v - 0.5f * fv - 0.5f);
+    v1 = (int64_t)ceilf(v + 0.5f * fv - 0.5f);
+    v1 = v1 > v0 ? v1 : v0 + 1;
+    u0 = u0 > 0 ? u0 : 0;
+    u1 = u1 < span ? u1 : span;
+    v0 = v0 > 0 ? v0 : 0;
+    for (iv = v0; iv < v1 && u0 < u1; iv++) {
+        a = iv * span + u0 > k0 ? iv * span + u0 : k0;
+        b = iv * span + u1 < k1 ? iv * span + u1 : k1;
+        if (a < b) {
+            n += b - a;
+            set += raster_count(p, a - k0, b - k0);
+        }
+    }
+    return n == 0 ? -1 : 2 * set >= n;
+}
+
+// draw a raster scaled by whole numbers without a turn, a run of equal source bits at a time
+// bx0, by0 to bx1, by1 are the target pixels that may be drawn
+KERNEL_INLINE void raster_scaled(GRAPH_OBJ *go, const int op, int span, int64_t k0, int64_t k1,
+                                 int bx0, int by0, int bx1, int by1, ALLEGRO_COLOR col[2]) {
+
+    int x, y, sx, sy, b;
+    int64_t iu, iv, ua, ub, va, vb, a, e, k, n;
+    const uint8_t *p = go->grast.rdataptr;
+
+    x = fix_to_int(go->grast.x);
+    y = fix_to_int(go->grast.y);
+    sx = (int)go->grast.sx;
+    sy = (int)go->grast.sy;
+
+    // the source rows and columns under the pixels that may be drawn
+    va = (int64_t)floor((double)(by0 - y) / sy);
+    vb = (int64_t)ceil((double)(by1 - y) / sy);
+    va = va > k0 / span ? va : k0 / span;
+    vb = vb < (k1 - 1) / span + 1 ? vb : (k1 - 1) / span + 1;
+    ua = (int64_t)floor((double)(bx0 - x) / sx);
+    ub = (int64_t)ceil((double)(bx1 - x) / sx);
+    ua = ua > 0 ? ua : 0;
+    ub = ub < span ? ub : span;
+
+    for (iv = va; iv < vb; iv++) {
+        a = iv * span + ua > k0 ? iv * span + ua : k0;
+        e = iv * span + ub < k1 ? iv * span + ub : k1;
+        for (k = a; k < e; k += n) {
+            b = raster_bit(p, k - k0);
+            n = raster_run(p, k - k0, e - k0);
+            if (COP_WRITES_OFF(op) || b) {
+                iu = k - iv * span;
+                span_box(x + (int)(iu * sx), y + (int)(iv * sy),
+                         x + (int)((iu + n) * sx), y + (int)((iv + 1) * sy), col[b]);
+            }
+        }
+    }
+}
+
+// draw a scaled and turned raster, mapping each target pixel back into the source
+// like raster_k, only the part of the raster from its byte offset is drawn
+KERNEL_INLINE void raster_affine_k(GRAPH_OBJ *go, const int op) {
+
+    int i, b, rb, run, span, px, py, bx0, by0, bx1, by1, cl[4];
+    int64_t k0, k1, v0, v1;
+    float ox, oy, sx, sy, c, s, u, v, du, dv, fu, fv, fx, fy, cx, cy;
+    bool box;
+    const uint8_t *p;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    p = go->grast.rdataptr;
+    span = go->grast.width - fix_to_int(go->grast.x);
+    span = span > 0 ? span : 1;
+    k0 = (int64_t)go->grast.offset * RASTER_BITS;
+    k1 = k0 + (int64_t)go->grast.fdlength * RASTER_BITS;
+    v0 = k0 / span;
+    v1 = (k1 - 1) / span + 1;
+    sx = go->grast.sx;
+    sy = go->grast.sy;
+
+    // the pixels that may be drawn, in the clipping rectangle and the band of the thread
+    al_get_clipping_rectangle(&cl[0], &cl[1], &cl[2], &cl[3]);
+    bx0 = cl[0] > span_left ? cl[0] : span_left;
+    by0 = cl[1] > span_top ? cl[1] : span_top;
+    bx1 = cl[0] + cl[2] < span_right ? cl[0] + cl[2] : span_right;
+    by1 = cl[1] + cl[3] < span_bottom ? cl[1] + cl[3] : span_bottom;
+
+    if (go->grast.angle == 0 && sx == floorf(sx) && sy == floorf(sy)) {
+        raster_scaled(go, op, span, k0, k1, bx0, by0, bx1, by1, col);
+        span_flush();
+        return;
+    }
+
+    // target x = ox + c sx u - s sy v, y = oy + s sx u + c sy v, bounded by the corners of the rows
+    ox = fix_to_float(go->grast.x);
+    oy = fix_to_float(go->grast.y);
+    c = cosf(go->grast.angle);
+    s = sinf(go->grast.angle);
+    fx = fy = INFINITY;
+    cx = cy = -INFINITY;
+    for (i = 0; i < 4; i++) {
+        u = i & 1 ? span : 0;
+        v = i & 2 ? v1 : v0;
+        fx = fminf(fx, ox + c * sx * u - s * sy * v);
+        fy = fminf(fy, oy + s * sx * u + c * sy * v);
+        cx = fmaxf(cx, ox + c * sx * u - s * sy * v);
+        cy = fmaxf(cy, oy + s * sx * u + c * sy * v);
+    }
+    bx0 = fx > bx0 ? (int)floorf(fx) : bx0;
+    by0 = fy > by0 ? (int)floorf(fy) : by0;
+    bx1 = cx < bx1 ? (int)ceilf(cx) : bx1;
+    by1 = cy < by1 ? (int)ceilf(cy) : by1;
+
+    // a step of one pixel along a target row is a step of c / sx in u and -s / sy in v
+    du = c / sx;
+    dv = -s / sy;
+    box = sx < 1 || sy < 1;
+    fu = sx < 1 ? 1 / sx : 1;
+    fv = sy < 1 ? 1 / sy : 1;
+
+    for (py = by0; py < by1; py++) {
+        fx = bx0 + 0.5f - ox;
+        fy = py + 0.5f - oy;
+        cx = (c * fx + s * fy) / sx;
+        cy = (c * fy - s * fx) / sy;
+        rb = -1;
+        run = bx0;
+        for (px = bx0; px < bx1; px++) {
+            u = cx + du * (px - bx0);
+            v = cy + dv * (px - bx0);
+            b = box ? raster_sample(p, k0, k1, span, u, v, fu, fv, 1)
+                    : raster_sample(p, k0, k1, span, u, v, fu, fv, 0);
+            if (b != rb) {
+                if (rb >= 0 && (COP_WRITES_OFF(op) || rb)) {
+                    span_quad(run, py, px, col[rb]);
+                }
+                rb = b;
+                run = px;
+            }
+        }
+        if (rb >= 0 && (COP_WRITES_OFF(op) || rb)) {
+            span_quad(run, py, bx1, col[rb]);
+        }
+    }
+    span_flush();
+}
+
+// draw a text string from the glyph atlas in one call
+// glyphs use the set bit color, character backgrounds the clear bit color
+KERNEL_INLINE void text_k(GRAPH_OBJ *go, const int op) {
+
+    int c, scale, n;
+    size_t len;
+    float x, y, x0, w, h, u, v, su, sv;
+    char *s;
+    ALLEGRO_BITMAP *atlas;
+    ALLEGRO_VERTEX *vtx, *p;
+    ALLEGRO_COLOR col[2];
+
+    kernel_colors(&go->gc, op, col);
+    s = go->gtext.str;
+    len = strlen(s);
+    atlas = text_get_atlas();
+    vtx = text_vertices(len * 12);
+    if (len == 0 || atlas == NULL || vtx == NULL) {
+        return;
+    }
+
+    scale = go->gtext.scale;
+    w = (float)(text_cell_w * scale);
+    h = (float)(text_cell_h * scale);
+    x0 = (float)fix_to_int(go->gtext.x);
+    x = x0;
+    y = (float)fix_to_int(go->gtext.y);
+    text_cell(TEXT_SOLID_CELL, &su, &sv);
+
+    p = vtx;
+    for (; *s != '\0'; s++) {
+        c = (unsigned char)*s;
+        if (c == '\n') {
+            x = x0;
+            y += h;
+            continue;
+        }
+        if (c < TEXT_FIRST_CHAR || c >= TEXT_SOLID_CELL) {
+            c = '?';
+        }
+        if (COP_WRITES_OFF(op)) {
+            p = text_quad(p, x, y, w, h, su, sv, text_cell_w, text_cell_h, col[0]);
+        }
+        if (c != ' ') {
+            text_cell(c, &u, &v);
+            p = text_quad(p, x, y, w, h, u, v, text_cell_w, text_cell_h, col[1]);
+        }
+        x += w;
+    }
+
+    n = (int)(p - vtx);
+    if (n > 0) {
+        al_draw_prim(vtx, NULL, atlas, 0, n, ALLEGRO_PRIM_TRIANGLE_LIST);
+    }
+}
+
+// empty kernel, for objects without a fill or border
+static void kernel_none(GRAPH_OBJ *go) {
+    (void)go;
+}
+
+// instantiate a kernel template for every color op
+#define DEFINE_KERNELS(name) \
+    static void name##_normal(GRAPH_OBJ *go)  { name##_k(go, COP_NORMAL); } \
+    static void name##_invert(GRAPH_OBJ *go)  { name##_k(go, COP_INVERT); } \
+    static void name##_overlay(GRAPH_OBJ *go) { name##_k(go, COP_OVERLAY); } \
+    static void name##_erase(GRAPH_OBJ *go)   { name##_k(go, COP_ERASE); }
+
+// kernel table row, indexed by color op
+#define KERNELS(name)   { name##_normal, name##_invert, name##_overlay, name##_erase }
+#define NO_KERNELS      { kernel_none, kernel_none, kernel_none, kernel_none }
+
+DEFINE_KERNELS(rect_fill_solid)
+DEFINE_KERNELS(rect_fill_vertbar)
+DEFINE_KERNELS(rect_fill_pattern)
+DEFINE_KERNELS(circle_fill_solid)
+DEFINE_KERNELS(circle_fill_vertbar)
+DEFINE_KERNELS(circle_fill_pattern)
+DEFINE_KERNELS(line_solid)
+DEFINE_KERNELS(line_dash)
+DEFINE_KERNELS(line_pattern)
+DEFINE_KERNELS(rect_border_solid)
+DEFINE_KERNELS(rect_border_dash)
+DEFINE_KERNELS(rect_border_pattern)
+DEFINE_KERNELS(circle_border_solid)
+DEFINE_KERNELS(circle_border_dash)
+DEFINE_KERNELS(circle_border_pattern)
+DEFINE_KERNELS(polygon_fill_solid)
+DEFINE_KERNELS(polygon_fill_vertbar)
+DEFINE_KERNELS(polygon_fill_pattern)
+DEFINE_KERNELS(polygon_border_solid)
+DEFINE_KERNELS(polygon_border_dash)
+DEFINE_KERNELS(polygon_border_pattern)
+DEFINE_KERNELS(rect_fill_vertbar_shader)
+DEFINE_KERNELS(rect_fill_pattern_shader)
+DEFINE_KERNELS(circle_fill_vertbar_shader)
+DEFINE_KERNELS(circle_fill_pattern_shader)
+DEFINE_KERNELS(polygon_fill_vertbar_shader)
+DEFINE_KERNELS(polygon_fill_pattern_shader)
+DEFINE_KERNELS(line_dash_shader)
+DEFINE_KERNELS(line_pattern_shader)
+DEFINE_KERNELS(rect_border_dash_shader)
+DEFINE_KERNELS(rect_border_pattern_shader)
+DEFINE_KERNELS(polygon_border_dash_shader)
+DEFINE_KERNELS(polygon_border_pattern_shader)
+DEFINE_KERNELS(line_thick_solid)
+DEFINE_KERNELS(line_thick_dash)
+DEFINE_KERNELS(line_thick_pattern)
+DEFINE_KERNELS(rect_thick_solid)
+DEFINE_KERNELS(rect_thick_dash)
+DEFINE_KERNELS(rect_thick_pattern)
+DEFINE_KERNELS(circle_thick_solid)
+DEFINE_KERNELS(circle_thick_dash)
+DEFINE_KERNELS(circle_thick_pattern)
+DEFINE_KERNELS(polygon_thick_solid)
+DEFINE_KERNELS(polygon_thick_dash)
+DEFINE_KERNELS(polygon_thick_pattern)
+DEFINE_KERNELS(raster)
+DEFINE_KERNELS(raster_affine)
+DEFINE_KERNELS(text)
+
+// fill kernels, indexed by GTYPE, GFILL and color op
+static const DAP_KERNEL fill_kernels[TYPE_MAX][FILL_MAX][COP_MAX] = {
+    [TYPE_LINE] = {
+        NO_KERNELS, NO_KERNELS, NO_KERNELS, NO_KERNELS,
+    },
+    [TYPE_CIRCLE] = {
+        [FILL_NONE] = NO_KERNELS,
+        [FILL_SOLID] = KERNELS(circle_fill_solid),
+        [FILL_VERTBARS] = KERNELS(circle_fill_vertbar),
+        [FILL_PATTERN] = KERNELS(circle_fill_pattern),
+    },
+    [TYPE_RECTANGLE] = {
+        [FILL_NONE] = NO_KERNELS,
+        [FILL_SOLID] = KERNELS(rect_fill_solid),
+        [FILL_VERTBARS] = KERNELS(rect_fill_vertbar),
+        [FILL_PATTERN] = KERNELS(rect_fill_pattern),
+    },
+    // rasters have no fill style, the raster kernel is their fill
+    [TYPE_RASTER] = {
+        KERNELS(raster), KERNELS(raster), KERNELS(raster), KERNELS(raster),
+    },
+    // text has no fill style either, the text kernel is its fill
+    [TYPE_TEXT] = {
+        KERNELS(text), KERNELS(text), KERNELS(text), KERNELS(text),
+    },
+    [TYPE_POLYGON] = {
+        [FILL_NONE] = NO_KERNELS,
+        [FILL_SOLID] = KERNELS(polygon_fill_solid),
+        [FILL_VERTBARS] = KERNELS(polygon_fill_vertbar),
+        [FILL_PATTERN] = KERNELS(polygon_fill_pattern),
+    },
+};
+
+// border kernels, indexed by GTYPE, GBORDER and color op
+static const DAP_KERNEL border_kernels[TYPE_MAX][BORDER_MAX][COP_MAX] = {
+    [TYPE_LINE] = {
+        [BORDER_NONE] = NO_KERNELS,
+        [BORDER_SOLID] = KERNELS(line_solid),
+        [BORDER_DASH] = KERNELS(line_dash),
+        [BORDER_PATTERN] = KERNELS(line_pattern),
+    },
+    [TYPE_CIRCLE] = {
+        [BORDER_NONE] = NO_KERNELS,
+        [BORDER_SOLID] = KERNELS(circle_border_solid),
+        [BORDER_DASH] = KERNELS(circle_border_dash),
+        [BORDER_PATTERN] = KERNELS(circle_border_pattern),
+    },
+    [TYPE_RECTANGLE] = {
+        [BORDER_NONE] = NO_KERNELS,
+        [BORDER_SOLID] = KERNELS(rect_border_solid),
+        [BORDER_DASH] = KERNELS(rect_border_dash),
+        [BORDER_PATTERN] = KERNELS(rect_border_pattern),
+    },
+    [TYPE_RASTER] = {
+        NO_KERNELS, NO_KERNELS, NO_KERNELS, NO_KERNELS,
+    },
+    [TYPE_TEXT] = {
+        NO_KERNELS, NO_KERNELS, NO_KERNELS, NO_KERNELS,
+    },
+    [TYPE_POLYGON] = {
+        [BORDER_NONE] = NO_KERNELS,
+        [BORDER_SOLID] = KERNELS(polygon_border_solid),
+        [BORDER_DASH] = KERNELS(polygon_border_dash),
+        [BORDER_PATTERN] = KERNELS(polygon_border_pattern),
+    },
+};
+
+// shaded fill kernels, used instead of the fill kernels when there is a pattern shader
+// styles without an entry are drawn by the fill kernels
+static const DAP_KERNEL shader_fill_kernels[TYPE_MAX][FILL_MAX][COP_MAX] = {
+    [TYPE_CIRCLE] = {
+        [FILL_VERTBARS] = KERNELS(circle_fill_vertbar_shader),
+        [FILL_PATTERN] = KERNELS(circle_fill_pattern_shader),
+    },
+    [TYPE_RECTANGLE] = {
+        [FILL_VERTBARS] = KERNELS(rect_fill_vertbar_shader),
+        [FILL_PATTERN] = KERNELS(rect_fill_pattern_shader),
+    },
+    [TYPE_POLYGON] = {
+        [FILL_VERTBARS] = KERNELS(polygon_fill_vertbar_shader),
+        [FILL_PATTERN] = KERNELS(polygon_fill_pattern_shader),
+    },
+};
+
+// shaded border kernels, circle borders are already one primitive on the CPU
+static const DAP_KERNEL shader_border_kernels[TYPE_MAX][BORDER_MAX][COP_MAX] = {
+    [TYPE_LINE] = {
+        [BORDER_DASH] = KERNELS(line_dash_shader),
+        [BORDER_PATTERN] = KERNELS(line_pattern_shader),
+    },
+    [TYPE_RECTANGLE] = {
+        [BORDER_DASH] = KERNELS(rect_border_dash_shader),
+        [BORDER_PATTERN] = KERNELS(rect_border_pattern_shader),
+    },
+    [TYPE_POLYGON] = {
+        [BORDER_DASH] = KERNELS(polygon_border_dash_shader),
+        [BORDER_PATTERN] = KERNELS(polygon_border_pattern_shader),
+    },
+};
+
+// thick border kernels, used instead of the border and shaded border kernels for widths over one
+static const DAP_KERNEL thick_border_kernels[TYPE_MAX][BORDER_MAX][COP_MAX] = {
+    [TYPE_LINE] = {
+        [BORDER_SOLID] = KERNELS(line_thick_solid),
+        [BORDER_DASH] = KERNELS(line_thick_dash),
+        [BORDER_PATTERN] = KERNELS(line_thick_pattern),
+    },
+    [TYPE_CIRCLE] = {
+        [BORDER_SOLID] = KERNELS(circle_thick_solid),
+        [BORDER_DASH] = KERNELS(circle_thick_dash),
+        [BORDER_PATTERN] = KERNELS(circle_thick_pattern),
+    },
+    [TYPE_RECTANGLE] = {
+        [BORDER_SOLID] = KERNELS(rect_thick_solid),
+        [BORDER_DASH] = KERNELS(rect_thick_dash),
+        [BORDER_PATTERN] = KERNELS(rect_thick_pattern),
+    },
+    [TYPE_POLYGON] = {
+        [BORDER_SOLID] = KERNELS(polygon_thick_solid),
+        [BORDER_DASH] = KERNELS(polygon_thick_dash),
+        [BORDER_PATTERN] = KERNELS(polygon_thick_pattern),
+    },
+};
+
+// border kernel drawn on the CPU, thick if the object is wider than one pixel
+static DAP_KERNEL cpu_border_kernel(GRAPH_OBJ *go, int op) {
+
+    if (go->gs.width > 1 && thick_border_kernels[go->gtype][go->gs.border][op] != NULL) {
+        return thick_border_kernels[go->gtype][go->gs.border][op];
+    }
+    return border_kernels[go->gtype][go->gs.border][op];
+}
+
+// raster kernels of a scaled or turned raster, indexed by color op
+static const DAP_KERNEL raster_affine_kernels[COP_MAX] = KERNELS(raster_affine);
+
+// look up and cache the fill and border kernels of an object, the shaded ones if shaded
+static void bind_kernels_shaded(GRAPH_OBJ *go, bool shaded) {
+
+    int op;
+
+    assert(go->gtype < TYPE_MAX);
+    assert(go->gs.fill < FILL_MAX);
+    assert(go->gs.border < BORDER_MAX);
+
+    op = color_op(&go->gc);
+    go->fillk = fill_kernels[go->gtype][go->gs.fill][op];
+    go->borderk = border_kernels[go->gtype][go->gs.border][op];
+    if (shaded) {
+        if (shader_fill_kernels[go->gtype][go->gs.fill][op] != NULL) {
+            go->fillk = shader_fill_kernels[go->gtype][go->gs.fill][op];
+        }
+        if (shader_border_kernels[go->gtype][go->gs.border][op] != NULL) {
+            go->borderk = shader_border_kernels[go->gtype][go->gs.border][op];
+        }
+    }
+    if (go->gs.width > 1) {
+        go->borderk = cpu_border_kernel(go, op);
+    }
+    if (go->gtype == TYPE_RASTER && go->grast.affine) {
+        go->fillk = raster_affine_kernels[op];
+    }
+}
+
+// look up and cache the kernels of an object, shaded if there is a pattern shader
+// called by every setter that changes the type, style or colors
+static void bind_kernels(GRAPH_OBJ *go) {
+    bind_kernels_shaded(go, pattern_shader != NULL);
+}
+
+// bind the kernels of an object no setter has bound, such as a zeroed one, before it is drawn
+static inline void ensure_kernels(GRAPH_OBJ *go) {
+    if (go->fillk == NULL || go->borderk == NULL) {
+        bind_kernels(go);
+    }
+}
+
+// get raster data
+// open file and memory map so it can be accessed as an array
+// returns 0 if success, otherwise -1
+ int dap_open_raster_file(GRAPH_OBJ *go, char *filename) {
+
+    assert(go != NULL);
+    assert(filename != NULL);
+
+    int r;
+    uint8_t *dataptr;
+    struct stat sb;
+
+    // open file and get stats (size)
+    go->grast.fd = open(filename, O_RDONLY, S_IRUSR | S_IWUSR);
+    assert(go->grast.fd != -1);
+
+    r = fstat(go->grast.fd, &sb);
+    if (r == -1) {
+        go->grast.fdlength = 0;
+        return -1;
+    }
+    else {
+        go->grast.fdlength = sb.st_size;
+    }
+
+    // memory map file, return pointer to array of data bytes
+    dataptr = mmap(NULL, go->grast.fdlength, PROT_READ, MAP_PRIVATE, go->grast.fd, 0);
+    if (dataptr == MAP_FAILED) {
+        go->grast.rdataptr = NULL;
+        return -1;
+    }
+    else {
         go->grast.rdataptr = dataptr;
     }
 
-    return 0;
+    return 0;
+}
+
+// close raster file
+// data loaded by dap_load_raster_file has no file open, its mapping is unmapped instead
+// returns 0 if success, otherwise -1
+ int dap_close_raster_file(GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    int r = 0;
+
+    if (go->grast.owned) {
+        r = munmap(go->grast.rdataptr, go->grast.fdlength);
+        go->grast.rdataptr = NULL;
+        go->grast.fdlength = 0;
+        go->grast.owned = false;
+    }
+    if (go->grast.fd != -1) {
+        r = close(go->grast.fd) == -1 ? -1 : r;
+        go->grast.fd = -1;
+    }
+    return r;
+}
+
+// Asynchronous raster loading
+//
+// dap_load_raster_file opens, maps and pre-faults a raster file on a loader
+// thread, so the page faults of a cold file are not taken by the first draw.
+// The loader asks for readahead with posix_fadvise, maps the file with
+// MAP_POPULATE and marks it MADV_WILLNEED, then publishes the mapping. The
+// object takes the data over on the first draw or dap_raster_ready after the
+// loader is done; until then dap_draw_raster draws a dashed placeholder frame
+// instead of blocking.
+
+enum LOAD_STATE {
+    LOAD_PENDING,
+    LOAD_READY,
+    LOAD_FAILED,
+};
+
+// background load of a raster file
+typedef struct dload {
+    pthread_t thread;
+    char *filename;     // copy of the file name
+    int state;          // LOAD_STATE, accessed atomically
+    size_t length;      // file length, 0 until known, accessed atomically
+    uint8_t *data;      // mapped file, valid once the state is LOAD_READY
+} DAP_RASTER_LOAD;
+
+// open, map and pre-fault a raster file, the loader thread
+static void *raster_loader(void *arg) {
+
+    int fd;
+    uint8_t *data;
+    struct stat sb;
+    DAP_RASTER_LOAD *ld = arg;
+
+    fd = open(ld->filename, O_RDONLY);
+    if (fd == -1) {
+        __atomic_store_n(&ld->state, LOAD_FAILED, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+        close(fd);
+        __atomic_store_n(&ld->state, LOAD_FAILED, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    __atomic_store_n(&ld->length, (size_t)sb.st_size, __ATOMIC_RELEASE);
+
+    // start reading the whole file, then map it with its pages already faulted in
+    posix_fadvise(fd, 0, sb.st_size, POSIX_FADV_WILLNEED);
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        __atomic_store_n(&ld->state, LOAD_FAILED, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    madvise(data, sb.st_size, MADV_WILLNEED);
+
+    ld->data = data;
+    __atomic_store_n(&ld->state, LOAD_READY, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// set raster file, loaded in the background
+// the object draws a placeholder until the file is mapped, there is no file to close
+// returns 0 if the load started, otherwise -1
+int dap_load_raster_file(GRAPH_OBJ *go, char *filename, float x0, float y0, int width) {
+
+    assert(go != NULL);
+    assert(filename != NULL);
+    assert(width > 0);
+
+    DAP_RASTER_LOAD *ld;
+
+    raster_cancel(go);
+    go->gtype = TYPE_RASTER;
+    go->grast.x = fix_from_float(x0);
+    go->grast.y = fix_from_float(y0);
+    go->grast.width = width;
+    go->grast.fd = -1;
+    go->grast.fdlength = 0;
+    go->grast.rdataptr = NULL;
+    go->grast.offset = 0;
+    go->grast.load = NULL;
+    go->grast.owned = false;
+    go->grast.affine = false;
+    geom_changed(go);
+    bind_kernels(go);
+
+    ld = calloc(1, sizeof(DAP_RASTER_LOAD));
+    if (ld == NULL) {
+        return -1;
+    }
+    ld->filename = strdup(filename);
+    ld->state = LOAD_PENDING;
+    if (ld->filename == NULL || pthread_create(&ld->thread, NULL, raster_loader, ld) != 0) {
+        free(ld->filename);
+        free(ld);
+        return -1;
+    }
+    go->grast.load = ld;
+    return 0;
+}
+
+// take over the data of a finished load
+// returns 0 if the raster has data, otherwise -1
+static int raster_adopt(GRAPH_OBJ *go) {
+
+    DAP_RASTER_LOAD *ld = go->grast.load;
+
+    pthread_join(ld->thread, NULL);
+    go->grast.load = NULL;
+    if (ld->state == LOAD_READY) {
+        go->grast.rdataptr = ld->data;
+        go->grast.fdlength = ld->length;
+        go->grast.owned = true;
+        TRACE(TRACE_SET_RASTER_DATA, go, fix_to_float(go->grast.x), fix_to_float(go->grast.y),
+              go->grast.width, go->grast.rdataptr, go->grast.fdlength);
+        if (go->grast.affine) {
+            TRACE(TRACE_SET_RASTER_TRANSFORM, go, go->grast.sx, go->grast.sy, go->grast.angle);
+        }
+    }
+    free(ld->filename);
+    free(ld);
+    return go->grast.rdataptr != NULL ? 0 : -1;
+}
+
+// drop the load a raster object still has and the mapping it owns, before the object is set again
+// waits for the loader, so the loader never writes a load that was freed
+static void raster_cancel(GRAPH_OBJ *go) {
+
+    DAP_RASTER_LOAD *ld;
+
+    if (go->gtype != TYPE_RASTER) {
+        return;
+    }
+    if (go->grast.owned) {
+        munmap(go->grast.rdataptr, go->grast.fdlength);
+        go->grast.rdataptr = NULL;
+        go->grast.owned = false;
+    }
+    if (go->grast.load == NULL) {
+        return;
+    }
+    ld = go->grast.load;
+    pthread_join(ld->thread, NULL);
+    go->grast.load = NULL;
+    if (ld->state == LOAD_READY) {
+        munmap(ld->data, ld->length);
+    }
+    free(ld->filename);
+    free(ld);
+}
+
+// check a raster loaded by dap_load_raster_file, never blocks
+// returns 1 if the data is ready, 0 while loading, -1 if the load failed
+int dap_raster_ready(GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    assert(go->gtype == TYPE_RASTER);
+
+    if (go->grast.load == NULL) {
+        return go->grast.rdataptr != NULL ? 1 : -1;
+    }
+    if (__atomic_load_n(&go->grast.load->state, __ATOMIC_ACQUIRE) == LOAD_PENDING) {
+        return 0;
+    }
+    return raster_adopt(go) == 0 ? 1 : -1;
+}
+
+// wait for a raster loaded by dap_load_raster_file
+// returns 0 if the data is ready, otherwise -1
+int dap_raster_wait(GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    assert(go->gtype == TYPE_RASTER);
+
+    if (go->grast.load == NULL) {
+        return go->grast.rdataptr != NULL ? 0 : -1;
+    }
+    return raster_adopt(go);
+}
+
+// draw the dashed frame of a raster still loading, one row high until its length is known
+static void draw_raster_placeholder(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    int span;
+    size_t len, rows;
+    GRAPH_OBJ ph;
+
+    len = __atomic_load_n(&go->grast.load->length, __ATOMIC_ACQUIRE);
+    span = go->grast.width - fix_to_int(go->grast.x);
+    span = span > 0 ? span : 1;
+    rows = (len * RASTER_BITS + span - 1) / span;
+    rows = rows > 0 ? rows : 1;
+
+    memcpy(&ph, go, sizeof(GRAPH_OBJ));
+    ph.gtype = TYPE_RECTANGLE;
+    ph.gs.border = BORDER_DASH;
+    ph.grect.x0 = go->grast.x;
+    ph.grect.y0 = go->grast.y;
+    ph.grect.x1 = go->grast.x + span * FIX_ONE;
+    ph.grect.y1 = go->grast.y + (GFIXED)rows * FIX_ONE;
+    ph.gen = 0;
+    bind_kernels(&ph);
+    ctx_draw(ctx, &ph, CMD_BORDER);
+}
+
+// draw raster pattern
+// a raster still loading in the background is drawn as a placeholder
+// returns 0 if success, otherwise -1
+int dap_draw_raster(GRAPH_OBJ *go) {
+    return dap_ctx_draw_raster(NULL, go);
+}
+
+// draw raster pattern in a context
+// returns 0 if success, otherwise -1
+int dap_ctx_draw_raster(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+
+    if (go->gtype == TYPE_RASTER && go->grast.load != NULL) {
+        switch (dap_raster_ready(go))
+        {
+            case 0:
+            draw_raster_placeholder(ctx, go);
+            return 0;
+
+            case -1:
+            return -1;
+        }
+    }
+    TRACE_DRAW(ctx, TRACE_DRAW_RASTER, go);
+
+    if ((go->grast.width == 0) || (go->grast.fdlength == 0) || go->grast.rdataptr == NULL) {
+        // nothing to draw
+        return -1;
+    }
+
+    if (go->gtype == TYPE_RASTER) {
+        ctx_draw(ctx, go, CMD_FILL);
+    }
+    return 0;
+}
+
+// Incremental raster update
+//
+// dap_update_raster keeps a copy of the raster data last drawn and compares
+// the new data with it a 64 bit word at a time. Only the runs of changed
+// bytes are drawn again, each as a part of the raster starting at its byte
+// offset, so the cost follows the amount of change. The target must keep its
+// pixels between updates, a memory bitmap or a window surface, and the object
+// must write both colours, COP_NORMAL or COP_INVERT, so changed clear bits
+// are drawn too. Overlay and erase draw only the set bits and would leave the
+// old ones standing, which no redraw short of clearing the target undoes.
+
+// start incremental updates of a raster object, keeping a copy of its data
+// returns 0 if success, otherwise -1
+int dap_raster_diff_init(DAP_RASTER_DIFF *rd, GRAPH_OBJ *go) {
+
+    assert(rd != NULL);
+    assert(go != NULL);
+    assert(go->gtype == TYPE_RASTER);
+
+    memset(rd, 0, sizeof(DAP_RASTER_DIFF));
+    rd->prev = malloc(go->grast.fdlength);
+    if (rd->prev == NULL) {
+        return -1;
+    }
+    memcpy(rd->prev, go->grast.rdataptr, go->grast.fdlength);
+    rd->len = go->grast.fdlength;
+    return 0;
+}
+
+// free the copy kept for incremental updates
+void dap_raster_diff_free(DAP_RASTER_DIFF *rd) {
+
+    assert(rd != NULL);
+
+    free(rd->prev);
+    rd->prev = NULL;
+    rd->len = 0;
+}
+
+// draw bytes first to last of the raster data
+static void draw_raster_run(GRAPH_OBJ *go, uint8_t *data, size_t first, size_t last) {
+
+    GRAPH_OBJ run;
+
+    memcpy(&run, go, sizeof(GRAPH_OBJ));
+    run.grast.rdataptr = data + first;
+    run.grast.fdlength = last - first + 1;
+    run.grast.offset = first;
+    draw_or_queue(&run, CMD_FILL);
+}
+
+// point a raster object at new data of the same length and draw only the bytes that changed
+// the data must stay valid until it is drawn, like dap_set_raster_data
+// the object must write both colours, it must not be in overlay or erase mode
+// returns the number of changed runs drawn if success, otherwise -1
+int dap_update_raster(GRAPH_OBJ *go, DAP_RASTER_DIFF *rd, uint8_t *data) {
+
+    assert(go != NULL);
+    assert(rd != NULL && rd->prev != NULL);
+    assert(data != NULL);
+    assert(COP_WRITES_OFF(color_op(&go->gc)));
+
+    size_t i, nwords, first = 0, last = 0, a, b;
+    uint64_t wa, wb, d;
+    bool inrun = false;
+
+    if (go->gtype != TYPE_RASTER || go->grast.fdlength != rd->len) {
+        return -1;
+    }
+    TRACE(TRACE_UPDATE_RASTER, go, data, rd->len);
+    go->grast.rdataptr = data;
+    rd->nbytes = 0;
+    rd->nruns = 0;
+
+    // find the changed bytes a word at a time, the first byte in memory is the
+    // lowest of a word on little endian hosts and the highest on big endian ones
+    nwords = rd->len / sizeof(uint64_t);
+    for (i = 0; i <= nwords; i++) {
+        if (i < nwords) {
+            memcpy(&wa, rd->prev + i * sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&wb, data + i * sizeof(uint64_t), sizeof(uint64_t));
+        }
+        else {
+            // tail bytes, the missing ones compare equal
+            wa = wb = 0;
+            memcpy(&wa, rd->prev + i * sizeof(uint64_t), rd->len % sizeof(uint64_t));
+            memcpy(&wb, data + i * sizeof(uint64_t), rd->len % sizeof(uint64_t));
+        }
+        d = wa ^ wb;
+        if (d == 0) {
+            continue;
+        }
+        if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            a = i * sizeof(uint64_t) + __builtin_ctzll(d) / 8;
+            b = i * sizeof(uint64_t) + (63 - __builtin_clzll(d)) / 8;
+        }
+        else {
+            a = i * sizeof(uint64_t) + __builtin_clzll(d) / 8;
+            b = i * sizeof(uint64_t) + (63 - __builtin_ctzll(d)) / 8;
+        }
+
+        // join runs separated by a short gap, otherwise draw the open run
+        if (inrun && a - last <= RASTER_DIFF_GAP) {
+            last = b;
+            continue;
+        }
+        if (inrun) {
+            draw_raster_run(go, data, first, last);
+            rd->nbytes += last - first + 1;
+            rd->nruns++;
+        }
+        first = a;
+        last = b;
+        inrun = true;
+    }
+    if (inrun) {
+        draw_raster_run(go, data, first, last);
+        rd->nbytes += last - first + 1;
+        rd->nruns++;
+    }
+
+    memcpy(rd->prev, data, rd->len);
+    return rd->nruns;
+}
+
+// draw a line
+void dap_draw_line(GRAPH_OBJ *go) {
+    dap_ctx_draw_line(NULL, go);
+}
+
+// draw rectangle fill
+void dap_draw_rectangle_fill(GRAPH_OBJ *go) {
+    dap_ctx_draw_rectangle_fill(NULL, go);
+}
+
+// draw circle fill
+void dap_draw_circle_fill(GRAPH_OBJ *go) {
+    dap_ctx_draw_circle_fill(NULL, go);
+}
+
+// draw circle border
+void dap_draw_circle_border(GRAPH_OBJ *go) {
+    dap_ctx_draw_circle_border(NULL, go);
+}
+
+// draw rectangle border
+void dap_draw_rectangle_border(GRAPH_OBJ *go) {
+    dap_ctx_draw_rectangle_border(NULL, go);
+}
+
+// draw a circle
+void dap_draw_circle(GRAPH_OBJ *go) {
+    dap_ctx_draw_circle(NULL, go);
+}
+
+// draw a rectangle
+void dap_draw_rectangle(GRAPH_OBJ *go) {
+    dap_ctx_draw_rectangle(NULL, go);
+}
+
+// draw text
+void dap_draw_text(GRAPH_OBJ *go) {
+    dap_ctx_draw_text(NULL, go);
+}
+
+// draw a polygon, its fill then its border
+void dap_draw_polygon(GRAPH_OBJ *go) {
+    dap_ctx_draw_polygon(NULL, go);
+}
+
+// Compact scenes
+//
+// A scene holds very many objects as compact records: whole pixel int16
+// coordinates, palette indexed colours and the style packed in a byte, 12 to
+// 14 bytes where a GRAPH_OBJ takes about a hundred. Records are kept in one
+// pool per object type, in chunks carved from the arena of the scene, so they
+// are drawn in long sequential runs and the whole scene is cleared in O(1) by
+// resetting the arena. Pools are drawn in enum GTYPE order, so objects of
+// different types must not depend on their stacking order.
+
+// compact record size of each object type, 0 if the type has none
+static const size_t compact_size[TYPE_MAX] = {
+    [TYPE_LINE] = sizeof(DAP_CLINE),
+    [TYPE_CIRCLE] = sizeof(DAP_CCIRCLE),
+    [TYPE_RECTANGLE] = sizeof(DAP_CRECT),
+    [TYPE_RASTER] = sizeof(DAP_CRASTER),
+};
+
+// take len bytes, 16 byte aligned, from the arena
+// returns a pointer if success, otherwise NULL
+static void *arena_alloc(DAP_ARENA *a, size_t len) {
+
+    assert(len <= ARENA_BLOCK_SIZE);
+
+    DAP_BLOCK *b;
+    void *p;
+
+    len = (len + 15) & ~(size_t)15;
+    if (a->cur == NULL || a->used + len > ARENA_BLOCK_SIZE) {
+
+        // reuse the blocks kept by the last reset before taking new ones
+        b = a->cur != NULL ? a->cur->next : a->first;
+        if (b == NULL) {
+            b = malloc(sizeof(DAP_BLOCK) + ARENA_BLOCK_SIZE);
+            if (b == NULL) {
+                return NULL;
+            }
+            b->next = NULL;
+            if (a->cur != NULL) {
+                a->cur->next = b;
+            }
+            else {
+                a->first = b;
+            }
+            a->nblocks++;
+        }
+        a->cur = b;
+        a->used = 0;
+    }
+    p = a->cur->data + a->used;
+    a->used += len;
+    return p;
+}
+
+// append a zeroed record to a pool, its padding is saved to scene files as it is
+// returns a pointer to the record if success, otherwise NULL
+static void *pool_alloc(DAP_POOL *pool, DAP_ARENA *a) {
+
+    DAP_CHUNK *c = pool->last;
+    uint8_t *rec;
+
+    if (c == NULL || c->n == POOL_CHUNK_RECS) {
+        c = arena_alloc(a, sizeof(DAP_CHUNK) + POOL_CHUNK_RECS * pool->size);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->next = NULL;
+        c->n = 0;
+        if (pool->last != NULL) {
+            pool->last->next = c;
+        }
+        else {
+            pool->first = c;
+        }
+        pool->last = c;
+    }
+    pool->count++;
+    rec = c->recs + c->n++ * pool->size;
+    memset(rec, 0, pool->size);
+    return rec;
+}
+
+// create an empty scene
+// returns the scene if success, otherwise NULL
+DAP_SCENE *dap_scene_create(void) {
+
+    int i;
+    DAP_SCENE *sc;
+
+    sc = calloc(1, sizeof(DAP_SCENE));
+    if (sc == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < TYPE_MAX; i++) {
+        sc->pools[i].size = compact_size[i];
+    }
+    return sc;
+}
+
+// remove every object and colour, the arena keeps its blocks for reuse
+void dap_scene_clear(DAP_SCENE *sc) {
+
+    assert(sc != NULL);
+    int i;
+
+    for (i = 0; i < TYPE_MAX; i++) {
+        sc->pools[i].count = 0;
+        sc->pools[i].first = NULL;
+        sc->pools[i].last = NULL;
+    }
+    sc->ncolors = 0;
+    sc->arena.cur = NULL;
+    sc->arena.used = 0;
+}
+
+// free a scene and its arena
+void dap_scene_destroy(DAP_SCENE *sc) {
+
+    assert(sc != NULL);
+    DAP_BLOCK *b, *next;
+
+    for (b = sc->arena.first; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(sc);
+}
+
+// number of objects in a scene
+size_t dap_scene_count(DAP_SCENE *sc) {
+
+    assert(sc != NULL);
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < TYPE_MAX; i++) {
+        n += sc->pools[i].count;
+    }
+    return n;
+}
+
+// bytes of memory held by the arena of a scene
+size_t dap_scene_bytes(DAP_SCENE *sc) {
+
+    assert(sc != NULL);
+    return sc->arena.nblocks * (sizeof(DAP_BLOCK) + ARENA_BLOCK_SIZE);
+}
+
+// palette index of a colour, added to the palette if it is new
+// returns the index if success, otherwise -1 if the palette is full
+int dap_scene_color(DAP_SCENE *sc, ALLEGRO_COLOR c) {
+
+    assert(sc != NULL);
+    int i;
+
+    for (i = 0; i < sc->ncolors; i++) {
+        if (memcmp(&sc->palette[i], &c, sizeof(ALLEGRO_COLOR)) == 0) {
+            return i;
+        }
+    }
+    if (sc->ncolors == SCENE_PALETTE_SIZE) {
+        return -1;
+    }
+    sc->palette[sc->ncolors] = c;
+    return sc->ncolors++;
+}
+
+// true if a fixed point coordinate is a whole pixel that fits a record
+static bool fits_int16(GFIXED f) {
+    int v = fix_to_int(f);
+    return v >= INT16_MIN && v <= INT16_MAX;
+}
+
+// add a copy of a line, rectangle, circle or raster to a scene, coordinates are truncated to whole pixels
+// raster data is not copied, it must stay mapped while the scene is drawn or saved
+// returns 0 if success, otherwise -1 if the object has no compact record, does not fit one,
+// or the scene is out of memory or colours
+// records keep neither a stroke width nor a raster transform, so thick lines and borders
+// and scaled or turned rasters do not fit one
+int dap_scene_add(DAP_SCENE *sc, GRAPH_OBJ *go) {
+
+    assert(sc != NULL);
+    assert(go != NULL);
+
+    int fg, bg;
+    uint8_t style;
+    DAP_CLINE *l;
+    DAP_CRECT *r;
+    DAP_CCIRCLE *c;
+    DAP_CRASTER *ra;
+
+    if (go->gtype < 0 || go->gtype >= TYPE_MAX || sc->pools[go->gtype].size == 0) {
+        return -1;
+    }
+    if ((go->gtype != TYPE_RASTER && go->gs.width > 1) || (go->gtype == TYPE_RASTER && go->grast.affine)) {
+        return -1;
+    }
+
+    fg = dap_scene_color(sc, go->gc.fg);
+    bg = dap_scene_color(sc, go->gc.bg);
+    if (fg == -1 || bg == -1) {
+        return -1;
+    }
+    style = go->gs.border | go->gs.fill << CSTYLE_FILL_SHIFT;
+    style |= go->gs.clip ? CSTYLE_CLIP : 0;
+    style |= go->gc.invert ? CSTYLE_INVERT : 0;
+    style |= go->gc.overlay ? CSTYLE_OVERLAY : 0;
+    style |= go->gc.erase ? CSTYLE_ERASE : 0;
+
+    switch (go->gtype)
+    {
+        case TYPE_LINE:
+        if (!fits_int16(go->gline.x0) || !fits_int16(go->gline.y0) ||
+            !fits_int16(go->gline.x1) || !fits_int16(go->gline.y1)) {
+            return -1;
+        }
+        l = pool_alloc(&sc->pools[TYPE_LINE], &sc->arena);
+        if (l == NULL) {
+            return -1;
+        }
+        l->x0 = fix_to_int(go->gline.x0);
+        l->y0 = fix_to_int(go->gline.y0);
+        l->x1 = fix_to_int(go->gline.x1);
+        l->y1 = fix_to_int(go->gline.y1);
+        l->pattern = go->gs.pattern;
+        l->style = style;
+        l->fg = fg;
+        l->bg = bg;
+        break;
+
+        case TYPE_RECTANGLE:
+        if (!fits_int16(go->grect.x0) || !fits_int16(go->grect.y0) ||
+            !fits_int16(go->grect.x1) || !fits_int16(go->grect.y1)) {
+            return -1;
+        }
+        r = pool_alloc(&sc->pools[TYPE_RECTANGLE], &sc->arena);
+        if (r == NULL) {
+            return -1;
+        }
+        r->x0 = fix_to_int(go->grect.x0);
+        r->y0 = fix_to_int(go->grect.y0);
+        r->x1 = fix_to_int(go->grect.x1);
+        r->y1 = fix_to_int(go->grect.y1);
+        r->pattern = go->gs.pattern;
+        r->style = style;
+        r->fg = fg;
+        r->bg = bg;
+        break;
+
+        case TYPE_CIRCLE:
+        if (!fits_int16(go->gcirc.x) || !fits_int16(go->gcirc.y) || !fits_int16(go->gcirc.radius)) {
+            return -1;
+        }
+        c = pool_alloc(&sc->pools[TYPE_CIRCLE], &sc->arena);
+        if (c == NULL) {
+            return -1;
+        }
+        c->x = fix_to_int(go->gcirc.x);
+        c->y = fix_to_int(go->gcirc.y);
+        c->radius = fix_to_int(go->gcirc.radius);
+        c->pattern = go->gs.pattern;
+        c->style = style;
+        c->fg = fg;
+        c->bg = bg;
+        break;
+
+        case TYPE_RASTER:
+        if (!fits_int16(go->grast.x) || !fits_int16(go->grast.y) ||
+            go->grast.width > UINT16_MAX || go->grast.fdlength > UINT32_MAX) {
+            return -1;
+        }
+        ra = pool_alloc(&sc->pools[TYPE_RASTER], &sc->arena);
+        if (ra == NULL) {
+            return -1;
+        }
+        ra->x = fix_to_int(go->grast.x);
+        ra->y = fix_to_int(go->grast.y);
+        ra->width = go->grast.width;
+        ra->length = go->grast.fdlength;
+        ra->data = (uintptr_t)go->grast.rdataptr;
+        ra->style = style;
+        ra->fg = fg;
+        ra->bg = bg;
+        break;
+    }
+    return 0;
+}
+
+// expand a compact style into an object, kernels are bound only when it changed
+static void expand_style(ALLEGRO_COLOR *palette, GRAPH_OBJ *go, uint64_t *last, uint16_t pattern, uint8_t style, uint8_t fg, uint8_t bg) {
+
+    uint64_t key = (uint64_t)pattern << 24 | (uint64_t)style << 16 | (uint64_t)fg << 8 | bg;
+
+    if (key == *last) {
+        return;
+    }
+    *last = key;
+    go->gs.border = style & CSTYLE_BORDER_MASK;
+    go->gs.fill = (style & CSTYLE_FILL_MASK) >> CSTYLE_FILL_SHIFT;
+    go->gs.pattern = pattern;
+    go->gs.clip = (style & CSTYLE_CLIP) != 0;
+    go->gc.invert = (style & CSTYLE_INVERT) != 0;
+    go->gc.overlay = (style & CSTYLE_OVERLAY) != 0;
+    go->gc.erase = (style & CSTYLE_ERASE) != 0;
+    go->gc.fg = palette[fg];
+    go->gc.bg = palette[bg];
+    bind_kernels(go);
+}
+
+// draw a run of compact records of one type
+// go carries the expanded style from one run to the next, last is its key
+// raster data is at base plus the record data, base is NULL when data is an address
+static void draw_records(ALLEGRO_COLOR *palette, int type, uint8_t *recs, uint32_t n,
+                         uint8_t *base, GRAPH_OBJ *go, uint64_t *last) {
+
+    uint32_t i;
+    DAP_CLINE *l;
+    DAP_CRECT *r;
+    DAP_CCIRCLE *c;
+    DAP_CRASTER *ra;
+
+    // records change from one to the next, they are not memoized
+    go->gtype = type;
+    go->gen = 0;
+    switch (type)
+    {
+        case TYPE_LINE:
+        for (i = 0, l = (DAP_CLINE *)recs; i < n; i++, l++) {
+            expand_style(palette, go, last, l->pattern, l->style, l->fg, l->bg);
+            go->gline.x0 = l->x0 * FIX_ONE;
+            go->gline.y0 = l->y0 * FIX_ONE;
+            go->gline.x1 = l->x1 * FIX_ONE;
+            go->gline.y1 = l->y1 * FIX_ONE;
+            draw_or_queue(go, CMD_BORDER);
+        }
+        break;
+
+        case TYPE_CIRCLE:
+        for (i = 0, c = (DAP_CCIRCLE *)recs; i < n; i++, c++) {
+            expand_style(palette, go, last, c->pattern, c->style, c->fg, c->bg);
+            go->gcirc.x = c->x * FIX_ONE;
+            go->gcirc.y = c->y * FIX_ONE;
+            go->gcirc.radius = c->radius * FIX_ONE;
+            draw_or_queue(go, CMD_FILL);
+            draw_or_queue(go, CMD_BORDER);
+        }
+        break;
+
+        case TYPE_RECTANGLE:
+        for (i = 0, r = (DAP_CRECT *)recs; i < n; i++, r++) {
+            expand_style(palette, go, last, r->pattern, r->style, r->fg, r->bg);
+            go->grect.x0 = r->x0 * FIX_ONE;
+            go->grect.y0 = r->y0 * FIX_ONE;
+            go->grect.x1 = r->x1 * FIX_ONE;
+            go->grect.y1 = r->y1 * FIX_ONE;
+            draw_or_queue(go, CMD_FILL);
+            draw_or_queue(go, CMD_BORDER);
+        }
+        break;
+
+        case TYPE_RASTER:
+        go->grast.affine = false;
+        for (i = 0, ra = (DAP_CRASTER *)recs; i < n; i++, ra++) {
+            if (ra->width == 0 || ra->length == 0) {
+                continue;
+            }
+            expand_style(palette, go, last, 0, ra->style, ra->fg, ra->bg);
+            go->grast.x = ra->x * FIX_ONE;
+            go->grast.y = ra->y * FIX_ONE;
+            go->grast.width = ra->width;
+            go->grast.fd = -1;
+            go->grast.fdlength = ra->length;
+            go->grast.rdataptr = (uint8_t *)(uintptr_t)((uintptr_t)base + ra->data);
+            go->grast.offset = 0;
+            go->grast.load = NULL;
+            go->grast.owned = false;
+            draw_or_queue(go, CMD_FILL);
+        }
+        break;
+    }
+}
+
+// draw every object of a scene, a pool at a time
+void dap_scene_draw(DAP_SCENE *sc) {
+
+    assert(sc != NULL);
+
+    int t;
+    uint64_t last;
+    DAP_CHUNK *ch;
+    GRAPH_OBJ go;
+
+    memset(&go, 0, sizeof(GRAPH_OBJ));
+    for (t = 0; t < TYPE_MAX; t++) {
+        last = UINT64_MAX;
+        for (ch = sc->pools[t].first; ch != NULL; ch = ch->next) {
+            draw_records(sc->palette, t, ch->recs, ch->n, NULL, &go, &last);
+        }
+    }
+}
+
+// Scene files
+//
+// A scene file is a compact scene laid out for mmap: a header, the palette,
+// one section of records per object type and the raster data, all at 16 byte
+// aligned offsets from the start of the file. Nothing in it is a pointer, so
+// dap_scene_map checks the header and the raster bounds and the records are
+// drawn straight from the mapped pages. Switching screens costs the page
+// faults of the records drawn, not a decoding pass.
+
+// write n zero bytes
+static int write_pad(FILE *f, size_t n) {
+
+    static const uint8_t zero[16];
+
+    assert(n <= sizeof(zero));
+    return fwrite(zero, 1, n, f) == n ? 0 : -1;
+}
+
+// round up to a multiple of 16
+static size_t align16(size_t n) {
+    return (n + 15) & ~(size_t)15;
+}
+
+// save a compact scene, with the raster data it references, to a scene file
+// returns 0 if success, otherwise -1
+int dap_scene_save(DAP_SCENE *sc, char *filename) {
+
+    assert(sc != NULL);
+    assert(filename != NULL);
+
+    int t, r = 0;
+    uint32_t i;
+    size_t off, len, blob;
+    FILE *f;
+    DAP_FILE_HEADER hdr;
+    DAP_CHUNK *ch;
+    DAP_CRASTER ra;
+
+    // lay out the header, palette, sections and raster data
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SCENE_FILE_MAGIC;
+    hdr.version = SCENE_FILE_VERSION;
+    off = align16(sizeof(hdr));
+    hdr.palette = off;
+    off += SCENE_PALETTE_SIZE * sizeof(ALLEGRO_COLOR);
+    for (t = 0; t < TYPE_MAX; t++) {
+        if (sc->pools[t].count == 0) {
+            continue;
+        }
+        hdr.sections[t].offset = off;
+        hdr.sections[t].count = sc->pools[t].count;
+        hdr.sections[t].size = sc->pools[t].size;
+        off = align16(off + sc->pools[t].count * sc->pools[t].size);
+    }
+    blob = off;
+    for (ch = sc->pools[TYPE_RASTER].first; ch != NULL; ch = ch->next) {
+        for (i = 0; i < ch->n; i++) {
+            off += align16(((DAP_CRASTER *)ch->recs)[i].length);
+        }
+    }
+    if (off > UINT32_MAX) {
+        return -1;
+    }
+    hdr.length = off;
+
+    f = fopen(filename, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    r |= fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+    r |= write_pad(f, align16(sizeof(hdr)) - sizeof(hdr));
+    r |= fwrite(sc->palette, sizeof(ALLEGRO_COLOR), SCENE_PALETTE_SIZE, f) == SCENE_PALETTE_SIZE ? 0 : -1;
+
+    // records, raster data addresses become offsets into the file
+    for (t = 0; t < TYPE_MAX && r == 0; t++) {
+        if (sc->pools[t].count == 0) {
+            continue;
+        }
+        len = sc->pools[t].count * sc->pools[t].size;
+        for (ch = sc->pools[t].first; ch != NULL; ch = ch->next) {
+            if (t != TYPE_RASTER) {
+                r |= fwrite(ch->recs, sc->pools[t].size, ch->n, f) == ch->n ? 0 : -1;
+                continue;
+            }
+            for (i = 0; i < ch->n; i++) {
+                memcpy(&ra, &((DAP_CRASTER *)ch->recs)[i], sizeof(ra));
+                ra.data = blob;
+                blob += align16(ra.length);
+                r |= fwrite(&ra, sizeof(ra), 1, f) == 1 ? 0 : -1;
+            }
+        }
+        r |= write_pad(f, align16(len) - len);
+    }
+
+    // raster data
+    for (ch = sc->pools[TYPE_RASTER].first; ch != NULL && r == 0; ch = ch->next) {
+        for (i = 0; i < ch->n; i++) {
+            memcpy(&ra, &((DAP_CRASTER *)ch->recs)[i], sizeof(ra));
+            r |= fwrite((uint8_t *)(uintptr_t)ra.data, 1, ra.length, f) == ra.length ? 0 : -1;
+            r |= write_pad(f, align16(ra.length) - ra.length);
+        }
+    }
+
+    if (fclose(f) != 0) {
+        r = -1;
+    }
+    return r;
+}
+
+// check the header and the raster bounds of a mapped scene file
+// returns 0 if the file can be drawn, otherwise -1
+static int check_scene_file(DAP_SCENE_FILE *sf) {
+
+    int t;
+    uint32_t i;
+    uint64_t end;
+    DAP_FILE_HEADER *hdr = sf->hdr;
+    DAP_FILE_SECTION *sec;
+    DAP_CRASTER *ra;
+
+    if (sf->length < sizeof(DAP_FILE_HEADER) || hdr->magic != SCENE_FILE_MAGIC ||
+        hdr->version != SCENE_FILE_VERSION || hdr->length != sf->length) {
+        return -1;
+    }
+    if (hdr->palette % 16 != 0 ||
+        (uint64_t)hdr->palette + SCENE_PALETTE_SIZE * sizeof(ALLEGRO_COLOR) > sf->length) {
+        return -1;
+    }
+    for (t = 0; t < SCENE_FILE_SECTIONS; t++) {
+        sec = &hdr->sections[t];
+        if (sec->count == 0) {
+            continue;
+        }
+        if (t >= TYPE_MAX || compact_size[t] == 0 || sec->size != compact_size[t] || sec->offset % 16 != 0) {
+            return -1;
+        }
+        end = (uint64_t)sec->offset + (uint64_t)sec->count * sec->size;
+        if (end > sf->length) {
+            return -1;
+        }
+    }
+
+    sec = &hdr->sections[TYPE_RASTER];
+    ra = (DAP_CRASTER *)(sf->base + sec->offset);
+    for (i = 0; i < sec->count; i++) {
+        if (ra[i].data > sf->length || ra[i].length > sf->length - ra[i].data) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// map a scene file
+// returns the mapped file if success, otherwise NULL if it cannot be read or is not a valid scene file
+DAP_SCENE_FILE *dap_scene_map(char *filename) {
+
+    assert(filename != NULL);
+
+    int fd;
+    struct stat sb;
+    void *p;
+    DAP_SCENE_FILE *sf;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(DAP_FILE_HEADER)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+
+    sf = malloc(sizeof(DAP_SCENE_FILE));
+    if (sf == NULL) {
+        munmap(p, sb.st_size);
+        return NULL;
+    }
+    sf->base = p;
+    sf->length = sb.st_size;
+    sf->hdr = p;
+    if (check_scene_file(sf) == -1) {
+        munmap(p, sb.st_size);
+        free(sf);
+        return NULL;
+    }
+    return sf;
+}
+
+// unmap a scene file
+// queued draws of it must be drawn first
+void dap_scene_unmap(DAP_SCENE_FILE *sf) {
+
+    assert(sf != NULL);
+
+    munmap(sf->base, sf->length);
+    free(sf);
+}
+
+// draw every object of a mapped scene file, a section at a time
+// the file must stay mapped until queued draws of it are drawn
+void dap_scene_file_draw(DAP_SCENE_FILE *sf) {
+
+    assert(sf != NULL);
+
+    int t;
+    uint64_t last;
+    DAP_FILE_SECTION *sec;
+    GRAPH_OBJ go;
+
+    memset(&go, 0, sizeof(GRAPH_OBJ));
+    for (t = 0; t < TYPE_MAX; t++) {
+        sec = &sf->hdr->sections[t];
+        if (sec->count == 0) {
+            continue;
+        }
+        last = UINT64_MAX;
+        draw_records((ALLEGRO_COLOR *)(sf->base + sf->hdr->palette), t,
+                     sf->base + sec->offset, sec->count, sf->base, &go, &last);
+    }
+}
+
+// Render thread
+//
+// dap_queue_create starts a thread that owns the display. Any thread can then
+// submit draw commands, copies of the object with its bound kernels, to a
+// bounded lock-free ring. Submitting reserves a slot with one compare and
+// swap and publishes it with the slot sequence number, so it never takes a
+// lock unless the render thread is asleep. The render thread drains every
+// published command in one batch before it sleeps again.
+
+// queue the dap_draw_* calls of this thread go to, NULL to draw on the calling thread
+static __thread DAP_QUEUE *target_queue;
+
+// set the queue the dap_draw_* calls of this thread go to, NULL to draw immediately
+void dap_set_target_queue(DAP_QUEUE *q) {
+    target_queue = q;
+}
+
+// get the queue the dap_draw_* calls of this thread go to
+DAP_QUEUE *dap_get_target_queue(void) {
+    return target_queue;
+}
+
+// draw a command on the current target bitmap
+static void exec_cmd(DAP_CMD *cmd) {
+
+    switch (cmd->op)
+    {
+        case CMD_FILL:
+        if (view_on) {
+            view_draw(&cmd->obj, CMD_FILL);
+            break;
+        }
+        cmd->obj.fillk(&cmd->obj);
+        break;
+
+        case CMD_BORDER:
+        if (view_on) {
+            view_draw(&cmd->obj, CMD_BORDER);
+            break;
+        }
+        cmd->obj.borderk(&cmd->obj);
+        break;
+
+        case CMD_CLEAR:
+        al_clear_to_color(indexed_target != NULL ? indexed_color(cmd->color) : cmd->color);
+        break;
+
+        case CMD_FLIP:
+        al_flip_display();
+        if (cmd->pacer != NULL) {
+            frame_presented(cmd->pacer, cmd->deadline);
+        }
+        break;
+
+        case CMD_COMPOSE:
+        compose_windows(cmd->wins, cmd->nwins);
+        break;
+
+        case CMD_BATCH_BEGIN:
+        circle_batch(true);
+        break;
+
+        case CMD_BATCH_END:
+        if (view_on) {
+            view_use(true);
+        }
+        circle_batch(false);
+        break;
+
+        case CMD_CAPTURE:
+        capture_frame(cmd->capture);
+        break;
+
+        case CMD_VIEW:
+        view_set(&cmd->view);
+        break;
+
+        case CMD_FREEZE:
+        if (view_on) {
+            view_use(true);
+        }
+        dap_freeze_draw(cmd->freeze);
+        break;
+
+        default:
+        assert(cmd->op < CMD_MAX);
+        break;
+    }
+}
+
+// submit a command to the render thread
+// returns 0 if success, otherwise -1 if the queue is full
+int dap_queue_submit(DAP_QUEUE *q, DAP_CMD *cmd) {
+
+    assert(q != NULL);
+    assert(cmd != NULL);
+
+    uint32_t pos, seq;
+    DAP_SLOT *slot;
+
+    // reserve a slot, its sequence number equals pos when it is free
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if ((int32_t)(seq - pos) < 0) {
+            // slot not drawn yet, queue is full
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    // publish the command, then wake the render thread if it is waiting
+    memcpy(&slot->cmd, cmd, sizeof(DAP_CMD));
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) {
+        al_lock_mutex(q->mutex);
+        al_signal_cond(q->cond);
+        al_unlock_mutex(q->mutex);
+    }
+    return 0;
+}
+
+// submit a command, yielding while the queue is full
+static void queue_cmd(DAP_QUEUE *q, DAP_CMD *cmd) {
+
+    while (dap_queue_submit(q, cmd) == -1) {
+        sched_yield();
+    }
+}
+
+// run a kernel of an object now, or queue it if this thread has a target queue
+static void draw_or_queue(GRAPH_OBJ *go, int op) {
+
+    DAP_CMD cmd;
+
+    ensure_kernels(go);
+    if (target_queue == NULL) {
+        if (op == CMD_FILL) {
+            go->fillk(go);
+        }
+        else {
+            go->borderk(go);
+        }
+        return;
+    }
+
+    cmd.op = op;
+    memcpy(&cmd.obj, go, sizeof(GRAPH_OBJ));
+    queue_cmd(target_queue, &cmd);
+}
+
+// clear the display, or queue the clear if this thread has a target queue
+void dap_clear(ALLEGRO_COLOR c) {
+
+    DAP_CMD cmd;
+
+    TRACE(TRACE_CLEAR, NULL, c);
+    if (target_queue == NULL) {
+        al_clear_to_color(indexed_target != NULL ? indexed_color(c) : c);
+        return;
+    }
+    cmd.op = CMD_CLEAR;
+    cmd.color = c;
+    queue_cmd(target_queue, &cmd);
+}
+
+// flip the display, or queue the flip if this thread has a target queue
+void dap_flip(void) {
+
+    DAP_CMD cmd;
+
+    TRACE(TRACE_FLIP, NULL);
+    if (target_queue == NULL) {
+        al_flip_display();
+        return;
+    }
+    cmd.op = CMD_FLIP;
+    cmd.pacer = NULL;
+    queue_cmd(target_queue, &cmd);
+}
+
+// gather the dashed circle borders drawn until dap_circle_batch_end, queued
+// if this thread has a target queue
+// do not clear or flip the display inside a batch
+void dap_circle_batch_begin(void) {
+
+    DAP_CMD cmd;
+
+    TRACE(TRACE_CIRCLE_BATCH_BEGIN, NULL);
+    if (target_queue == NULL) {
+        circle_batch(true);
+        return;
+    }
+    cmd.op = CMD_BATCH_BEGIN;
+    queue_cmd(target_queue, &cmd);
+}
+
+// draw the gathered dashed circle borders in one call, queued if this thread has a target queue
+void dap_circle_batch_end(void) {
+
+    DAP_CMD cmd;
+
+    TRACE(TRACE_CIRCLE_BATCH_END, NULL);
+    if (target_queue == NULL) {
+        circle_batch(false);
+        return;
+    }
+    cmd.op = CMD_BATCH_END;
+    queue_cmd(target_queue, &cmd);
+}
+
+// true if the next slot has a published command
+static bool queue_ready(DAP_QUEUE *q) {
+    return __atomic_load_n(&q->slots[q->tail & q->mask].seq, __ATOMIC_SEQ_CST) == q->tail + 1;
+}
+
+// draw every published command, returns the number drawn
+static int queue_drain(DAP_QUEUE *q) {
+
+    int n = 0;
+    DAP_SLOT *slot;
+
+    while (queue_ready(q)) {
+        slot = &q->slots[q->tail & q->mask];
+        exec_cmd(&slot->cmd);
+        if (slot->cmd.op == CMD_FLIP) {
+            q->nflips++;
+        }
+
+        // free the slot for the submission one lap ahead
+        __atomic_store_n(&slot->seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+        q->tail++;
+        n++;
+    }
+    q->ncmds += n;
+    return n;
+}
+
+// render thread, owns the display until it is stopped
+static void *render_thread(ALLEGRO_THREAD *thr, void *arg) {
+
+    DAP_QUEUE *q = arg;
+
+    al_set_target_backbuffer(q->display);
+
+    for (;;) {
+
+        if (queue_drain(q) > 0) {
+            continue;
+        }
+        if (al_get_thread_should_stop(thr)) {
+            break;
+        }
+
+        // nothing to draw, sleep until a command is submitted
+        al_lock_mutex(q->mutex);
+        __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (!queue_ready(q) && !al_get_thread_should_stop(thr)) {
+            al_wait_cond(q->cond, q->mutex);
+        }
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+        al_unlock_mutex(q->mutex);
+    }
+
+    // release the display so the creating thread can use it again
+    al_set_target_bitmap(NULL);
+    return NULL;
+}
+
+// create a command queue and start its render thread
+// the calling thread must release the display first, with al_set_target_bitmap(NULL)
+// size is the number of command slots, a power of 2
+// returns the queue if success, otherwise NULL
+DAP_QUEUE *dap_queue_create(ALLEGRO_DISPLAY *display, uint32_t size) {
+
+    assert(display != NULL);
+    assert(size > 1 && (size & (size - 1)) == 0);
+
+    uint32_t i;
+    DAP_QUEUE *q;
+
+    if (posix_memalign((void **)&q, 64, sizeof(DAP_QUEUE)) != 0) {
+        return NULL;
+    }
+    memset(q, 0, sizeof(DAP_QUEUE));
+
+    q->slots = calloc(size, sizeof(DAP_SLOT));
+    if (q->slots == NULL) {
+        free(q);
+        return NULL;
+    }
+    for (i = 0; i < size; i++) {
+        q->slots[i].seq = i;
+    }
+    q->mask = size - 1;
+    q->display = display;
+    q->mutex = al_create_mutex();
+    q->cond = al_create_cond();
+    q->thread = al_create_thread(render_thread, q);
+    if (q->mutex == NULL || q->cond == NULL || q->thread == NULL) {
+        if (q->thread != NULL) {
+            al_destroy_thread(q->thread);
+        }
+        if (q->cond != NULL) {
+            al_destroy_cond(q->cond);
+        }
+        if (q->mutex != NULL) {
+            al_destroy_mutex(q->mutex);
+        }
+        free(q->slots);
+        free(q);
+        return NULL;
+    }
+
+    al_start_thread(q->thread);
+    return q;
+}
+
+// draw the commands already submitted, stop the render thread and free the queue
+// the display is released, the calling thread can target it again afterwards
+void dap_queue_destroy(DAP_QUEUE *q) {
+
+    assert(q != NULL);
+
+    al_set_thread_should_stop(q->thread);
+    al_lock_mutex(q->mutex);
+    al_signal_cond(q->cond);
+    al_unlock_mutex(q->mutex);
+    al_join_thread(q->thread, NULL);
+
+    al_destroy_thread(q->thread);
+    al_destroy_cond(q->cond);
+    al_destroy_mutex(q->mutex);
+    free(q->slots);
+    free(q);
+}
+
+
+// Contexts
+//
+// A context is an explicit drawing state: the surface it draws to, the
+// colours and style new objects start from, and a command buffer. The
+// dap_ctx_* calls record their commands in the buffer instead of drawing, so
+// several threads can each build part of a screen in their own context at
+// the same time, touching nothing shared. dap_ctx_submit then draws the
+// buffers of any number of contexts as one frame, in context order, on the
+// calling thread or its render queue. The dap_draw_* calls are the dap_ctx_*
+// calls with no context, drawing at once on the thread's implicit target.
+//
+// The dap_set_* setters take no context. They only write the object they are
+// given, besides the atomic generation counter and the trace, which is written
+// under its lock, so threads setting up objects of their own need no shared
+// state to be passed around. dap_ctx_object starts such an object from the
+// defaults of a context. The demo and the test scenes draw with the global
+// GRAPH_OBJ g on one thread; the -p workers each set up objects of their own.
+
+// contexts created so far, numbers them in traces
+static uint32_t ctx_ids;
+
+// create a context drawing to target, NULL for the thread's target or queue at submit time
+// new objects start with the window colours, solid border and fill and a 0xFF00 pattern
+// returns a pointer to the context if success, otherwise NULL
+DAP_CTX *dap_ctx_create(ALLEGRO_BITMAP *target) {
+
+    DAP_CTX *ctx;
+
+    ctx = calloc(1, sizeof(DAP_CTX));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->target = target;
+    ctx->id = __atomic_add_fetch(&ctx_ids, 1, __ATOMIC_RELAXED);
+    ctx->view.zoom = 1;
+    ctx->defaults.gtype = TYPE_RECTANGLE;
+    ctx->defaults.gc.fg = DEFAULT_WINDOW_FGCOLOR;
+    ctx->defaults.gc.bg = DEFAULT_WINDOW_BGCOLOR;
+    ctx->defaults.gs.border = BORDER_SOLID;
+    ctx->defaults.gs.fill = FILL_SOLID;
+    ctx->defaults.gs.pattern = 0xFF00;
+    bind_kernels(&ctx->defaults);
+    return ctx;
+}
+
+// destroy a context and its command buffer
+void dap_ctx_destroy(DAP_CTX *ctx) {
+
+    assert(ctx != NULL);
+
+    free(ctx->cmds);
+    free(ctx);
+}
+
+// start an object from the defaults of a context, every field set
+void dap_ctx_object(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(ctx != NULL);
+    assert(go != NULL);
+
+    memcpy(go, &ctx->defaults, sizeof(GRAPH_OBJ));
+    TRACE(TRACE_CTX_OBJECT, go, (int)ctx->id);
+}
+
+// next free command of a context, the buffer doubles when full
+// returns NULL if out of memory, the command is then dropped
+static DAP_CMD *ctx_cmd(DAP_CTX *ctx) {
+
+    size_t size;
+    DAP_CMD *cmds;
+
+    if (ctx->ncmds == ctx->size) {
+        size = ctx->size ? ctx->size * 2 : 256;
+        cmds = realloc(ctx->cmds, size * sizeof(DAP_CMD));
+        if (cmds == NULL) {
+            ctx->ndropped++;
+            return NULL;
+        }
+        ctx->cmds = cmds;
+        ctx->size = size;
+    }
+    return &ctx->cmds[ctx->ncmds++];
+}
+
+// record a kernel of an object in a context, or draw or queue it now without one
+static void ctx_draw(DAP_CTX *ctx, GRAPH_OBJ *go, int op) {
+
+    DAP_CMD *cmd;
+
+    if (ctx == NULL) {
+        draw_or_queue(go, op);
+        return;
+    }
+    ensure_kernels(go);
+    cmd = ctx_cmd(ctx);
+    if (cmd != NULL) {
+        cmd->op = op;
+        memcpy(&cmd->obj, go, sizeof(GRAPH_OBJ));
+    }
+}
+
+// draw a line in a context
+void dap_ctx_draw_line(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_LINE, go);
+    if (go->gtype == TYPE_LINE) {
+        ctx_draw(ctx, go, CMD_BORDER);
+    }
+}
+
+// draw rectangle fill in a context
+void dap_ctx_draw_rectangle_fill(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_RECTANGLE_FILL, go);
+    if (go->gtype == TYPE_RECTANGLE) {
+        ctx_draw(ctx, go, CMD_FILL);
+    }
+}
+
+// draw circle fill in a context
+void dap_ctx_draw_circle_fill(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_CIRCLE_FILL, go);
+    if (go->gtype == TYPE_CIRCLE) {
+        ctx_draw(ctx, go, CMD_FILL);
+    }
+}
+
+// draw circle border in a context
+void dap_ctx_draw_circle_border(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_CIRCLE_BORDER, go);
+    if (go->gtype == TYPE_CIRCLE) {
+        ctx_draw(ctx, go, CMD_BORDER);
+    }
+}
+
+// draw rectangle border in a context
+void dap_ctx_draw_rectangle_border(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_RECTANGLE_BORDER, go);
+    if (go->gtype == TYPE_RECTANGLE) {
+        ctx_draw(ctx, go, CMD_BORDER);
+    }
+}
+
+// draw a circle in a context
+void dap_ctx_draw_circle(DAP_CTX *ctx, GRAPH_OBJ *go) {
+    assert(go != NULL);
+    dap_ctx_draw_circle_fill(ctx, go);
+    dap_ctx_draw_circle_border(ctx, go);
+}
+
+// draw a rectangle in a context
+void dap_ctx_draw_rectangle(DAP_CTX *ctx, GRAPH_OBJ *go) {
+    assert(go != NULL);
+    dap_ctx_draw_rectangle_fill(ctx, go);
+    dap_ctx_draw_rectangle_border(ctx, go);
+}
+
+// draw text in a context
+void dap_ctx_draw_text(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_TEXT, go);
+    if (go->gtype == TYPE_TEXT) {
+        ctx_draw(ctx, go, CMD_FILL);
+    }
+}
+
+// draw a polygon in a context, its fill then its border
+void dap_ctx_draw_polygon(DAP_CTX *ctx, GRAPH_OBJ *go) {
+
+    assert(go != NULL);
+    TRACE_DRAW(ctx, TRACE_DRAW_POLYGON, go);
+    if (go->gtype == TYPE_POLYGON && go->gpoly.n > 1) {
+        ctx_draw(ctx, go, CMD_FILL);
+        ctx_draw(ctx, go, CMD_BORDER);
+    }
+}
+
+// clear in a context
+void dap_ctx_clear(DAP_CTX *ctx, ALLEGRO_COLOR c) {
+
+    DAP_CMD *cmd;
+
+    if (ctx == NULL) {
+        dap_clear(c);
+        return;
+    }
+    TRACE(TRACE_CTX_CLEAR, NULL, (int)ctx->id, c);
+    cmd = ctx_cmd(ctx);
+    if (cmd != NULL) {
+        cmd->op = CMD_CLEAR;
+        cmd->color = c;
+    }
+}
+
+// draw the commands recorded in n contexts as one frame, in context order, and empty the contexts
+// commands are drawn on the calling thread, or queued if it has a target queue
+// contexts with a target surface can only be drawn on the calling thread
+void dap_ctx_submit(DAP_CTX **ctxs, int n) {
+
+    int i;
+    size_t k;
+    bool viewed;
+    DAP_CTX *ctx;
+    DAP_CMD view, end;
+    ALLEGRO_BITMAP *prev;
+
+    assert(ctxs != NULL);
+
+    if (trace_rec != NULL) {
+        trace_ctx_submit(ctxs, n);
+    }
+
+    // the commands of a context with a view are drawn between setting it and ending it
+    memset(&view, 0, sizeof(DAP_CMD));
+    memset(&end, 0, sizeof(DAP_CMD));
+    view.op = CMD_VIEW;
+    end.op = CMD_VIEW;
+    end.view.zoom = 1;
+
+    for (i = 0; i < n; i++) {
+        ctx = ctxs[i];
+        viewed = !view_identity(&ctx->view);
+        view.view = ctx->view;
+        if (target_queue != NULL) {
+            assert(ctx->target == NULL);
+            if (viewed) {
+                queue_cmd(target_queue, &view);
+            }
+            for (k = 0; k < ctx->ncmds; k++) {
+                queue_cmd(target_queue, &ctx->cmds[k]);
+            }
+            if (viewed) {
+                queue_cmd(target_queue, &end);
+            }
+        }
+        else {
+            prev = al_get_target_bitmap();
+            if (ctx->target != NULL) {
+                al_set_target_bitmap(ctx->target);
+            }
+            if (viewed) {
+                exec_cmd(&view);
+            }
+            for (k = 0; k < ctx->ncmds; k++) {
+                exec_cmd(&ctx->cmds[k]);
+            }
+            if (viewed) {
+                exec_cmd(&end);
+            }
+            if (ctx->target != NULL) {
+                al_set_target_bitmap(prev);
+            }
+        }
+        ctx->ncmds = 0;
+    }
+}
+
+// Views
+//
+// dap_ctx_set_view pans and zooms everything a context draws, applied when
+// the context is submitted, so moving the view costs a redraw and no object
+// is set again. The view is a command on the drawing thread, before and after
+// the commands of the context. Kernels that draw lines, dashes, strips, text
+// or frozen groups are drawn in the coordinates of the objects through an
+// ALLEGRO_TRANSFORM, so their memoized geometry and vertex buffers stay
+// valid. Fills, patterned one pixel borders and rasters are drawn from a copy
+// of the object moved into target pixels, so the span generators still walk
+// whole target pixels and the patterns stay one target pixel to a bit.
+
+// view of a drawing thread, set by CMD_VIEW, with view_on
+static __thread DAP_VIEW view_cur;
+static __thread ALLEGRO_TRANSFORM view_base;    // transform of the target before the view
+static __thread ALLEGRO_TRANSFORM view_tf;      // view_base after the view
+static __thread bool view_tf_used;      // view_tf is the current transform
+static __thread float *view_pts;        // polygon points moved into target pixels, grown as needed
+static __thread int view_pts_size;
+
+// Thread buffers
+//
+// A drawing thread grows its vertex, edge, point and memo buffers as it needs
+// them and keeps them for its next draws. The first time it grows one, the
+// thread is registered with a key whose destructor frees them all when it
+// exits, so render threads and workers that come and go do not leak them.
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread bool thread_kept;       // the buffers of the thread are freed when it exits
+
+// free the buffers of an exiting thread
+static void thread_buffers_free(void *p) {
+
+    (void)p;
+    free(text_vtx);
+    text_vtx = NULL;
+    text_vtx_size = 0;
+    free(dash_vtx);
+    dash_vtx = NULL;
+    dash_vtx_size = dash_vtx_n = 0;
+    free(span_vtx);
+    span_vtx = NULL;
+    span_vtx_size = span_vtx_n = 0;
+    free(poly_edges);
+    free(poly_xs);
+    poly_edges = NULL;
+    poly_xs = NULL;
+    poly_edges_size = 0;
+    free(strip_vtx);
+    strip_vtx = NULL;
+    strip_vtx_size = strip_vtx_n = 0;
+    free(view_pts);
+    view_pts = NULL;
+    view_pts_size = 0;
+    geom_table_free();
+}
+
+static void thread_key_create(void) {
+    pthread_key_create(&thread_key, thread_buffers_free);
+}
+
+// have the buffers of the calling thread freed when it exits, called before one is grown
+static void thread_buffers_keep(void) {
+
+    if (!thread_kept) {
+        pthread_once(&thread_once, thread_key_create);
+        thread_kept = pthread_setspecific(thread_key, &thread_kept) == 0;
+    }
+}
+
+// true if a view moves nothing
+static bool view_identity(DAP_VIEW *v) {
+    return v->x == 0 && v->y == 0 && v->zoom == 1;
+}
+
+// use the transform of the view for vector kernels, or the target's own for pixel kernels
+static void view_use(bool vector) {
+
+    if (vector != view_tf_used) {
+        al_use_transform(vector ? &view_tf : &view_base);
+        view_tf_used = vector;
+    }
+}
+
+// set the view of the commands that follow on this thread, the identity ends it
+static void view_set(DAP_VIEW *v) {
+
+    // dashed circles gathered under the old view are drawn with it
+    if (view_on) {
+        view_use(true);
+        dash_flush();
+        view_use(false);
+        view_on = false;
+    }
+    if (view_identity(v)) {
+        return;
+    }
+    view_cur = *v;
+    al_copy_transform(&view_base, al_get_current_transform());
+    al_identity_transform(&view_tf);
+    al_scale_transform(&view_tf, v->zoom, v->zoom);
+    al_translate_transform(&view_tf, v->x, v->y);
+    al_compose_transform(&view_tf, &view_base);
+    view_tf_used = false;
+    view_on = true;
+}
+
+// true if the kernel of an object draws vectors, which the transform of the view can move
+static bool view_vector(GRAPH_OBJ *go, int op) {
+
+    if (op == CMD_FILL) {
+        return go->gtype == TYPE_TEXT;
+    }
+    switch (go->gs.border) {
+        case BORDER_SOLID:
+        return true;
+
+        // the dash shader works from the line in target pixels
+        case BORDER_DASH:
+        return go->gs.width > 1 || pattern_shader == NULL || go->gtype == TYPE_CIRCLE;
+
+        default:
+        return go->gs.width > 1;
+    }
+}
+
+// move a coordinate into target pixels
+static float view_move(GFIXED f, float offset) {
+    return fix_to_float(f) * view_cur.zoom + offset;
+}
+
+// true if the box between two corners in target pixels misses the clipping rectangle
+static bool view_missed(float x0, float y0, float x1, float y1) {
+
+    int cx, cy, cw, ch;
+
+    al_get_clipping_rectangle(&cx, &cy, &cw, &ch);
+    return fmaxf(x0, x1) < cx - 1 || fmaxf(y0, y1) < cy - 1 ||
+           fminf(x0, x1) > cx + cw + 1 || fminf(y0, y1) > cy + ch + 1;
+}
+
+// true if the box between two corners in target pixels is within FIX_LIMIT, past it fixed point wraps
+static bool view_fits(float x0, float y0, float x1, float y1) {
+    return fabsf(x0) < FIX_LIMIT && fabsf(y0) < FIX_LIMIT && fabsf(x1) < FIX_LIMIT && fabsf(y1) < FIX_LIMIT;
+}
+
+// copy an object moved into target pixels, not memoized as the view changes from frame to frame
+// objects that miss the target or do not fit in fixed point once moved are not drawn,
+// the zoom can move them far past the target
+// returns 0 if success, otherwise -1 if out of memory or there is nothing to draw
+static int view_object(GRAPH_OBJ *dst, GRAPH_OBJ *go) {
+
+    int i, span;
+    float z = view_cur.zoom, x = view_cur.x, y = view_cur.y;
+    float f[4], lo[2], hi[2], r;
+    float *p;
+
+    memcpy(dst, go, sizeof(GRAPH_OBJ));
+    dst->gen = 0;
+    switch (go->gtype) {
+        case TYPE_LINE:
+        f[0] = view_move(go->gline.x0, x);
+        f[1] = view_move(go->gline.y0, y);
+        f[2] = view_move(go->gline.x1, x);
+        f[3] = view_move(go->gline.y1, y);
+        if (view_missed(f[0], f[1], f[2], f[3]) || !view_fits(f[0], f[1], f[2], f[3])) {
+            return -1;
+        }
+        dst->gline = (GLINE){fix_from_float(f[0]), fix_from_float(f[1]), fix_from_float(f[2]), fix_from_float(f[3])};
+        break;
+
+        case TYPE_RECTANGLE:
+        f[0] = view_move(go->grect.x0, x);
+        f[1] = view_move(go->grect.y0, y);
+        f[2] = view_move(go->grect.x1, x);
+        f[3] = view_move(go->grect.y1, y);
+        if (view_missed(f[0], f[1], f[2], f[3]) || !view_fits(f[0], f[1], f[2], f[3])) {
+            return -1;
+        }
+        dst->grect = (GRECTANGLE){fix_from_float(f[0]), fix_from_float(f[1]), fix_from_float(f[2]), fix_from_float(f[3])};
+        break;
+
+        case TYPE_CIRCLE:
+        f[0] = view_move(go->gcirc.x, x);
+        f[1] = view_move(go->gcirc.y, y);
+        f[2] = view_move(go->gcirc.radius, 0);
+        if (view_missed(f[0] - f[2], f[1] - f[2], f[0] + f[2], f[1] + f[2]) ||
+            !view_fits(f[0] - f[2], f[1] - f[2], f[0] + f[2], f[1] + f[2])) {
+            return -1;
+        }
+        dst->gcirc = (GCIRCLE){fix_from_float(f[0]), fix_from_float(f[1]), fix_from_float(f[2])};
+        break;
+
+        case TYPE_POLYGON:
+        if (go->gpoly.n * 2 > view_pts_size) {
+            thread_buffers_keep();
+            p = realloc(view_pts, (size_t)go->gpoly.n * 2 * sizeof(float));
+            if (p == NULL) {
+                return -1;
+            }
+            view_pts = p;
+            view_pts_size = go->gpoly.n * 2;
+        }
+        f[0] = view_move(go->gpoly.x, x);
+        f[1] = view_move(go->gpoly.y, y);
+        lo[0] = hi[0] = f[0];
+        lo[1] = hi[1] = f[1];
+        for (i = 0; i < go->gpoly.n * 2; i++) {
+            view_pts[i] = go->gpoly.pts[i] * z;
+            lo[i & 1] = fminf(lo[i & 1], f[i & 1] + view_pts[i]);
+            hi[i & 1] = fmaxf(hi[i & 1], f[i & 1] + view_pts[i]);
+        }
+        if (view_missed(lo[0], lo[1], hi[0], hi[1]) || !view_fits(lo[0], lo[1], hi[0], hi[1])) {
+            return -1;
+        }
+        dst->gpoly.x = fix_from_float(f[0]);
+        dst->gpoly.y = fix_from_float(f[1]);
+        dst->gpoly.pts = view_pts;
+        break;
+
+        // rows keep their length in raster pixels, the zoom becomes part of the raster transform
+        case TYPE_RASTER:
+        span = go->grast.width - fix_to_int(go->grast.x);
+        span = span > 0 ? span : 1;
+        dst->grast.sx = (go->grast.affine ? go->grast.sx : 1) * z;
+        dst->grast.sy = (go->grast.affine ? go->grast.sy : 1) * z;
+        // whatever the angle, within a row length and the height of the rows of the origin,
+        // the kernel clips the rows themselves in float, only the origin is in fixed point
+        f[0] = view_move(go->grast.x, x);
+        f[1] = view_move(go->grast.y, y);
+        r = span * fabsf(dst->grast.sx) +
+            ((float)(go->grast.offset + go->grast.fdlength) * RASTER_BITS / span + 1) * fabsf(dst->grast.sy);
+        if (view_missed(f[0] - r, f[1] - r, f[0] + r, f[1] + r) || !view_fits(f[0], f[1], f[0], f[1])) {
+            return -1;
+        }
+        dst->grast.x = fix_from_float(f[0]);
+        dst->grast.y = fix_from_float(f[1]);
+        dst->grast.width = fix_to_int(dst->grast.x) + span;
+        dst->grast.angle = go->grast.affine ? go->grast.angle : 0;
+        dst->grast.affine = go->grast.affine || z != 1;
+        break;
+    }
+    bind_kernels(dst);
+    return 0;
+}
+
+// run the fill or border kernel of an object under the view
+static void view_draw(GRAPH_OBJ *go, int op) {
+
+    GRAPH_OBJ moved;
+
+    if (view_vector(go, op)) {
+        view_use(true);
+        if (op == CMD_FILL) {
+            go->fillk(go);
+        }
+        else {
+            go->borderk(go);
+        }
+        return;
+    }
+    view_use(false);
+    if (view_object(&moved, go) == -1) {
+        return;
+    }
+    if (op == CMD_FILL) {
+        moved.fillk(&moved);
+    }
+    else {
+        moved.borderk(&moved);
+    }
+}
+
+// set the view of a context, it draws the point x, y of an object at x * zoom + vx, y * zoom + vy
+// the view applies to every command of the context when it is submitted
+void dap_ctx_set_view(DAP_CTX *ctx, float vx, float vy, float zoom) {
+
+    assert(ctx != NULL);
+    assert(zoom > 0);
+
+    TRACE(TRACE_CTX_SET_VIEW, NULL, (int)ctx->id, vx, vy, zoom);
+    ctx->view = (DAP_VIEW){vx, vy, zoom};
+}
+
+// draw a frozen group in a context, moved by the view of the context
+// without a context it is drawn at once, as dap_freeze_draw
+void dap_ctx_draw_freeze(DAP_CTX *ctx, DAP_FREEZE *fz) {
+
+    DAP_CMD *cmd;
+
+    assert(fz != NULL);
+
+    if (ctx == NULL) {
+        dap_freeze_draw(fz);
+        return;
+    }
+    cmd = ctx_cmd(ctx);
+    if (cmd != NULL) {
+        cmd->op = CMD_FREEZE;
+        cmd->freeze = fz;
+    }
+}
+
+// Frame pacing
+//
+// The drawing thread calls dap_frame_due for every frame timer tick and draws
+// a frame only when it returns true. A tick is skipped when another tick is
+// already waiting, or when FRAMES_IN_FLIGHT frames are still queued for the
+// render thread, so a slow frame never builds up a backlog.
+// dap_flip_frame records the frame on the thread that flips the display: the
+// time since the previous flip goes into a ring of recent frame times, and
+// the frame counts as missed if the flip is later than one period after its
+// tick. Read the statistics once the flipping thread is idle or stopped.
+
+// initialise a frame pacer for a target frame rate in frames per second
+void dap_frame_init(DAP_FRAME_PACER *fp, double rate) {
+
+    assert(fp != NULL);
+    assert(rate > 0);
+
+    memset(fp, 0, sizeof(DAP_FRAME_PACER));
+    fp->period = 1.0 / rate;
+}
+
+// call for each frame timer tick
+// returns true if a frame should be drawn for the tick, otherwise the tick is skipped
+bool dap_frame_due(DAP_FRAME_PACER *fp, ALLEGRO_EVENT_QUEUE *q, ALLEGRO_EVENT *ev) {
+
+    assert(fp != NULL);
+    assert(ev != NULL);
+
+    ALLEGRO_EVENT next;
+    uint32_t presented;
+
+    // a later tick is already waiting, so this one is late
+    if (al_peek_next_event(q, &next) && next.type == ALLEGRO_EVENT_TIMER) {
+        fp->nskipped++;
+        return false;
+    }
+
+    // the render thread is still behind on earlier frames
+    presented = __atomic_load_n(&fp->npresented, __ATOMIC_ACQUIRE);
+    if (fp->nsubmitted - presented >= FRAMES_IN_FLIGHT) {
+        fp->nskipped++;
+        return false;
+    }
+
+    fp->deadline = ev->any.timestamp + fp->period;
+    fp->nsubmitted++;
+    return true;
+}
+
+// record a flipped frame, called on the thread that flipped the display
+static void frame_presented(DAP_FRAME_PACER *fp, double deadline) {
+
+    double now;
+    uint32_t n;
+
+    now = al_get_time();
+    n = fp->npresented;
+    if (n > 0) {
+        fp->times[(n - 1) & (FRAME_HISTORY - 1)] = now - fp->last;
+    }
+    if (now > deadline) {
+        fp->nmissed++;
+    }
+    fp->last = now;
+    __atomic_store_n(&fp->npresented, n + 1, __ATOMIC_RELEASE);
+}
+
+// flip the display and record the frame, queued if this thread has a target queue
+void dap_flip_frame(DAP_FRAME_PACER *fp) {
+
+    assert(fp != NULL);
+    DAP_CMD cmd;
+
+    TRACE(TRACE_FLIP, NULL);
+    if (target_queue == NULL) {
+        al_flip_display();
+        frame_presented(fp, fp->deadline);
+        return;
+    }
+    cmd.op = CMD_FLIP;
+    cmd.pacer = fp;
+    cmd.deadline = fp->deadline;
+    queue_cmd(target_queue, &cmd);
+}
+
+// compare frame times for qsort
+static int cmp_time(const void *a, const void *b) {
+
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// frame time percentile p, 0 < p <= 1, of n sorted frame times
+static double percentile(double *t, uint32_t n, double p) {
+
+    uint32_t i;
+
+    i = (uint32_t)ceil(p * n);
+    return t[i > 0 ? i - 1 : 0];
+}
+
+// get frame statistics over the recent frame times
+void dap_frame_stats(DAP_FRAME_PACER *fp, DAP_FRAME_STATS *st) {
+
+    assert(fp != NULL);
+    assert(st != NULL);
+
+    uint32_t n;
+    double t[FRAME_HISTORY];
+
+    memset(st, 0, sizeof(DAP_FRAME_STATS));
+    st->frames = __atomic_load_n(&fp->npresented, __ATOMIC_ACQUIRE);
+    st->missed = fp->nmissed;
+    st->skipped = fp->nskipped;
+
+    n = st->frames > 0 ? st->frames - 1 : 0;
+    if (n > FRAME_HISTORY) {
+        n = FRAME_HISTORY;
+    }
+    if (n == 0) {
+        return;
+    }
+    memcpy(t, fp->times, n * sizeof(double));
+    qsort(t, n, sizeof(double), cmp_time);
+    st->p50 = percentile(t, n, 0.50);
+    st->p95 = percentile(t, n, 0.95);
+    st->p99 = percentile(t, n, 0.99);
+    st->max = t[n - 1];
+}
+
+// print frame statistics
+void dap_frame_report(DAP_FRAME_PACER *fp) {
+
+    assert(fp != NULL);
+    DAP_FRAME_STATS st;
+
+    dap_frame_stats(fp, &st);
+    printf("frames %u, missed deadlines %u, skipped ticks %u, target %.2f ms\n",
+           st.frames, st.missed, st.skipped, fp->period * 1000.0);
+    printf("frame time p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           st.p50 * 1000.0, st.p95 * 1000.0, st.p99 * 1000.0, st.max * 1000.0);
+}
+
+// Progressive rendering
+//
+// A scheduler draws objects that may take longer than a frame, a piece at a
+// time. Fills of rectangles, circles and polygons are split into bands of
+// SCHED_BAND_ROWS rows, limited to the clipping rectangle, and rasters into
+// runs of SCHED_RASTER_BYTES bytes; any other object is one unit. Each call
+// of dap_sched_run draws whole units until its time budget is used up and
+// carries the rest into the next call, so an oversized object costs frames of
+// progress instead of a frozen display. Jobs are finished in the order they
+// were added, so overlapping objects are stacked as if drawn at once. The
+// scheduler draws on the calling thread, usually into a bitmap kept from
+// frame to frame, since the back buffer is not kept across flips.
+
+// create a scheduler with no jobs
+// returns a pointer to the scheduler if success, otherwise NULL
+DAP_SCHED *dap_sched_create(void) {
+    return calloc(1, sizeof(DAP_SCHED));
+}
+
+// destroy a scheduler, jobs not yet drawn are dropped
+void dap_sched_destroy(DAP_SCHED *s) {
+
+    assert(s != NULL);
+
+    free(s->jobs);
+    free(s);
+}
+
+// add a job drawing the fill or border of an object, op is CMD_FILL or CMD_BORDER
+// the object is copied, except for a raster still loading, which must stay valid until drawn
+// returns the ticket of the job for dap_sched_done, otherwise -1 if out of memory
+int64_t dap_sched_add(DAP_SCHED *s, GRAPH_OBJ *go, int op) {
+
+    int i, size;
+    float y;
+    DAP_SCHED_JOB *jobs, *j;
+
+    assert(s != NULL);
+    assert(go != NULL);
+    assert(op == CMD_FILL || op == CMD_BORDER);
+
+    ensure_kernels(go);
+    // the buffer doubles when full, after moving the jobs left to the start
+    if (s->head > 0 && s->njobs == s->size) {
+        memmove(s->jobs, s->jobs + s->head, (s->njobs - s->head) * sizeof(DAP_SCHED_JOB));
+        s->njobs -= s->head;
+        s->head = 0;
+    }
+    if (s->njobs == s->size) {
+        size = s->size ? s->size * 2 : 64;
+        jobs = realloc(s->jobs, size * sizeof(DAP_SCHED_JOB));
+        if (jobs == NULL) {
+            return -1;
+        }
+        s->jobs = jobs;
+        s->size = size;
+    }
+    j = &s->jobs[s->njobs++];
+    memcpy(&j->obj, go, sizeof(GRAPH_OBJ));
+    j->src = go->gtype == TYPE_RASTER && go->grast.load != NULL ? go : NULL;
+    j->op = op;
+    j->next = 0;
+    j->end = 1;
+    j->banded = false;
+
+    // rows of a fill, split into bands when the job starts
+    if (op == CMD_FILL) {
+        switch (go->gtype)
+        {
+            case TYPE_RECTANGLE:
+            j->next = fix_to_int(go->grect.y0 < go->grect.y1 ? go->grect.y0 : go->grect.y1);
+            j->end = fix_to_int(go->grect.y0 < go->grect.y1 ? go->grect.y1 : go->grect.y0);
+            j->banded = true;
+            break;
+
+            case TYPE_CIRCLE:
+            j->next = fix_to_int((int64_t)go->gcirc.y - go->gcirc.radius);
+            j->end = fix_to_int((int64_t)go->gcirc.y + go->gcirc.radius) + 1;
+            j->banded = true;
+            break;
+
+            case TYPE_POLYGON:
+            j->next = INT_MAX;
+            j->end = INT_MIN;
+            for (i = 0; i < go->gpoly.n; i++) {
+                y = fix_to_float(go->gpoly.y) + go->gpoly.pts[2 * i + 1];
+                j->next = (int)floorf(y) < j->next ? (int)floorf(y) : j->next;
+                j->end = (int)ceilf(y) + 1 > j->end ? (int)ceilf(y) + 1 : j->end;
+            }
+            j->banded = true;
+            break;
+        }
+    }
+    return s->nadded++;
+}
+
+// true if the job of a ticket has been drawn
+bool dap_sched_done(DAP_SCHED *s, int64_t ticket) {
+
+    assert(s != NULL);
+    return ticket >= 0 && ticket < s->ndone;
+}
+
+// number of jobs not yet drawn
+int dap_sched_pending(DAP_SCHED *s) {
+
+    assert(s != NULL);
+    return s->njobs - s->head;
+}
+
+// draw the next unit of a job, clip is the clipping rectangle x, y, w, h
+// returns 1 if the job is finished, 0 if it has more units, -1 if it waits for its raster
+static int sched_unit(DAP_SCHED_JOB *j, int clip[4]) {
+
+    int r;
+    GRAPH_OBJ run;
+
+    // a raster still loading is adopted by the object it was added from
+    if (j->src != NULL) {
+        r = dap_raster_ready(j->src);
+        if (r == 0) {
+            return -1;
+        }
+        memcpy(&j->obj, j->src, sizeof(GRAPH_OBJ));
+        j->src = NULL;
+        if (r == -1) {
+            return 1;
+        }
+    }
+
+    if (j->op == CMD_BORDER) {
+        j->obj.borderk(&j->obj);
+        return 1;
+    }
+
+    // a run of raster bytes, drawn from the pixel of its first byte
+    if (j->obj.gtype == TYPE_RASTER) {
+        if (j->obj.grast.rdataptr == NULL || j->obj.grast.width == 0) {
+            return 1;
+        }
+        j->end = (int64_t)j->obj.grast.fdlength;
+        memcpy(&run, &j->obj, sizeof(GRAPH_OBJ));
+        run.grast.rdataptr += j->next;
+        run.grast.offset += j->next;
+        run.grast.fdlength = j->end - j->next < SCHED_RASTER_BYTES ? (size_t)(j->end - j->next) : SCHED_RASTER_BYTES;
+        run.fillk(&run);
+        j->next += run.grast.fdlength;
+        return j->next >= j->end;
+    }
+
+    if (!j->banded) {
+        j->obj.fillk(&j->obj);
+        return 1;
+    }
+
+    // a band of rows, the rows outside the clipping rectangle are never drawn
+    j->next = j->next > clip[1] ? j->next : clip[1];
+    j->end = j->end < clip[1] + clip[3] ? j->end : clip[1] + clip[3];
+    if (j->next >= j->end) {
+        return 1;
+    }
+    span_left = clip[0];
+    span_right = clip[0] + clip[2];
+    span_top = (int)j->next;
+    span_bottom = (int)(j->end - j->next < SCHED_BAND_ROWS ? j->end : j->next + SCHED_BAND_ROWS);
+    j->obj.fillk(&j->obj);
+    j->next = span_bottom;
+    span_left = INT_MIN;
+    span_top = INT_MIN;
+    span_right = INT_MAX;
+    span_bottom = INT_MAX;
+    return j->next >= j->end;
+}
+
+// draw units of the jobs in order until the budget in seconds is used up
+// at least one unit is drawn, the rest is carried into the next call
+// returns the number of jobs not yet drawn
+int dap_sched_run(DAP_SCHED *s, double budget) {
+
+    int r, clip[4];
+    double start;
+
+    assert(s != NULL);
+    assert(target_queue == NULL);
+
+    al_get_clipping_rectangle(&clip[0], &clip[1], &clip[2], &clip[3]);
+    start = al_get_time();
+    s->nunits = 0;
+    while (s->head < s->njobs) {
+        r = sched_unit(&s->jobs[s->head], clip);
+        if (r == -1) {
+            break;
+        }
+        s->nunits++;
+        if (r == 1) {
+            s->head++;
+            s->ndone++;
+        }
+        if (al_get_time() - start >= budget) {
+            break;
+        }
+    }
+    if (s->head == s->njobs) {
+        s->head = 0;
+        s->njobs = 0;
+    }
+    return s->njobs - s->head;
+}
+
+// Frozen groups
+//
+// Static overlays such as grids, range rings and frames are the same every
+// frame. A frozen group records the triangles its lines, rectangles, circles
+// and polygons draw, fills and borders alike, into a vertex buffer and an
+// index buffer once, and draws them with one al_draw_indexed_buffer call. The
+// members are not copied: each keeps its generation from the last recording,
+// and the group is recorded again only when a setter has changed a member.
+// The points of a polygon are not the object's own and may change in place,
+// so a copy of them is kept as well and compared.
+// The group is recorded by running the CPU kernels with the primitives they
+// would draw redirected into the group, lines and dashes as quads one pixel
+// wide and pattern pixels as unit squares. Memory bitmap targets, and
+// displays without vertex buffers, draw the same triangles from memory with
+// al_draw_indexed_prim. With a render queue the members are queued and drawn
+// one by one, as the buffers belong to the render thread.
+
+// get room for nv more vertices and ni more indices in the group being recorded
+// returns a pointer to the first new vertex, NULL if out of memory
+static ALLEGRO_VERTEX *freeze_room(DAP_FREEZE *fz, int nv, int ni) {
+
+    int size;
+    void *p;
+
+    if (fz->nvtx + nv > fz->vtx_size) {
+        size = (fz->nvtx + nv) * 2;
+        p = realloc(fz->vtx, size * sizeof(ALLEGRO_VERTEX));
+        if (p == NULL) {
+            fz->failed = true;
+            return NULL;
+        }
+        fz->vtx = p;
+        fz->vtx_size = size;
+    }
+    if (fz->nidx + ni > fz->idx_size) {
+        size = (fz->nidx + ni) * 2;
+        p = realloc(fz->idx, size * sizeof(int));
+        if (p == NULL) {
+            fz->failed = true;
+            return NULL;
+        }
+        fz->idx = p;
+        fz->idx_size = size;
+    }
+    return fz->vtx + fz->nvtx;
+}
+
+// record a quad of corners a, b, c and d in order, as two triangles sharing a and c
+static void freeze_quad(ALLEGRO_VERTEX *a, ALLEGRO_VERTEX *b, ALLEGRO_VERTEX *c, ALLEGRO_VERTEX *d) {
+
+    int *i;
+    ALLEGRO_VERTEX *v;
+    DAP_FREEZE *fz = freeze_rec;
+
+    v = freeze_room(fz, 4, 6);
+    if (v == NULL) {
+        return;
+    }
+    v[0] = *a;
+    v[1] = *b;
+    v[2] = *c;
+    v[3] = *d;
+    i = fz->idx + fz->nidx;
+    i[0] = fz->nvtx;
+    i[1] = fz->nvtx + 1;
+    i[2] = fz->nvtx + 2;
+    i[3] = fz->nvtx;
+    i[4] = fz->nvtx + 2;
+    i[5] = fz->nvtx + 3;
+    fz->nvtx += 4;
+    fz->nidx += 6;
+}
+
+// record a line as a quad LINE_WIDTH wide, as al_draw_line draws it
+static void freeze_line(float x0, float y0, float x1, float y1, ALLEGRO_COLOR c) {
+
+    float l, tx, ty;
+    ALLEGRO_VERTEX v[4];
+
+    l = hypotf(x1 - x0, y1 - y0);
+    if (l == 0) {
+        return;
+    }
+    tx = 0.5f * LINE_WIDTH * (y0 - y1) / l;
+    ty = 0.5f * LINE_WIDTH * (x1 - x0) / l;
+    v[0] = (ALLEGRO_VERTEX){x0 + tx, y0 + ty, 0, 0, 0, c};
+    v[1] = (ALLEGRO_VERTEX){x0 - tx, y0 - ty, 0, 0, 0, c};
+    v[2] = (ALLEGRO_VERTEX){x1 - tx, y1 - ty, 0, 0, 0, c};
+    v[3] = (ALLEGRO_VERTEX){x1 + tx, y1 + ty, 0, 0, 0, c};
+    freeze_quad(&v[0], &v[1], &v[2], &v[3]);
+}
+
+// record a pixel as a unit square
+static void freeze_pixel(int x, int y, ALLEGRO_COLOR c) {
+
+    ALLEGRO_VERTEX v[4];
+
+    v[0] = (ALLEGRO_VERTEX){x, y, 0, 0, 0, c};
+    v[1] = (ALLEGRO_VERTEX){x + 1, y, 0, 0, 0, c};
+    v[2] = (ALLEGRO_VERTEX){x + 1, y + 1, 0, 0, 0, c};
+    v[3] = (ALLEGRO_VERTEX){x, y + 1, 0, 0, 0, c};
+    freeze_quad(&v[0], &v[1], &v[2], &v[3]);
+}
+
+// record a circle border as segments of about CIRCLE_SEG_PIXELS
+static void freeze_circle(float x, float y, float r, ALLEGRO_COLOR c) {
+
+    int i, n, a, b;
+
+    pthread_once(&circle_once, circle_table_init);
+    n = (int)ceilf(RAD_PER_CIRCLE * r / CIRCLE_SEG_PIXELS);
+    n = n < CIRCLE_MIN_DASHES ? CIRCLE_MIN_DASHES : n > CIRCLE_TABLE_SIZE ? CIRCLE_TABLE_SIZE : n;
+    for (i = 0; i < n; i++) {
+        a = i * CIRCLE_TABLE_SIZE / n;
+        b = ((i + 1) * CIRCLE_TABLE_SIZE / n) & (CIRCLE_TABLE_SIZE - 1);
+        freeze_line(x + r * circle_cos[a], y + r * circle_sin[a],
+                    x + r * circle_cos[b], y + r * circle_sin[b], c);
+    }
+}
+
+// create an empty frozen group
+// returns a pointer to the group if success, otherwise NULL
+DAP_FREEZE *dap_freeze_create(void) {
+    return calloc(1, sizeof(DAP_FREEZE));
+}
+
+// destroy a frozen group and its buffers, the members are not touched
+void dap_freeze_destroy(DAP_FREEZE *fz) {
+
+    int i;
+
+    assert(fz != NULL);
+
+    if (fz->ib != NULL) {
+        al_destroy_index_buffer(fz->ib);
+    }
+    if (fz->vb != NULL) {
+        al_destroy_vertex_buffer(fz->vb);
+    }
+    free(fz->vtx);
+    free(fz->idx);
+    for (i = 0; i < fz->nobjs; i++) {
+        free(fz->pts[i]);
+    }
+    free(fz->pts);
+    free(fz->gens);
+    free(fz->objs);
+    free(fz);
+}
+
+// add a line, rectangle, circle or polygon to a frozen group, drawn after those added before
+// the object is not copied, it must stay valid while the group is drawn
+// returns 0 if success, otherwise -1 if the type cannot be frozen or out of memory
+int dap_freeze_add(DAP_FREEZE *fz, GRAPH_OBJ *go) {
+
+    int size;
+    void *p;
+
+    assert(fz != NULL);
+    assert(go != NULL);
+
+    if (go->gtype != TYPE_LINE && go->gtype != TYPE_RECTANGLE &&
+        go->gtype != TYPE_CIRCLE && go->gtype != TYPE_POLYGON) {
+        return -1;
+    }
+    if (fz->nobjs == fz->size) {
+        size = fz->size ? fz->size * 2 : 16;
+        p = realloc(fz->objs, size * sizeof(GRAPH_OBJ *));
+        if (p == NULL) {
+            return -1;
+        }
+        fz->objs = p;
+        p = realloc(fz->gens, size * sizeof(uint64_t));
+        if (p == NULL) {
+            return -1;
+        }
+        fz->gens = p;
+        p = realloc(fz->pts, size * sizeof(float *));
+        if (p == NULL) {
+            return -1;
+        }
+        fz->pts = p;
+        fz->size = size;
+    }
+    fz->objs[fz->nobjs] = go;
+    fz->gens[fz->nobjs] = 0;
+    fz->pts[fz->nobjs] = NULL;
+    fz->nobjs++;
+    fz->stale = true;
+    return 0;
+}
+
+// true if a member changed since the group was recorded, members of generation 0 always have
+static bool freeze_stale(DAP_FREEZE *fz) {
+
+    int i;
+    GRAPH_OBJ *go;
+
+    if (fz->stale || fz->indexed != (indexed_target != NULL)) {
+        return true;
+    }
+    for (i = 0; i < fz->nobjs; i++) {
+        go = fz->objs[i];
+        if (go->gen == 0 || go->gen != fz->gens[i]) {
+            return true;
+        }
+        if (go->gtype == TYPE_POLYGON &&
+            memcmp(fz->pts[i], go->gpoly.pts, (size_t)go->gpoly.n * 2 * sizeof(float)) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// keep a copy of the points of a polygon member, to see if they change in place
+// returns 0 if success, otherwise -1 if out of memory
+static int freeze_keep_points(DAP_FREEZE *fz, int i) {
+
+    float *p;
+    GRAPH_OBJ *go = fz->objs[i];
+
+    if (go->gtype != TYPE_POLYGON) {
+        free(fz->pts[i]);
+        fz->pts[i] = NULL;
+        return 0;
+    }
+    p = realloc(fz->pts[i], (size_t)go->gpoly.n * 2 * sizeof(float));
+    if (p == NULL) {
+        return -1;
+    }
+    memcpy(p, go->gpoly.pts, (size_t)go->gpoly.n * 2 * sizeof(float));
+    fz->pts[i] = p;
+    return 0;
+}
+
+// record the triangles of every member with the CPU kernels, and upload them if the target can
+static void freeze_build(DAP_FREEZE *fz, bool memory) {
+
+    int i, op;
+    bool batch;
+    GRAPH_OBJ *go;
+
+    // a dashed circle batch in progress is drawn first, the group records its own dashes
+    dash_flush();
+    batch = dash_batch;
+    dash_batch = false;
+
+    fz->nvtx = 0;
+    fz->nidx = 0;
+    fz->failed = false;     // out of memory, what was recorded is drawn and recorded again next time
+    freeze_rec = fz;
+    for (i = 0; i < fz->nobjs; i++) {
+        go = fz->objs[i];
+        op = color_op(&go->gc);
+        if (go->gtype != TYPE_LINE) {
+            fill_kernels[go->gtype][go->gs.fill][op](go);
+        }
+        cpu_border_kernel(go, op)(go);
+        fz->gens[i] = go->gen;
+        if (freeze_keep_points(fz, i) == -1) {
+            fz->failed = true;
+        }
+    }
+    freeze_rec = NULL;
+    dash_batch = batch;
+    fz->stale = fz->failed;
+    fz->indexed = indexed_target != NULL;
+    fz->nbuilds++;
+
+    // the buffers are made again at the new size, drawn from memory if they cannot be
+    if (fz->ib != NULL) {
+        al_destroy_index_buffer(fz->ib);
+        fz->ib = NULL;
+    }
+    if (fz->vb != NULL) {
+        al_destroy_vertex_buffer(fz->vb);
+        fz->vb = NULL;
+    }
+    if (memory || fz->nidx == 0) {
+        return;
+    }
+    fz->vb = al_create_vertex_buffer(NULL, fz->vtx, fz->nvtx, ALLEGRO_PRIM_BUFFER_STATIC);
+    fz->ib = fz->vb != NULL ? al_create_index_buffer(sizeof(int), fz->idx, fz->nidx, ALLEGRO_PRIM_BUFFER_STATIC) : NULL;
+    if (fz->ib == NULL && fz->vb != NULL) {
+        al_destroy_vertex_buffer(fz->vb);
+        fz->vb = NULL;
+    }
+}
+
+// draw a frozen group, recording it again first if a member changed
+void dap_freeze_draw(DAP_FREEZE *fz) {
+
+    int i;
+    bool memory;
+
+    assert(fz != NULL);
+
+    if (target_queue != NULL) {
+        for (i = 0; i < fz->nobjs; i++) {
+            if (fz->objs[i]->gtype != TYPE_LINE) {
+                draw_or_queue(fz->objs[i], CMD_FILL);
+            }
+            draw_or_queue(fz->objs[i], CMD_BORDER);
+        }
+        return;
+    }
+
+    memory = (al_get_bitmap_flags(al_get_target_bitmap()) & ALLEGRO_MEMORY_BITMAP) != 0;
+    if (freeze_stale(fz)) {
+        freeze_build(fz, memory);
+    }
+    if (fz->nidx == 0) {
+        return;
+    }
+    if (!memory && fz->vb != NULL) {
+        al_draw_indexed_buffer(fz->vb, NULL, fz->ib, 0, fz->nidx, ALLEGRO_PRIM_TRIANGLE_LIST);
+    }
+    else {
+        al_draw_indexed_prim(fz->vtx, NULL, NULL, fz->idx, fz->nidx, ALLEGRO_PRIM_TRIANGLE_LIST);
+    }
+}
+
+// Windows
+//
+// A window is an offscreen surface with its own origin, size and colours. Its
+// paint function draws the contents with the dap_draw_* calls, relative to the
+// window, and is only called again after dap_window_invalidate. dap_compose
+// builds the frame from the cached surfaces of the visible windows, so an
+// unchanged window costs one textured quad. Painting and compositing run on
+// the thread that draws, the render thread if the caller has a target queue.
+
+// create a window at x, y of w by h pixels, with the default colours and scale 1
+// paint is called with arg to draw the contents, on a surface cleared to the background
+// the surface is created when the window is first composited
+// returns the window if success, otherwise NULL
+DAP_WINDOW *dap_window_create(int x, int y, int w, int h, void (*paint)(DAP_WINDOW *win, void *arg), void *arg) {
+
+    assert(w > 0 && h > 0);
+    assert(paint != NULL);
+
+    DAP_WINDOW *win;
+
+    win = calloc(1, sizeof(DAP_WINDOW));
+    if (win == NULL) {
+        return NULL;
+    }
+    win->x = x;
+    win->y = y;
+    win->w = w;
+    win->h = h;
+    win->scale = 1;
+    win->visible = true;
+    win->fg = DEFAULT_WINDOW_FGCOLOR;
+    win->bg = DEFAULT_WINDOW_BGCOLOR;
+    win->paint = paint;
+    win->arg = arg;
+    win->dirty = 1;
+    return win;
+}
+
+// free a window and its surface
+// call it on the drawing thread, after the frames that composite it are drawn
+void dap_window_destroy(DAP_WINDOW *win) {
+
+    assert(win != NULL);
+
+    if (win->bmp != NULL) {
+        al_destroy_bitmap(win->bmp);
+    }
+    free(win);
+}
+
+// mark the contents changed, the window is painted again when it is next composited
+// safe to call from any thread
+void dap_window_invalidate(DAP_WINDOW *win) {
+
+    assert(win != NULL);
+    __atomic_store_n(&win->dirty, 1, __ATOMIC_RELEASE);
+}
+
+// set the window colours, the contents are painted again
+void dap_window_set_color(DAP_WINDOW *win, ALLEGRO_COLOR fg, ALLEGRO_COLOR bg) {
+
+    assert(win != NULL);
+
+    win->fg = fg;
+    win->bg = bg;
+    dap_window_invalidate(win);
+}
+
+// move the window, the cached contents are reused
+void dap_window_move(DAP_WINDOW *win, int x, int y) {
+
+    assert(win != NULL);
+
+    win->x = x;
+    win->y = y;
+}
+
+// set the display pixels per window pixel, the cached contents are reused
+void dap_window_set_scale(DAP_WINDOW *win, int scale) {
+
+    assert(win != NULL);
+    assert(scale > 0);
+
+    win->scale = scale;
+}
+
+// show or hide the window
+void dap_window_show(DAP_WINDOW *win, bool visible) {
+
+    assert(win != NULL);
+
+    win->visible = visible;
+}
+
+// paint the changed windows and composite every visible window onto the current target
+static void compose_windows(DAP_WINDOW **wins, int n) {
+
+    int i;
+    DAP_WINDOW *win;
+    ALLEGRO_BITMAP *target;
+
+    target = al_get_target_bitmap();
+
+    // paint the windows whose contents changed
+    for (i = 0; i < n; i++) {
+        win = wins[i];
+        if (!win->visible) {
+            continue;
+        }
+        if (win->bmp == NULL) {
+            win->bmp = al_create_bitmap(win->w, win->h);
+            if (win->bmp == NULL) {
+                continue;
+            }
+            __atomic_store_n(&win->dirty, 1, __ATOMIC_RELAXED);
+        }
+        if (__atomic_exchange_n(&win->dirty, 0, __ATOMIC_ACQUIRE)) {
+            al_set_target_bitmap(win->bmp);
+            al_clear_to_color(win->bg);
+            win->paint(win, win->arg);
+            win->npaints++;
+        }
+    }
+    al_set_target_bitmap(target);
+
+    // composite, the last window on top
+    al_clear_to_color(DEFAULT_WINDOW_BGCOLOR);
+    al_hold_bitmap_drawing(true);
+    for (i = 0; i < n; i++) {
+        win = wins[i];
+        if (!win->visible || win->bmp == NULL) {
+            continue;
+        }
+        if (win->scale == 1) {
+            al_draw_bitmap(win->bmp, win->x, win->y, 0);
+        }
+        else {
+            al_draw_scaled_bitmap(win->bmp, 0, 0, win->w, win->h,
+                                  win->x, win->y, win->w * win->scale, win->h * win->scale, 0);
+        }
+    }
+    al_hold_bitmap_drawing(false);
+}
+
+// paint the changed windows and composite them onto the display, queued if
+// this thread has a target queue
+// wins is in stacking order, bottom first, and must stay valid until the frame is drawn
+void dap_compose(DAP_WINDOW **wins, int n) {
+
+    assert(wins != NULL || n == 0);
+    DAP_CMD cmd;
+
+    if (target_queue == NULL) {
+        compose_windows(wins, n);
+        return;
+    }
+    cmd.op = CMD_COMPOSE;
+    cmd.wins = wins;
+    cmd.nwins = n;
+    queue_cmd(target_queue, &cmd);
+}
+
+// Indexed framebuffer
+//
+// An indexed framebuffer holds one byte per pixel, a palette index, in an
+// 8 bit single channel memory bitmap. Between dap_indexed_begin and
+// dap_indexed_end the dap_draw_* calls of the thread draw into it: the
+// kernels look up the palette index of their two colours and draw with the
+// index as the red channel, so fills write a quarter of the bytes of an ARGB
+// target. dap_indexed_present expands the indices through the palette into
+// an ARGB bitmap once per frame and draws it. Changing a palette entry
+// recolours every pixel drawn with it at the next present, without drawing
+// anything again. Drawing is direct, on the calling thread; the thread must
+// not have a target queue.
+
+// target to go back to after drawing into an indexed framebuffer
+static __thread ALLEGRO_BITMAP *indexed_prev;
+
+// create an indexed framebuffer of w by h pixels with an empty palette
+// returns a pointer to the framebuffer if success, otherwise NULL
+DAP_INDEXED *dap_indexed_create(int w, int h) {
+
+    int flags, format;
+    DAP_INDEXED *ix;
+
+    assert(w > 0 && h > 0);
+
+    ix = calloc(1, sizeof(DAP_INDEXED));
+    if (ix == NULL) {
+        return NULL;
+    }
+    ix->w = w;
+    ix->h = h;
+
+    flags = al_get_new_bitmap_flags();
+    format = al_get_new_bitmap_format();
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    al_set_new_bitmap_format(ALLEGRO_PIXEL_FORMAT_SINGLE_CHANNEL_8);
+    ix->index = al_create_bitmap(w, h);
+    al_set_new_bitmap_flags(flags);
+    al_set_new_bitmap_format(format);
+    ix->argb = al_create_bitmap(w, h);
+
+    if (ix->index == NULL || ix->argb == NULL) {
+        dap_indexed_destroy(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+// destroy an indexed framebuffer
+void dap_indexed_destroy(DAP_INDEXED *ix) {
+
+    assert(ix != NULL);
+    assert(indexed_target != ix);
+
+    if (ix->index != NULL) {
+        al_destroy_bitmap(ix->index);
+    }
+    if (ix->argb != NULL) {
+        al_destroy_bitmap(ix->argb);
+    }
+    free(ix);
+}
+
+// set palette entry i to colour c, pixels drawn with it change colour at the next present
+// an entry not yet in use is also taken for c, an entry in use keeps the colour it was taken for
+void dap_indexed_set_palette(DAP_INDEXED *ix, int i, ALLEGRO_COLOR c) {
+
+    unsigned char r, g, b, a;
+
+    assert(ix != NULL);
+    assert(i >= 0 && i < INDEXED_COLORS);
+
+    al_unmap_rgba(c, &r, &g, &b, &a);
+    ix->palette[i] = c;
+    ix->lut[i] = (uint32_t)a << 24 | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+    if (i >= ix->ncolors) {
+        // entries skipped over are taken for the colour they already show
+        for (; ix->ncolors < i; ix->ncolors++) {
+            ix->keys[ix->ncolors] = ix->palette[ix->ncolors];
+        }
+        ix->keys[i] = c;
+        ix->ncolors = i + 1;
+    }
+}
+
+// palette index of a colour, added to the palette if it is new and there is room
+// returns the index, the nearest palette colour if the palette is full
+int dap_indexed_color(DAP_INDEXED *ix, ALLEGRO_COLOR c) {
+
+    int i, best = 0;
+    float d, dr, dg, db, bestd = FLT_MAX;
+    ALLEGRO_COLOR *p;
+
+    assert(ix != NULL);
+
+    // looked up by the colour an entry was taken for, not the one it is displayed with
+    for (i = 0; i < ix->ncolors; i++) {
+        p = &ix->keys[i];
+        if (p->r == c.r && p->g == c.g && p->b == c.b && p->a == c.a) {
+            return i;
+        }
+    }
+    if (ix->ncolors < INDEXED_COLORS) {
+        i = ix->ncolors;
+        dap_indexed_set_palette(ix, i, c);
+        return i;
+    }
+    for (i = 0; i < ix->ncolors; i++) {
+        p = &ix->keys[i];
+        dr = p->r - c.r;
+        dg = p->g - c.g;
+        db = p->b - c.b;
+        d = dr * dr + dg * dg + db * db;
+        if (d < bestd) {
+            bestd = d;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// colour that draws the palette index of c into the thread's indexed framebuffer
+static ALLEGRO_COLOR indexed_color(ALLEGRO_COLOR c) {
+    return al_map_rgb(dap_indexed_color(indexed_target, c), 0, 0);
+}
+
+// draw into an indexed framebuffer on this thread until dap_indexed_end
+void dap_indexed_begin(DAP_INDEXED *ix) {
+
+    assert(ix != NULL);
+    assert(indexed_target == NULL);
+    assert(target_queue == NULL);
+
+    indexed_prev = al_get_target_bitmap();
+    indexed_target = ix;
+    al_set_target_bitmap(ix->index);
+}
+
+// go back to drawing in colour on the previous target
+void dap_indexed_end(void) {
+
+    assert(indexed_target != NULL);
+
+    indexed_target = NULL;
+    al_set_target_bitmap(indexed_prev);
+    indexed_prev = NULL;
+}
+
+// expand the indices through the palette and draw the frame at x, y of the current target
+// returns 0 if success, otherwise -1
+int dap_indexed_present(DAP_INDEXED *ix, float x, float y) {
+
+    int r, c;
+    uint8_t *src;
+    uint32_t *dst;
+    ALLEGRO_LOCKED_REGION *li, *la;
+
+    assert(ix != NULL);
+    assert(indexed_target == NULL);
+
+    li = al_lock_bitmap(ix->index, ALLEGRO_PIXEL_FORMAT_ANY, ALLEGRO_LOCK_READONLY);
+    if (li == NULL) {
+        return -1;
+    }
+    la = al_lock_bitmap(ix->argb, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+    if (la == NULL) {
+        al_unlock_bitmap(ix->index);
+        return -1;
+    }
+    for (r = 0; r < ix->h; r++) {
+        src = (uint8_t *)li->data + (ptrdiff_t)r * li->pitch;
+        dst = (uint32_t *)((uint8_t *)la->data + (ptrdiff_t)r * la->pitch);
+        for (c = 0; c < ix->w; c++) {
+            dst[c] = ix->lut[src[c]];
+        }
+    }
+    al_unlock_bitmap(ix->argb);
+    al_unlock_bitmap(ix->index);
+
+    al_draw_bitmap(ix->argb, x, y, 0);
+    return 0;
+}
+
+// Shared memory output
+//
+// dap_shm_create makes a POSIX shared memory object holding a header and two
+// ARGB 8888 frame buffers, so other processes such as a recorder or a remote
+// viewer can map it and read frames in place, with no copies through a
+// socket and no read back from the display. dap_shm_publish copies the dirty
+// region of a memory bitmap frame into the back buffer, together with the
+// region dirtied by the frame before, which the back buffer has not seen,
+// then makes it the front buffer and bumps the sequence counter.
+//
+// seq is odd while a frame is being written and even once it is published,
+// seq / 2 frames so far. A consumer waits for an even seq, reads front and
+// the front buffer's dirty region, uses the pixels and reads seq again. The
+// next frame goes to the other buffer, so the pixels were intact unless seq
+// grew by 3 or more, when the frame is dropped.
+
+// rectangle of changed pixels, empty if w or h is 0
+typedef struct dshmrect {
+    int32_t x, y, w, h;
+} DAP_SHM_RECT;
+
+// header at offset 0 of the shared memory object, native byte order
+typedef struct dshmhdr {
+    uint32_t magic;     // SHM_MAGIC
+    uint32_t version;   // SHM_VERSION
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;     // bytes per row of a buffer
+    uint32_t format;    // ALLEGRO_PIXEL_FORMAT_ARGB_8888
+    uint64_t offset[2]; // offset of each buffer, page aligned
+    uint64_t seq;       // twice the frames published, odd while writing, accessed atomically
+    uint32_t front;     // buffer of the last published frame, accessed atomically
+    uint32_t reserved;
+    DAP_SHM_RECT dirty[2];  // region of each buffer that changed from the frame before
+} DAP_SHM_HEADER;
+
+// shared memory output, producer side
+typedef struct dshm {
+    char *name;
+    int fd;
+    size_t length;
+    DAP_SHM_HEADER *hdr;
+    uint8_t *buf[2];
+    DAP_SHM_RECT last;  // dirty region of the last published frame
+} DAP_SHM;
+
+// page aligned offset
+static size_t page_align(size_t n) {
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (n + page - 1) / page * page;
+}
+
+// smallest rectangle holding a and b
+static DAP_SHM_RECT rect_union(DAP_SHM_RECT a, DAP_SHM_RECT b) {
+
+    DAP_SHM_RECT r;
+
+    if (a.w <= 0 || a.h <= 0) {
+        return b;
+    }
+    if (b.w <= 0 || b.h <= 0) {
+        return a;
+    }
+    r.x = a.x < b.x ? a.x : b.x;
+    r.y = a.y < b.y ? a.y : b.y;
+    r.w = (a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w) - r.x;
+    r.h = (a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h) - r.y;
+    return r;
+}
+
+// create shared memory output of w by h pixels, name as for shm_open, e.g. "/dashline"
+// returns a pointer to the output if success, otherwise NULL
+DAP_SHM *dap_shm_create(char *name, int w, int h) {
+
+    size_t frame;
+    DAP_SHM *shm;
+    uint8_t *base;
+
+    assert(name != NULL);
+    assert(w > 0 && h > 0);
+
+    shm = calloc(1, sizeof(DAP_SHM));
+    if (shm == NULL) {
+        return NULL;
+    }
+    shm->name = strdup(name);
+    shm->fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (shm->name == NULL || shm->fd == -1) {
+        free(shm->name);
+        free(shm);
+        return NULL;
+    }
+
+    frame = page_align((size_t)w * h * 4);
+    shm->length = page_align(sizeof(DAP_SHM_HEADER)) + 2 * frame;
+    base = MAP_FAILED;
+    if (ftruncate(shm->fd, shm->length) == 0) {
+        base = mmap(NULL, shm->length, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        close(shm->fd);
+        shm_unlink(name);
+        free(shm->name);
+        free(shm);
+        return NULL;
+    }
+
+    // the object starts zeroed, buffers are black and transparent until the first frame
+    shm->hdr = (DAP_SHM_HEADER *)base;
+    shm->hdr->width = w;
+    shm->hdr->height = h;
+    shm->hdr->pitch = w * 4;
+    shm->hdr->format = ALLEGRO_PIXEL_FORMAT_ARGB_8888;
+    shm->hdr->offset[0] = page_align(sizeof(DAP_SHM_HEADER));
+    shm->hdr->offset[1] = shm->hdr->offset[0] + frame;
+    shm->buf[0] = base + shm->hdr->offset[0];
+    shm->buf[1] = base + shm->hdr->offset[1];
+    shm->hdr->version = SHM_VERSION;
+    __atomic_store_n(&shm->hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+// unmap and remove shared memory output, consumers keep their mappings
+void dap_shm_destroy(DAP_SHM *shm) {
+
+    assert(shm != NULL);
+
+    munmap(shm->hdr, shm->length);
+    close(shm->fd);
+    shm_unlink(shm->name);
+    free(shm->name);
+    free(shm);
+}
+
+// publish a frame drawn in bmp, of which the region x, y, w, h changed since the last frame
+// returns the number of frames published if success, otherwise -1
+int64_t dap_shm_publish(DAP_SHM *shm, ALLEGRO_BITMAP *bmp, int x, int y, int w, int h) {
+
+    int r;
+    uint32_t back;
+    DAP_SHM_RECT dirty, copy, full;
+    ALLEGRO_LOCKED_REGION *lr;
+
+    assert(shm != NULL);
+    assert(bmp != NULL);
+
+    // clip the dirty region to the frame
+    full = (DAP_SHM_RECT){0, 0, (int32_t)shm->hdr->width, (int32_t)shm->hdr->height};
+    dirty.x = x > 0 ? x : 0;
+    dirty.y = y > 0 ? y : 0;
+    dirty.w = (x + w < full.w ? x + w : full.w) - dirty.x;
+    dirty.h = (y + h < full.h ? y + h : full.h) - dirty.y;
+    if (dirty.w <= 0 || dirty.h <= 0) {
+        dirty = (DAP_SHM_RECT){0, 0, 0, 0};
+    }
+
+    // the back buffer holds the frame before last, bring it up to date with both frames
+    copy = rect_union(dirty, shm->last);
+    back = __atomic_load_n(&shm->hdr->front, __ATOMIC_RELAXED) ^ 1;
+    lr = NULL;
+    if (copy.w > 0 && copy.h > 0) {
+        lr = al_lock_bitmap_region(bmp, copy.x, copy.y, copy.w, copy.h,
+                                   ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READONLY);
+        if (lr == NULL) {
+            return -1;
+        }
+    }
+
+    // odd while writing
+    __atomic_add_fetch(&shm->hdr->seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (lr != NULL) {
+        for (r = 0; r < copy.h; r++) {
+            memcpy(shm->buf[back] + (size_t)(copy.y + r) * shm->hdr->pitch + (size_t)copy.x * 4,
+                   (uint8_t *)lr->data + (ptrdiff_t)r * lr->pitch, (size_t)copy.w * 4);
+        }
+        al_unlock_bitmap(bmp);
+    }
+
+    shm->hdr->dirty[back] = dirty;
+    shm->last = dirty;
+    __atomic_store_n(&shm->hdr->front, back, __ATOMIC_RELEASE);
+    return (int64_t)(__atomic_add_fetch(&shm->hdr->seq, 1, __ATOMIC_RELEASE) / 2);
+}
+
+// Frame capture
+//
+// dap_capture snapshots the current target into a buffer from a fixed pool
+// and hands it to an encoder thread, which saves it with al_save_bitmap, PNG
+// or BMP by the extension of the file name, and returns the buffer to the
+// pool. The drawing thread only pays for the pixel copy. Captures queue in
+// the order taken; when every buffer is taken the drop policy either skips
+// the new capture or reuses the buffer of the oldest capture still queued,
+// so capturing never waits for the encoder.
+
+// take a buffer for a capture, following the drop policy when none is free
+// the mutex must be held, returns the buffer index or -1 if the capture is dropped
+static int capture_take(DAP_CAPTURE *cap) {
+
+    int b;
+
+    if (cap->nfree > 0) {
+        return cap->free[--cap->nfree];
+    }
+    cap->ndropped++;
+    if (cap->policy == CAPTURE_DROP_OLDEST && cap->njobs > 0) {
+        b = cap->jobs[cap->head].buf;
+        cap->head = (cap->head + 1) % cap->nbufs;
+        cap->njobs--;
+        return b;
+    }
+    return -1;
+}
+
+// snapshot the current target into a pool buffer and queue it for encoding
+// returns 0 if success, otherwise -1 if the capture was dropped
+static int capture_frame(DAP_CAPTURE *cap) {
+
+    int b, r, w, h;
+    uint32_t n;
+    ALLEGRO_BITMAP *target;
+    ALLEGRO_LOCKED_REGION *src, *dst;
+
+    al_lock_mutex(cap->mutex);
+    n = cap->next++;
+    b = capture_take(cap);
+    al_unlock_mutex(cap->mutex);
+    if (b == -1) {
+        return -1;
+    }
+
+    // copy the pixels, the buffer belongs to this thread until it is queued
+    target = al_get_target_bitmap();
+    w = al_get_bitmap_width(cap->bufs[b]);
+    h = al_get_bitmap_height(cap->bufs[b]);
+    w = w < al_get_bitmap_width(target) ? w : al_get_bitmap_width(target);
+    h = h < al_get_bitmap_height(target) ? h : al_get_bitmap_height(target);
+    src = al_lock_bitmap_region(target, 0, 0, w, h, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_READONLY);
+    dst = al_lock_bitmap(cap->bufs[b], ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+    if (src != NULL && dst != NULL) {
+        for (r = 0; r < h; r++) {
+            memcpy((uint8_t *)dst->data + (ptrdiff_t)r * dst->pitch,
+                   (uint8_t *)src->data + (ptrdiff_t)r * src->pitch, (size_t)w * 4);
+        }
+    }
+    if (src != NULL) {
+        al_unlock_bitmap(target);
+    }
+    if (dst != NULL) {
+        al_unlock_bitmap(cap->bufs[b]);
+    }
+
+    al_lock_mutex(cap->mutex);
+    if (src == NULL || dst == NULL) {
+        cap->free[cap->nfree++] = b;
+        cap->nfailed++;
+        al_unlock_mutex(cap->mutex);
+        return -1;
+    }
+    cap->jobs[(cap->head + cap->njobs) % cap->nbufs] = (DAP_CAPTURE_JOB){b, n};
+    cap->njobs++;
+    al_signal_cond(cap->cond);
+    al_unlock_mutex(cap->mutex);
+    return 0;
+}
+
+// encode queued captures until stopped, then finish the queue, the encoder thread
+static void *capture_thread(ALLEGRO_THREAD *thr, void *arg) {
+
+    bool ok;
+    char name[PATH_MAX];
+    DAP_CAPTURE *cap = arg;
+    DAP_CAPTURE_JOB job;
+
+    for (;;) {
+        al_lock_mutex(cap->mutex);
+        while (cap->njobs == 0 && !al_get_thread_should_stop(thr)) {
+            al_wait_cond(cap->cond, cap->mutex);
+        }
+        if (cap->njobs == 0) {
+            al_unlock_mutex(cap->mutex);
+            break;
+        }
+        job = cap->jobs[cap->head];
+        cap->head = (cap->head + 1) % cap->nbufs;
+        cap->njobs--;
+        al_unlock_mutex(cap->mutex);
+
+        snprintf(name, sizeof(name), cap->pattern, (unsigned)job.n);
+        ok = al_save_bitmap(name, cap->bufs[job.buf]);
+
+        al_lock_mutex(cap->mutex);
+        cap->free[cap->nfree++] = job.buf;
+        if (ok) {
+            cap->nsaved++;
+        }
+        else {
+            cap->nfailed++;
+        }
+        al_unlock_mutex(cap->mutex);
+    }
+    return NULL;
+}
+
+// check a file name pattern has exactly one conversion, of an unsigned int: %u, %d, %i, %x, %X or %o
+// with optional flags, width and precision, other text and %% are copied as they are
+// returns true if the pattern is safe to give snprintf with the capture number
+static bool capture_pattern_ok(char *pattern) {
+
+    int nconv = 0;
+    char *p = pattern;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if (*p == '.') {
+            p++;
+            p += strspn(p, "0123456789");
+        }
+        if (*p == '\0' || strchr("udixXo", *p) == NULL) {
+            return false;
+        }
+        p++;
+        nconv++;
+    }
+    return nconv == 1;
+}
+
+// create a capture pool of nbufs w by h buffers and start its encoder thread
+// pattern is a printf pattern given the capture number, e.g. "capture%05u.png"
+// returns NULL if it does not have exactly one integer conversion, see capture_pattern_ok
+// policy is CAPTURE_DROP_NEWEST or CAPTURE_DROP_OLDEST
+// returns a pointer to the capture pool if success, otherwise NULL
+DAP_CAPTURE *dap_capture_create(int w, int h, int nbufs, char *pattern, int policy) {
+
+    int i, flags;
+    DAP_CAPTURE *cap;
+
+    assert(w > 0 && h > 0);
+    assert(nbufs > 0);
+    assert(pattern != NULL);
+    assert(policy == CAPTURE_DROP_NEWEST || policy == CAPTURE_DROP_OLDEST);
+
+    if (!capture_pattern_ok(pattern)) {
+        return NULL;
+    }
+    cap = calloc(1, sizeof(DAP_CAPTURE));
+    if (cap == NULL) {
+        return NULL;
+    }
+    cap->policy = policy;
+    cap->nbufs = nbufs;
+    cap->pattern = strdup(pattern);
+    cap->bufs = calloc(nbufs, sizeof(ALLEGRO_BITMAP *));
+    cap->free = calloc(nbufs, sizeof(int));
+    cap->jobs = calloc(nbufs, sizeof(DAP_CAPTURE_JOB));
+    cap->mutex = al_create_mutex();
+    cap->cond = al_create_cond();
+    if (cap->pattern == NULL || cap->bufs == NULL || cap->free == NULL || cap->jobs == NULL ||
+        cap->mutex == NULL || cap->cond == NULL) {
+        dap_capture_destroy(cap);
+        return NULL;
+    }
+
+    // buffers are memory bitmaps, the encoder never touches the display
+    flags = al_get_new_bitmap_flags();
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    for (i = 0; i < nbufs; i++) {
+        cap->bufs[i] = al_create_bitmap(w, h);
+        if (cap->bufs[i] == NULL) {
+            break;
+        }
+        cap->free[cap->nfree++] = i;
+    }
+    al_set_new_bitmap_flags(flags);
+
+    cap->thread = i == nbufs ? al_create_thread(capture_thread, cap) : NULL;
+    if (cap->thread == NULL) {
+        dap_capture_destroy(cap);
+        return NULL;
+    }
+    al_start_thread(cap->thread);
+    return cap;
+}
+
+// encode the captures still queued and stop the encoder thread
+// the counts of the pool are final afterwards, further captures are only queued
+void dap_capture_stop(DAP_CAPTURE *cap) {
+
+    assert(cap != NULL);
+
+    if (cap->thread != NULL) {
+        al_set_thread_should_stop(cap->thread);
+        al_lock_mutex(cap->mutex);
+        al_signal_cond(cap->cond);
+        al_unlock_mutex(cap->mutex);
+        al_join_thread(cap->thread, NULL);
+        al_destroy_thread(cap->thread);
+        cap->thread = NULL;
+    }
+}
+
+// stop the encoder thread if still running and free the pool
+void dap_capture_destroy(DAP_CAPTURE *cap) {
+
+    int i;
+
+    assert(cap != NULL);
+
+    dap_capture_stop(cap);
+    for (i = 0; cap->bufs != NULL && i < cap->nbufs; i++) {
+        if (cap->bufs[i] != NULL) {
+            al_destroy_bitmap(cap->bufs[i]);
+        }
+    }
+    if (cap->cond != NULL) {
+        al_destroy_cond(cap->cond);
+    }
+    if (cap->mutex != NULL) {
+        al_destroy_mutex(cap->mutex);
+    }
+    free(cap->jobs);
+    free(cap->free);
+    free(cap->bufs);
+    free(cap->pattern);
+    free(cap);
+}
+
+// capture the current frame, call before the flip
+// the capture is taken at once, or queued if this thread has a target queue
+// returns 0 if the capture was taken or queued, otherwise -1 if it was dropped
+int dap_capture(DAP_CAPTURE *cap) {
+
+    DAP_CMD cmd;
+
+    assert(cap != NULL);
+
+    if (target_queue == NULL) {
+        return capture_frame(cap);
+    }
+    cmd.op = CMD_CAPTURE;
+    cmd.capture = cap;
+    queue_cmd(target_queue, &cmd);
+    return 0;
+}
+
+// Trace recording
+//
+// dap_trace_start records every dap_set_*, dap_draw_*, dap_clear and flip
+// call, with its object, arguments and a timestamp, to a binary trace file.
+// A call costs one test of trace_rec when no trace is recorded. Objects are
+// numbered in the order they are first seen, strings and raster data are
+// recorded by value, so dap_trace_replay can run the trace headless on
+// another machine, as fast as it can, timing every call.
+//
+// The dap_ctx_* calls are recorded with the id of their context, when a
+// worker thread records them. The replay records them in contexts of its
+// own and draws them at the traced dap_ctx_submit, in the order of the
+// submit, all to its memory bitmap. Frozen groups are not traced.
+
+// name and argument types of each traced call
+// f float, i int, c colour, s string, d data pointer and size_t length
+static const struct {
+    char *name;
+    char *args;
+} trace_calls[TRACE_MAX] = {
+    [TRACE_SET_GRAPH_TYPE] = {"dap_set_graph_type", "i"},
+    [TRACE_SET_GRAPH_COLOR] = {"dap_set_graph_color", "icc"},
+    [TRACE_SET_GRAPH_COLOR_MODE] = {"dap_set_graph_color_mode", "ii"},
+    [TRACE_SET_GRAPH_STYLE_PATTERN] = {"dap_set_graph_style_pattern", "i"},
+    [TRACE_SET_GRAPH_STYLE_CLIP] = {"dap_set_graph_style_clip", "i"},
+    [TRACE_SET_GRAPH_STYLE_FILL] = {"dap_set_graph_style_fill", "i"},
+    [TRACE_SET_GRAPH_STYLE_BORDER] = {"dap_set_graph_style_border", "i"},
+    [TRACE_SET_GRAPH_STYLE] = {"dap_set_graph_style", "iii"},
+    [TRACE_SET_CIRCLE] = {"dap_set_circle", "fff"},
+    [TRACE_SET_RECTANGLE] = {"dap_set_rectangle", "ffff"},
+    [TRACE_SET_LINE] = {"dap_set_line", "ffff"},
+    [TRACE_SET_RASTER_DATA] = {"dap_set_raster_data", "ffid"},
+    [TRACE_SET_TEXT] = {"dap_set_text", "ffs"},
+    [TRACE_SET_TEXT_SCALE] = {"dap_set_text_scale", "i"},
+    [TRACE_DRAW_RASTER] = {"dap_draw_raster", ""},
+    [TRACE_DRAW_LINE] = {"dap_draw_line", ""},
+    [TRACE_DRAW_RECTANGLE_FILL] = {"dap_draw_rectangle_fill", ""},
+    [TRACE_DRAW_CIRCLE_FILL] = {"dap_draw_circle_fill", ""},
+    [TRACE_DRAW_CIRCLE_BORDER] = {"dap_draw_circle_border", ""},
+    [TRACE_DRAW_RECTANGLE_BORDER] = {"dap_draw_rectangle_border", ""},
+    [TRACE_DRAW_TEXT] = {"dap_draw_text", ""},
+    [TRACE_CLEAR] = {"dap_clear", "c"},
+    [TRACE_FLIP] = {"dap_flip", ""},
+    [TRACE_CIRCLE_BATCH_BEGIN] = {"dap_circle_batch_begin", ""},
+    [TRACE_CIRCLE_BATCH_END] = {"dap_circle_batch_end", ""},
+    [TRACE_SET_GRAPH_STYLE_WIDTH] = {"dap_set_graph_style_width", "i"},
+    [TRACE_SET_RASTER_TRANSFORM] = {"dap_set_raster_transform", "fff"},
+    [TRACE_UPDATE_RASTER] = {"dap_update_raster", "d"},
+    [TRACE_SET_POLYGON] = {"dap_set_polygon", "ffd"},
+    [TRACE_DRAW_POLYGON] = {"dap_draw_polygon", ""},
+    [TRACE_CTX_OBJECT] = {"dap_ctx_object", "i"},
+    [TRACE_CTX_DRAW] = {"dap_ctx_draw", "ii"},
+    [TRACE_CTX_CLEAR] = {"dap_ctx_clear", "ic"},
+    [TRACE_CTX_SET_VIEW] = {"dap_ctx_set_view", "ifff"},
+    [TRACE_CTX_SUBMIT] = {"dap_ctx_submit", "d"},
+};
+
+// start recording a trace to a file
+// no other thread may draw while the trace is started or stopped
+// returns 0 if success, otherwise -1
+int dap_trace_start(char *filename) {
+
+    assert(filename != NULL);
+    assert(trace_rec == NULL);
+
+    uint32_t hdr[2] = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION};
+    DAP_TRACE *t;
+
+    t = calloc(1, sizeof(DAP_TRACE));
+    if (t == NULL) {
+        return -1;
+    }
+    t->f = fopen(filename, "wb");
+    if (t->f == NULL) {
+        free(t);
+        return -1;
+    }
+    if (fwrite(hdr, sizeof(hdr), 1, t->f) != 1) {
+        fclose(t->f);
+        free(t);
+        return -1;
+    }
+    t->start = al_get_time();
+    trace_rec = t;
+    return 0;
+}
+
+// stop recording and close the trace file
+// returns 0 if success, otherwise -1 if the trace could not be written
+int dap_trace_stop(void) {
+
+    assert(trace_rec != NULL);
+
+    int r;
+    DAP_TRACE *t = trace_rec;
+
+    trace_rec = NULL;
+    r = ferror(t->f) ? -1 : 0;
+    if (fclose(t->f) != 0) {
+        r = -1;
+    }
+    printf("traced %llu calls on %u objects, %llu dropped\n",
+           (unsigned long long)t->ncalls, t->nobjs, (unsigned long long)t->ndropped);
+    free(t);
+    return r;
+}
+
+// id of a traced object, numbered from 1 in the order first seen
+// returns the id, otherwise 0 if the object table is full
+static uint16_t trace_object(DAP_TRACE *t, GRAPH_OBJ *go) {
+
+    uint32_t h;
+
+    h = (uint32_t)(((uintptr_t)go >> 3) * 2654435761u) & (2 * TRACE_MAX_OBJECTS - 1);
+    while (t->objs[h] != NULL) {
+        if (t->objs[h] == go) {
+            return t->ids[h];
+        }
+        h = (h + 1) & (2 * TRACE_MAX_OBJECTS - 1);
+    }
+    if (t->nobjs == TRACE_MAX_OBJECTS) {
+        return 0;
+    }
+    t->objs[h] = go;
+    t->ids[h] = ++t->nobjs;
+    return t->ids[h];
+}
+
+// record a call, the arguments follow trace_calls[call].args
+// a record and its arguments are written under the file lock, so threads do not interleave
+static void trace_call(int call, GRAPH_OBJ *go, ...) {
+
+    va_list ap;
+    char *a;
+    uint8_t args[TRACE_MAX_ARGS * sizeof(ALLEGRO_COLOR)];
+    size_t n = 0;
+    void *blob = NULL;
+    uint32_t bloblen = 0;
+    float f;
+    int32_t i;
+    ALLEGRO_COLOR c;
+    DAP_TRACE_REC rec;
+    DAP_TRACE *t = trace_rec;
+
+    // at most one string or data argument, written after the others
+    va_start(ap, go);
+    for (a = trace_calls[call].args; *a != '\0'; a++) {
+        switch (*a)
+        {
+            case 'f':
+            f = (float)va_arg(ap, double);
+            memcpy(args + n, &f, sizeof(f));
+            n += sizeof(f);
+            break;
+
+            case 'i':
+            i = va_arg(ap, int);
+            memcpy(args + n, &i, sizeof(i));
+            n += sizeof(i);
+            break;
+
+            case 'c':
+            c = va_arg(ap, ALLEGRO_COLOR);
+            memcpy(args + n, &c, sizeof(c));
+            n += sizeof(c);
+            break;
+
+            case 's':
+            blob = va_arg(ap, char *);
+            bloblen = strlen(blob);
+            memcpy(args + n, &bloblen, sizeof(bloblen));
+            n += sizeof(bloblen);
+            break;
+
+            case 'd':
+            blob = va_arg(ap, uint8_t *);
+            bloblen = (uint32_t)va_arg(ap, size_t);
+            memcpy(args + n, &bloblen, sizeof(bloblen));
+            n += sizeof(bloblen);
+            break;
+        }
+    }
+    va_end(ap);
+
+    flockfile(t->f);
+    rec.obj = 0;
+    if (go != NULL) {
+        rec.obj = trace_object(t, go);
+        if (rec.obj == 0) {
+            t->ndropped++;
+            funlockfile(t->f);
+            return;
+        }
+    }
+    rec.call = call;
+    rec.len = n + bloblen;
+    rec.time = (uint64_t)((al_get_time() - t->start) * 1e9);
+    fwrite(&rec, sizeof(rec), 1, t->f);
+    fwrite(args, 1, n, t->f);
+    if (bloblen > 0) {
+        fwrite(blob, 1, bloblen, t->f);
+    }
+    t->ncalls++;
+    funlockfile(t->f);
+}
+
+// record a submit as the ids of its contexts, in order
+static void trace_ctx_submit(DAP_CTX **ctxs, int n) {
+
+    int i;
+    uint32_t *ids;
+
+    ids = malloc(((size_t)n + 1) * sizeof(uint32_t));
+    if (ids == NULL) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        ids[i] = ctxs[i]->id;
+    }
+    trace_call(TRACE_CTX_SUBMIT, NULL, ids, (size_t)n * sizeof(uint32_t));
+    free(ids);
+}
+
+// replay timing of one traced call
+typedef struct dtstat {
+    uint64_t count;
+    double total;       // seconds
+    double max;
+} DAP_TRACE_STAT;
+
+// contexts of a replayed trace, by the id they were traced with
+typedef struct dtctxs {
+    uint32_t *ids;
+    DAP_CTX **ctxs;
+    int n;
+    int size;
+} DAP_TRACE_CTXS;
+
+// replay context of a traced context id, created when first seen
+// returns the context, otherwise NULL if out of memory
+static DAP_CTX *replay_ctx(DAP_TRACE_CTXS *tc, uint32_t id) {
+
+    int k, size;
+    uint32_t *ids;
+    DAP_CTX **ctxs;
+
+    for (k = 0; k < tc->n; k++) {
+        if (tc->ids[k] == id) {
+            return tc->ctxs[k];
+        }
+    }
+    if (tc->n == tc->size) {
+        size = tc->size ? tc->size * 2 : 16;
+        ids = realloc(tc->ids, size * sizeof(uint32_t));
+        if (ids == NULL) {
+            return NULL;
+        }
+        tc->ids = ids;
+        ctxs = realloc(tc->ctxs, size * sizeof(DAP_CTX *));
+        if (ctxs == NULL) {
+            return NULL;
+        }
+        tc->ctxs = ctxs;
+        tc->size = size;
+    }
+    tc->ctxs[tc->n] = dap_ctx_create(NULL);
+    if (tc->ctxs[tc->n] == NULL) {
+        return NULL;
+    }
+    tc->ids[tc->n] = id;
+    return tc->ctxs[tc->n++];
+}
+
+// record a traced draw call in a replay context
+static void replay_ctx_draw(DAP_CTX *ctx, GRAPH_OBJ *go, int call) {
+
+    switch (call)
+    {
+        case TRACE_DRAW_RASTER:
+        dap_ctx_draw_raster(ctx, go);
+        break;
+
+        case TRACE_DRAW_LINE:
+        dap_ctx_draw_line(ctx, go);
+        break;
+
+        case TRACE_DRAW_RECTANGLE_FILL:
+        dap_ctx_draw_rectangle_fill(ctx, go);
+        break;
+
+        case TRACE_DRAW_CIRCLE_FILL:
+        dap_ctx_draw_circle_fill(ctx, go);
+        break;
+
+        case TRACE_DRAW_CIRCLE_BORDER:
+        dap_ctx_draw_circle_border(ctx, go);
+        break;
+
+        case TRACE_DRAW_RECTANGLE_BORDER:
+        dap_ctx_draw_rectangle_border(ctx, go);
+        break;
+
+        case TRACE_DRAW_TEXT:
+        dap_ctx_draw_text(ctx, go);
+        break;
+
+        case TRACE_DRAW_POLYGON:
+        dap_ctx_draw_polygon(ctx, go);
+        break;
+    }
+}
+
+// submit the replay contexts of a traced submit, blob holds their ids
+static void replay_ctx_submit(DAP_TRACE_CTXS *tc, uint8_t *blob, uint32_t bloblen) {
+
+    int k, n;
+    uint32_t id;
+    DAP_CTX **ctxs;
+
+    n = bloblen / sizeof(uint32_t);
+    ctxs = malloc(((size_t)n + 1) * sizeof(DAP_CTX *));
+    if (ctxs == NULL) {
+        return;
+    }
+    for (k = 0; k < n; k++) {
+        memcpy(&id, blob + k * sizeof(uint32_t), sizeof(id));
+        ctxs[k] = replay_ctx(tc, id);
+        if (ctxs[k] == NULL) {
+            free(ctxs);
+            return;
+        }
+    }
+    dap_ctx_submit(ctxs, n);
+    free(ctxs);
+}
+
+// run one traced call on an object
+// rd is the incremental update state of the object, tc the replay contexts
+static void replay_call(int call, GRAPH_OBJ *go, DAP_RASTER_DIFF *rd, DAP_TRACE_CTXS *tc, float *f,
+                        int32_t *i, ALLEGRO_COLOR *c, uint8_t *blob, uint32_t bloblen) {
+
+    DAP_CTX *ctx;
+
+    switch (call)
+    {
+        case TRACE_SET_GRAPH_TYPE:
+        dap_set_graph_type(go, i[0]);
+        break;
+
+        case TRACE_SET_GRAPH_COLOR:
+        dap_set_graph_color(go, i[0], c[1], c[2]);
+        break;
+
+        case TRACE_SET_GRAPH_COLOR_MODE:
+        dap_set_graph_color_mode(go, i[0], i[1]);
+        break;
+
+        case TRACE_SET_GRAPH_STYLE_PATTERN:
+        dap_set_graph_style_pattern(go, i[0]);
+        break;
+
+        case TRACE_SET_GRAPH_STYLE_CLIP:
+        dap_set_graph_style_clip(go, i[0]);
+        break;
+
+        case TRACE_SET_GRAPH_STYLE_FILL:
+        dap_set_graph_style_fill(go, i[0]);
+        break;
+
+        case TRACE_SET_GRAPH_STYLE_BORDER:
+        dap_set_graph_style_border(go, i[0]);
+        break;
+
+        case TRACE_SET_GRAPH_STYLE:
+        dap_set_graph_style(go, i[0], i[1], i[2]);
+        break;
+
+        case TRACE_SET_GRAPH_STYLE_WIDTH:
+        dap_set_graph_style_width(go, i[0]);
+        break;
+
+        case TRACE_SET_CIRCLE:
+        dap_set_circle(go, f[0], f[1], f[2]);
+        break;
+
+        case TRACE_SET_RECTANGLE:
+        dap_set_rectangle(go, f[0], f[1], f[2], f[3]);
+        break;
+
+        case TRACE_SET_LINE:
+        dap_set_line(go, f[0], f[1], f[2], f[3]);
+        break;
+
+        case TRACE_SET_RASTER_DATA:
+        dap_set_raster_data(go, f[0], f[1], i[2], blob, bloblen);
+        break;
+
+        case TRACE_SET_RASTER_TRANSFORM:
+        dap_set_raster_transform(go, f[0], f[1], f[2]);
+        break;
+
+        case TRACE_SET_TEXT:
+        dap_set_text(go, f[0], f[1], (char *)blob);
+        break;
+
+        case TRACE_SET_TEXT_SCALE:
+        dap_set_text_scale(go, i[0]);
+        break;
+
+        case TRACE_SET_POLYGON:
+        dap_set_polygon(go, f[0], f[1], (float *)blob, bloblen / (2 * sizeof(float)));
+        break;
+
+        case TRACE_UPDATE_RASTER:
+        if (rd->prev != NULL) {
+            dap_update_raster(go, rd, blob);
+        }
+        break;
+
+        case TRACE_DRAW_RASTER:
+        dap_draw_raster(go);
+        break;
+
+        case TRACE_DRAW_LINE:
+        dap_draw_line(go);
+        break;
+
+        case TRACE_DRAW_RECTANGLE_FILL:
+        dap_draw_rectangle_fill(go);
+        break;
+
+        case TRACE_DRAW_CIRCLE_FILL:
+        dap_draw_circle_fill(go);
+        break;
+
+        case TRACE_DRAW_CIRCLE_BORDER:
+        dap_draw_circle_border(go);
+        break;
+
+        case TRACE_DRAW_RECTANGLE_BORDER:
+        dap_draw_rectangle_border(go);
+        break;
+
+        case TRACE_DRAW_TEXT:
+        dap_draw_text(go);
+        break;
+
+        case TRACE_DRAW_POLYGON:
+        dap_draw_polygon(go);
+        break;
+
+        case TRACE_CLEAR:
+        dap_clear(c[0]);
+        break;
+
+        case TRACE_FLIP:
+        // headless, there is no display to flip
+        break;
+
+        case TRACE_CIRCLE_BATCH_BEGIN:
+        dap_circle_batch_begin();
+        break;
+
+        case TRACE_CIRCLE_BATCH_END:
+        dap_circle_batch_end();
+        break;
+
+        case TRACE_CTX_OBJECT:
+        ctx = replay_ctx(tc, i[0]);
+        if (ctx != NULL) {
+            dap_ctx_object(ctx, go);
+        }
+        break;
+
+        case TRACE_CTX_DRAW:
+        ctx = replay_ctx(tc, i[0]);
+        if (ctx != NULL) {
+            replay_ctx_draw(ctx, go, i[1]);
+        }
+        break;
+
+        case TRACE_CTX_CLEAR:
+        ctx = replay_ctx(tc, i[0]);
+        if (ctx != NULL) {
+            dap_ctx_clear(ctx, c[1]);
+        }
+        break;
+
+        case TRACE_CTX_SET_VIEW:
+        ctx = replay_ctx(tc, i[0]);
+        if (ctx != NULL && f[3] > 0) {
+            dap_ctx_set_view(ctx, f[1], f[2], f[3]);
+        }
+        break;
+
+        case TRACE_CTX_SUBMIT:
+        replay_ctx_submit(tc, blob, bloblen);
+        break;
+    }
+}
+
+// read the next trace record and its arguments into buf, grown as needed
+// returns 1 if a record was read, 0 at the end of the trace, otherwise -1 if it is truncated
+static int replay_read(FILE *f, DAP_TRACE_REC *rec, uint8_t **buf, size_t *bufsize) {
+
+    uint8_t *p;
+
+    if (fread(rec, sizeof(DAP_TRACE_REC), 1, f) != 1) {
+        return feof(f) ? 0 : -1;
+    }
+    if (rec->call >= TRACE_MAX || rec->obj > TRACE_MAX_OBJECTS) {
+        return -1;
+    }
+    if (rec->len > *bufsize) {
+        p = realloc(*buf, rec->len);
+        if (p == NULL) {
+            return -1;
+        }
+        *buf = p;
+        *bufsize = rec->len;
+    }
+    if (fread(*buf, 1, rec->len, f) != rec->len) {
+        return -1;
+    }
+    return 1;
+}
+
+// decode the arguments of a record by position, a string or data argument is
+// copied, nul terminated, to the storage of its object
+// returns 0 if success, otherwise -1 if the arguments do not match the call
+static int replay_args(DAP_TRACE_REC *rec, uint8_t *buf, uint8_t **objdata, float *f, int32_t *i,
+                       ALLEGRO_COLOR *c, uint8_t **blob, uint32_t *bloblen) {
+
+    char *a;
+    int k;
+    size_t n = 0, len;
+    uint8_t *p;
+
+    *blob = NULL;
+    *bloblen = 0;
+    for (a = trace_calls[rec->call].args, k = 0; *a != '\0'; a++, k++) {
+        len = *a == 'c' ? sizeof(ALLEGRO_COLOR) : 4;
+        if (n + len > rec->len) {
+            return -1;
+        }
+        switch (*a)
+        {
+            case 'f':
+            memcpy(&f[k], buf + n, len);
+            break;
+
+            case 'i':
+            memcpy(&i[k], buf + n, len);
+            break;
+
+            case 'c':
+            memcpy(&c[k], buf + n, len);
+            break;
+
+            case 's':
+            case 'd':
+            memcpy(bloblen, buf + n, len);
+            if (n + len + *bloblen != rec->len) {
+                return -1;
+            }
+            p = realloc(objdata[rec->obj], *bloblen + 1);
+            if (p == NULL) {
+                return -1;
+            }
+            memcpy(p, buf + n + len, *bloblen);
+            p[*bloblen] = '\0';
+            objdata[rec->obj] = *blob = p;
+            break;
+        }
+        n += len;
+    }
+    return 0;
+}
+
+// replay a trace headless into a memory bitmap, as fast as possible, and print the time of each call
+// returns 0 if success, otherwise -1 if the trace cannot be read
+int dap_trace_replay(char *filename) {
+
+    assert(filename != NULL);
+
+    FILE *f;
+    int r = -1, k;
+    uint32_t hdr[2], bloblen;
+    uint8_t *buf = NULL, *blob, **objdata;
+    size_t bufsize = 0;
+    float fa[TRACE_MAX_ARGS];
+    int32_t ia[TRACE_MAX_ARGS];
+    ALLEGRO_COLOR ca[TRACE_MAX_ARGS];
+    double t0, t, total = 0, recorded = 0;
+    uint64_t ncalls = 0;
+    DAP_TRACE_REC rec;
+    DAP_TRACE_STAT st[TRACE_MAX];
+    GRAPH_OBJ *objs;
+    DAP_RASTER_DIFF *diffs;
+    DAP_TRACE_CTXS tc;
+    ALLEGRO_BITMAP *bmp;
+
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Could not open trace %s\n", filename);
+        return -1;
+    }
+    // earlier versions only lack the calls added since
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != TRACE_FILE_MAGIC ||
+        hdr[1] == 0 || hdr[1] > TRACE_FILE_VERSION) {
+        printf("%s is not a version 1 to %d trace\n", filename, TRACE_FILE_VERSION);
+        fclose(f);
+        return -1;
+    }
+
+    // object 0 stands in for the calls without an object
+    memset(&tc, 0, sizeof(tc));
+    objs = calloc(TRACE_MAX_OBJECTS + 1, sizeof(GRAPH_OBJ));
+    objdata = calloc(TRACE_MAX_OBJECTS + 1, sizeof(uint8_t *));
+    diffs = calloc(TRACE_MAX_OBJECTS + 1, sizeof(DAP_RASTER_DIFF));
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    bmp = al_create_bitmap(WIN_WIDTH, WIN_HEIGHT);
+
+    if (objs != NULL && objdata != NULL && diffs != NULL && bmp != NULL) {
+        al_set_target_bitmap(bmp);
+        memset(st, 0, sizeof(st));
+
+        for (;;) {
+            r = replay_read(f, &rec, &buf, &bufsize);
+            if (r != 1) {
+                break;
+            }
+            r = replay_args(&rec, buf, objdata, fa, ia, ca, &blob, &bloblen);
+            if (r == -1) {
+                break;
+            }
+
+            t0 = al_get_time();
+            replay_call(rec.call, &objs[rec.obj], &diffs[rec.obj], &tc, fa, ia, ca, blob, bloblen);
+            t = al_get_time() - t0;
+
+            // keep a copy of new raster data for the incremental updates of the object
+            if (rec.call == TRACE_SET_RASTER_DATA) {
+                dap_raster_diff_free(&diffs[rec.obj]);
+                if (dap_raster_diff_init(&diffs[rec.obj], &objs[rec.obj]) == -1) {
+                    r = -1;
+                    break;
+                }
+            }
+
+            st[rec.call].count++;
+            st[rec.call].total += t;
+            if (t > st[rec.call].max) {
+                st[rec.call].max = t;
+            }
+            total += t;
+            recorded = rec.time / 1e9;
+            ncalls++;
+        }
+        al_set_target_bitmap(NULL);
+    }
+
+    if (r == -1) {
+        printf("Could not replay %s, bad record after %llu calls\n", filename, (unsigned long long)ncalls);
+    }
+    else {
+        printf("%-28s %10s %10s %10s %10s\n", "call", "count", "total ms", "mean us", "max us");
+        for (k = 0; k < TRACE_MAX; k++) {
+            if (st[k].count == 0) {
+                continue;
+            }
+            printf("%-28s %10llu %10.3f %10.3f %10.3f\n", trace_calls[k].name,
+                   (unsigned long long)st[k].count, st[k].total * 1e3,
+                   st[k].total * 1e6 / st[k].count, st[k].max * 1e6);
+        }
+        printf("replayed %llu calls in %.3f ms, recorded over %.3f ms\n",
+               (unsigned long long)ncalls, total * 1e3, recorded * 1e3);
+    }
+
+    for (k = 0; k <= TRACE_MAX_OBJECTS; k++) {
+        if (objdata != NULL) {
+            free(objdata[k]);
+        }
+        if (diffs != NULL) {
+            dap_raster_diff_free(&diffs[k]);
+        }
+    }
+    for (k = 0; k < tc.n; k++) {
+        dap_ctx_destroy(tc.ctxs[k]);
+    }
+    free(tc.ids);
+    free(tc.ctxs);
+    free(objdata);
+    free(diffs);
+    free(objs);
+    free(buf);
+    if (bmp != NULL) {
+        al_destroy_bitmap(bmp);
+    }
+    fclose(f);
+    return r;
+}
+
+// Demo screen
+//
+// The demo screen is drawn as a list of scenes. Each scene starts from the
+// demo defaults, so any scene can also be drawn on its own.
+
+// raster drawn by the demo, loaded in the background by demo_init
+GRAPH_OBJ   demo_raster;
+
+// set the demo defaults
+void scene_defaults(void) {
+    dap_set_graph_style_clip(&g, false);
+    dap_set_graph_type(&g, TYPE_RECTANGLE);
+    dap_set_graph_color(&g, false, C585NM, BLACK);
+    dap_set_graph_style(&g, BORDER_PATTERN, FILL_VERTBARS, 0xFF00);
+}
+
+// lines
+void scene_lines(void) {
+
+    // draw a horizontal line
+    dap_set_graph_style_border(&g, LINE_PATTERN);
+    dap_set_line(&g, 10, 10, 200, 10);
+    dap_draw_line(&g);
+    // draw a vertical line
+    dap_set_line(&g, 200, 10, 200, 250);
+    dap_draw_line(&g);
+    // draw diagonal line
+    dap_set_line(&g, 200, 250, 10, 10);
+    dap_draw_line(&g);
+}
+
+// rectangle fills
+void scene_rect_fills(void) {
+
+    dap_set_graph_style_fill(&g, FILL_VERTBARS);
+    dap_set_rectangle(&g, 10, 550, 200, 600);
+    dap_draw_rectangle_fill(&g);
+
+    dap_set_graph_style_fill(&g, FILL_PATTERN);
+    dap_set_rectangle(&g, 210, 550, 400, 600);
+    dap_draw_rectangle_fill(&g);
+
+    dap_set_graph_style_fill(&g, FILL_SOLID);
+    dap_set_rectangle(&g, 410, 550, 600, 600);
+    dap_draw_rectangle_fill(&g);
+}
+
+// circle fills
+void scene_circle_fills(void) {
+
+    dap_set_graph_style_fill(&g, FILL_VERTBARS);
+    dap_set_circle(&g, 60, 300, 50);
+    dap_draw_circle_fill(&g);
+
+    dap_set_graph_style_fill(&g, FILL_PATTERN);
+    dap_set_circle(&g, 200, 300, 50);
+    dap_draw_circle_fill(&g);
+
+    dap_set_graph_style_fill(&g, FILL_SOLID);
+    dap_set_circle(&g, 350, 300, 50);
+    dap_draw_circle_fill(&g);
+}
+
+// circle borders
+void scene_circle_borders(void) {
+
+    int r;
+
+    // range rings, drawn in one batch
+    dap_set_graph_style_border(&g, BORDER_DASH);
+    dap_circle_batch_begin();
+    for (r = 50; r > 0; r -= 12) {
+        dap_set_circle(&g, 60, 450, r);
+        dap_draw_circle_border(&g);
+    }
+    dap_circle_batch_end();
+
+    dap_set_graph_style_border(&g, BORDER_SOLID);
+    dap_set_circle(&g, 200, 450, 50);
+    dap_draw_circle_border(&g);
+
+    dap_set_graph_style_border(&g, BORDER_PATTERN);
+    dap_set_circle(&g, 350, 450, 50);
+    dap_draw_circle_border(&g);
 }
 
-// close raster file
+// rectangle borders
+void scene_rect_borders(void) {
+
+    dap_set_graph_style_border(&g, BORDER_SOLID);
+    dap_set_rectangle(&g, 410, 650, 600, 700);
+    dap_draw_rectangle_border(&g);
+
+    dap_set_graph_style_border(&g, BORDER_DASH);
+    dap_set_rectangle(&g, 10, 650, 200, 700);
+    dap_draw_rectangle_border(&g);
+
+    dap_set_graph_style_border(&g, BORDER_PATTERN);
+    dap_set_rectangle(&g, 210, 650, 400, 700);
+    dap_draw_rectangle_border(&g);
+}
+
+// thick strokes
+void scene_thick(void) {
+
+    dap_set_graph_style_width(&g, 5);
+
+    dap_set_graph_style_border(&g, BORDER_SOLID);
+    dap_set_line(&g, 930, 20, 1010, 60);
+    dap_draw_line(&g);
+
+    dap_set_graph_style_border(&g, BORDER_DASH);
+    dap_set_line(&g, 930, 80, 1010, 120);
+    dap_draw_line(&g);
+
+    dap_set_graph_style_border(&g, BORDER_PATTERN);
+    dap_set_rectangle(&g, 935, 150, 1005, 200);
+    dap_draw_rectangle_border(&g);
+
+    dap_set_graph_style_width(&g, 7);
+    dap_set_graph_style_border(&g, BORDER_DASH);
+    dap_set_circle(&g, 970, 270, 35);
+    dap_draw_circle_border(&g);
+    dap_set_graph_style_width(&g, 1);
+}
+
+// filled and bordered shapes
+void scene_shapes(void) {
+
+    // draw a rectangle
+    dap_set_graph_style(&g, BORDER_PATTERN, FILL_PATTERN, 0xFF00);
+    dap_set_rectangle(&g, 700, 400, 900, 500);
+    dap_draw_rectangle(&g);
+
+    // draw a circle
+    dap_set_graph_style(&g, BORDER_PATTERN, FILL_PATTERN, 0xFF00);
+    dap_set_circle(&g, 700, 200, 150);
+    dap_draw_circle(&g);
+}
+
+// polygons
+void scene_polygons(void) {
+
+    static float star[] = {0, -50, 12, -16, 48, -16, 19, 6, 30, 40, 0, 18, -30, 40, -19, 6, -48, -16, -12, -16};
+    static float arrow[] = {0, 0, 60, 30, 0, 60, 15, 30};
+
+    dap_set_graph_style(&g, BORDER_DASH, FILL_PATTERN, 0xFF00);
+    dap_set_polygon(&g, 700, 700, star, 10);
+    dap_draw_polygon(&g);
+
+    dap_set_graph_style(&g, BORDER_SOLID, FILL_VERTBARS, 0xF0F0);
+    dap_set_polygon(&g, 800, 670, arrow, 4);
+    dap_draw_polygon(&g);
+}
+
+// raster pattern
+void scene_raster(void) {
+
+    int r;
+
+    r = dap_draw_raster(&demo_raster);
+    if (r == -1) {
+        printf("Nothing to draw\n");
+    }
+}
+
+// raster pattern from the demo raster's data, at half size and turned
+void scene_raster_turned(void) {
+
+    GRAPH_OBJ rt;
+
+    // nothing until the demo raster is loaded
+    if (demo_raster.grast.load != NULL || demo_raster.grast.rdataptr == NULL) {
+        return;
+    }
+    memset(&rt, 0, sizeof(rt));
+    dap_set_graph_color(&rt, false, C585NM, BLACK);
+    dap_set_raster_data(&rt, 900, 600, 1028, demo_raster.grast.rdataptr, demo_raster.grast.fdlength);
+    dap_set_raster_transform(&rt, 0.5f, 0.5f, 0.3f);
+    dap_draw_raster(&rt);
+}
+
+// text overlay
+void scene_text(void) {
+
+    dap_set_text(&g, 620, 560, "DASHLINE TERMINAL OVERLAY\nAMBER ON BLACK, GLYPH ATLAS");
+    dap_draw_text(&g);
+
+    dap_set_graph_color(&g, true, APPLE2, BLACK);
+    dap_set_text(&g, 620, 590, " INVERTED APPLE2 ");
+    dap_draw_text(&g);
+
+    dap_set_graph_color(&g, false, GREEN1, BLACK);
+    dap_set_graph_color_mode(&g, true, false);
+    dap_set_text(&g, 620, 610, "OVERLAY X2");
+    dap_set_text_scale(&g, 2);
+    dap_draw_text(&g);
+    dap_set_graph_color_mode(&g, false, false);
+}
+
+typedef struct dscene {
+    char *name;
+    void (*draw)(void);
+    bool untimed;       // checked for its image only, its time is mostly threads, files and system calls
+} DEMO_SCENE;
+
+// scenes of the demo screen, in drawing order
+DEMO_SCENE demo_scenes[] = {
+    {"lines", scene_lines},
+    {"rect_fills", scene_rect_fills},
+    {"circle_fills", scene_circle_fills},
+    {"circle_borders", scene_circle_borders},
+    {"rect_borders", scene_rect_borders},
+    {"thick", scene_thick},
+    {"shapes", scene_shapes},
+    {"polygons", scene_polygons},
+    {"raster", scene_raster},
+    {"raster_turned", scene_raster_turned},
+    {"text", scene_text},
+};
+
+#define NUM_OF_DEMO_SCENES  (sizeof(demo_scenes) / sizeof(demo_scenes[0]))
+
+// map the demo raster
 // returns 0 if success, otherwise -1
- int dap_close_raster_file(GRAPH_OBJ *go) {
+int demo_init(void) {
 
-    assert(go != NULL);
     int r;
 
-    // open file and get stats (size)
-    r = close(go->grast.fd);
-    return r;
+    if (dap_text_init() == -1) {
+        printf("Could not create text font\n");
+    }
+
+    // map the raster file in the background, the demo draws a placeholder until it is ready
+    dap_set_graph_color(&demo_raster, false, C585NM, BLACK);
+    r = dap_load_raster_file(&demo_raster, RASTER_FILE, 0, 725, 512);
+    if (r == -1) {
+        printf("Could not load raster file\n");
+        return -1;
+    }
+    return 0;
 }
 
-// draw raster pattern
+// draw one demo scene
+void demo_draw_scene(DEMO_SCENE *s) {
+    scene_defaults();
+    s->draw();
+}
+
+// draw the demo screen
+void demo_draw(void) {
+
+    size_t i;
+
+    dap_clear(BLACK);
+    for (i = 0; i < NUM_OF_DEMO_SCENES; i++) {
+        demo_draw_scene(&demo_scenes[i]);
+    }
+}
+
+// fill a compact scene with the demo raster and n random lines, circles and rectangles
 // returns 0 if success, otherwise -1
-int dap_draw_raster(GRAPH_OBJ *go) {
+int demo_build_scene(DAP_SCENE *sc, size_t n) {
+
+    size_t i;
+    float x, y;
+    GRAPH_OBJ go;
+    ALLEGRO_COLOR colors[] = {C585NM, AMBER, APPLE2, GREEN1, BLUE};
+
+    if (dap_raster_wait(&demo_raster) == -1 || dap_scene_add(sc, &demo_raster) == -1) {
+        return -1;
+    }
+
+    memset(&go, 0, sizeof(GRAPH_OBJ));
+    dap_set_graph_style(&go, BORDER_SOLID, FILL_NONE, 0xF0F0);
+    srand(1);
+    for (i = 0; i < n; i++) {
+        x = rand() % WIN_WIDTH;
+        y = rand() % WIN_HEIGHT;
+        dap_set_graph_color(&go, false, colors[i % 5], BLACK);
+        switch (i % 3)
+        {
+            case 0:
+            dap_set_line(&go, x, y, x + rand() % 64 - 32, y + rand() % 64 - 32);
+            break;
+
+            case 1:
+            dap_set_circle(&go, x, y, 2 + rand() % 14);
+            break;
+
+            case 2:
+            dap_set_rectangle(&go, x, y, x + 2 + rand() % 30, y + 2 + rand() % 30);
+            break;
+        }
+        dap_set_graph_style_border(&go, i % 7 == 0 ? BORDER_PATTERN : BORDER_SOLID);
+        if (dap_scene_add(sc, &go) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// share of the random objects built in its own context by a worker thread
+typedef struct dpart {
+    pthread_t thread;
+    DAP_CTX *ctx;
+    unsigned int seed;
+    size_t n;
+} DEMO_PART;
+
+// build a share of random lines, circles and rectangles, the worker thread
+void *demo_build_part(void *arg) {
+
+    size_t i;
+    float x, y;
+    GRAPH_OBJ go;
+    DEMO_PART *part = arg;
+    ALLEGRO_COLOR colors[] = {C585NM, AMBER, APPLE2, GREEN1, BLUE};
+
+    dap_ctx_object(part->ctx, &go);
+    dap_set_graph_style(&go, BORDER_SOLID, FILL_NONE, 0xF0F0);
+    for (i = 0; i < part->n; i++) {
+        x = rand_r(&part->seed) % WIN_WIDTH;
+        y = rand_r(&part->seed) % WIN_HEIGHT;
+        dap_set_graph_color(&go, false, colors[i % 5], BLACK);
+        switch (i % 3)
+        {
+            case 0:
+            dap_set_line(&go, x, y, x + rand_r(&part->seed) % 64 - 32, y + rand_r(&part->seed) % 64 - 32);
+            dap_ctx_draw_line(part->ctx, &go);
+            break;
+
+            case 1:
+            dap_set_circle(&go, x, y, 2 + rand_r(&part->seed) % 14);
+            dap_ctx_draw_circle_border(part->ctx, &go);
+            break;
+
+            case 2:
+            dap_set_rectangle(&go, x, y, x + 2 + rand_r(&part->seed) % 30, y + 2 + rand_r(&part->seed) % 30);
+            dap_ctx_draw_rectangle_border(part->ctx, &go);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// build the random objects on n worker threads, one context each, and draw them as one frame
+// returns 0 if success, otherwise -1
+int demo_draw_parts(DEMO_PART *parts, int n) {
+
+    int i, started;
+    DAP_CTX *ctxs[n];
+
+    for (started = 0; started < n; started++) {
+        parts[started].seed = started + 1;
+        if (pthread_create(&parts[started].thread, NULL, demo_build_part, &parts[started]) != 0) {
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(parts[i].thread, NULL);
+        ctxs[i] = parts[i].ctx;
+    }
+    dap_clear(BLACK);
+    dap_ctx_submit(ctxs, started);
+    return started == n ? 0 : -1;
+}
+
+// paint the demo screen into a window
+void demo_paint_screen(DAP_WINDOW *win, void *arg) {
+
+    size_t i;
+
+    for (i = 0; i < NUM_OF_DEMO_SCENES; i++) {
+        demo_draw_scene(&demo_scenes[i]);
+    }
+
+    // the raster was drawn as a placeholder, paint again next frame
+    if (demo_raster.grast.load != NULL) {
+        dap_window_invalidate(win);
+    }
+}
+
+// paint the status window, the number of times it was painted
+void demo_paint_status(DAP_WINDOW *win, void *arg) {
+
+    GRAPH_OBJ *go = arg;
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "PAINTS %u", win->npaints + 1);
+    dap_set_graph_color(go, false, win->fg, win->bg);
+    dap_set_text(go, 2, 2, buf);
+    dap_draw_text(go);
+}
+
+// static overlay of the frozen group demo, a grid, range rings and a frame
+#define DEMO_GRID_STEP  128
+#define DEMO_RINGS      4
+GRAPH_OBJ demo_overlay[WIN_WIDTH / DEMO_GRID_STEP + WIN_HEIGHT / DEMO_GRID_STEP + DEMO_RINGS + 1];
+
+// add the overlay to a frozen group
+int demo_freeze(DAP_FREEZE *fz) {
+
+    int i, n = 0;
+    GRAPH_OBJ *go;
+
+    for (i = 1; i <= WIN_WIDTH / DEMO_GRID_STEP + WIN_HEIGHT / DEMO_GRID_STEP; i++) {
+        go = &demo_overlay[n++];
+        dap_set_graph_color(go, false, GREEN3, BLACK);
+        dap_set_graph_color_mode(go, true, false);
+        dap_set_graph_style(go, BORDER_DASH, FILL_NONE, 0);
+        if (i < WIN_WIDTH / DEMO_GRID_STEP) {
+            dap_set_line(go, i * DEMO_GRID_STEP, 0, i * DEMO_GRID_STEP, WIN_HEIGHT - 1);
+        }
+        else {
+            dap_set_line(go, 0, (i - WIN_WIDTH / DEMO_GRID_STEP) * DEMO_GRID_STEP,
+                         WIN_WIDTH - 1, (i - WIN_WIDTH / DEMO_GRID_STEP) * DEMO_GRID_STEP);
+        }
+    }
+    for (i = 1; i <= DEMO_RINGS; i++) {
+        go = &demo_overlay[n++];
+        dap_set_graph_color(go, false, AMBER, BLACK);
+        dap_set_graph_color_mode(go, true, false);
+        dap_set_graph_style(go, i == DEMO_RINGS ? BORDER_SOLID : BORDER_DASH, FILL_NONE, 0);
+        dap_set_circle(go, WIN_WIDTH / 2, WIN_HEIGHT / 2, i * DEMO_GRID_STEP * 0.75f);
+    }
+    go = &demo_overlay[n++];
+    dap_set_graph_color(go, false, AMBER, BLACK);
+    dap_set_graph_style(go, BORDER_SOLID, FILL_NONE, 0);
+    dap_set_rectangle(go, 1, 1, WIN_WIDTH - 1, WIN_HEIGHT - 1);
+
+    for (i = 0; i < n; i++) {
+        if (dap_freeze_add(fz, &demo_overlay[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// add the jobs of the progressive demo, a pattern filled circle far larger
+// than the screen, a vertical bar overlay, the raster and a dashed frame
+int demo_progressive(DAP_SCHED *s) {
+
+    GRAPH_OBJ go;
+
+    memset(&go, 0, sizeof(GRAPH_OBJ));
+    dap_set_graph_color(&go, false, C585NM, BLACK);
+    dap_set_graph_style(&go, BORDER_DASH, FILL_PATTERN, 0xF0F0);
+    dap_set_circle(&go, WIN_WIDTH / 2, WIN_HEIGHT / 2, 4000);
+    if (dap_sched_add(s, &go, CMD_FILL) == -1) {
+        return -1;
+    }
+    dap_set_graph_color(&go, false, RED, BLACK);
+    dap_set_graph_color_mode(&go, true, false);
+    dap_set_graph_style(&go, BORDER_DASH, FILL_VERTBARS, 0x8000);
+    dap_set_rectangle(&go, 64, 64, WIN_WIDTH - 64, WIN_HEIGHT - 64);
+    if (dap_sched_add(s, &go, CMD_FILL) == -1 || dap_sched_add(s, &go, CMD_BORDER) == -1) {
+        return -1;
+    }
+    return dap_sched_add(s, &demo_raster, CMD_FILL) == -1 ? -1 : 0;
+}
+
+// run the progressive demo for a frame within budget seconds and show what is drawn so far
+// returns the number of jobs not yet drawn
+int demo_draw_progressive(DAP_SCHED *s, ALLEGRO_BITMAP *canvas, double budget) {
+
+    int n;
+    ALLEGRO_BITMAP *target;
+
+    target = al_get_target_bitmap();
+    al_set_target_bitmap(canvas);
+    n = dap_sched_run(s, budget);
+    al_set_target_bitmap(target);
+    al_draw_bitmap(canvas, 0, 0, 0);
+    return n;
+}
+
+// draw the demo screen into a memory bitmap frame and publish it to shared memory
+// the screen is drawn until the raster is loaded, after that only the frame counter changes
+void demo_publish(DAP_SHM *shm, ALLEGRO_BITMAP *frame, GRAPH_OBJ *status, bool *redraw) {
+
+    int64_t n;
+    int x = WIN_WIDTH - 8 - 14 * 8, y = 8, w = 14 * 8, h = 8;
+    char buf[32];
+    ALLEGRO_BITMAP *target;
+
+    target = al_get_target_bitmap();
+    al_set_target_bitmap(frame);
+    if (*redraw) {
+        demo_draw();
+        *redraw = demo_raster.grast.load != NULL;
+        x = 0;
+        y = 0;
+        w = WIN_WIDTH;
+        h = WIN_HEIGHT;
+    }
+    n = (int64_t)(__atomic_load_n(&shm->hdr->seq, __ATOMIC_RELAXED) / 2);
+    snprintf(buf, sizeof(buf), "FRAME %8lld", (long long)n + 1);
+    dap_set_graph_color(status, false, DEFAULT_WINDOW_FGCOLOR, DEFAULT_WINDOW_BGCOLOR);
+    dap_set_text(status, WIN_WIDTH - 8 - 14 * 8, 8, buf);
+    dap_draw_text(status);
+    al_set_target_bitmap(target);
+
+    dap_shm_publish(shm, frame, x, y, w, h);
+    al_draw_bitmap(frame, 0, 0, 0);
+}
+
+// Regression tests
+//
+// dashline -T dir draws every demo scene, the test scenes that cover what
+// the demo screen does not, and the whole screen, headless into a memory
+// bitmap. Each one is compared pixel for pixel with dir/<scene>.png
+// and its best time over TEST_RUNS draws is checked against its budget in
+// dir/budget.txt. Any pixel difference, a missing reference or an exceeded
+// budget fails the run.
+// dashline -G dir writes the reference images, and a budget file allowing
+// TEST_BUDGET_MARGIN times the measured time. Review and commit both.
+
+// the whole demo screen, as a test scene
+void scene_screen(void) {
+
+    size_t i;
+
+    for (i = 0; i < NUM_OF_DEMO_SCENES; i++) {
+        demo_draw_scene(&demo_scenes[i]);
+    }
+}
+
+DEMO_SCENE demo_screen = {"screen", scene_screen};
+
+// indexed framebuffer, a colour drawn after its entry is given another
+// display colour still draws with that entry
+void scene_indexed(void) {
+
+    int alarm;
+    DAP_INDEXED *ix;
+
+    ix = dap_indexed_create(420, 120);
+    if (ix == NULL) {
+        printf("Could not create indexed framebuffer\n");
+        return;
+    }
+    dap_indexed_begin(ix);
+    dap_clear(BLACK);
+    alarm = dap_indexed_color(ix, C585NM);
+    dap_set_graph_style(&g, BORDER_SOLID, FILL_SOLID, 0xFF00);
+    dap_set_rectangle(&g, 10, 10, 200, 110);
+    dap_draw_rectangle(&g);
+    dap_indexed_set_palette(ix, alarm, RED);
+    dap_set_rectangle(&g, 220, 10, 410, 110);
+    dap_draw_rectangle(&g);
+    dap_indexed_end();
+    dap_indexed_present(ix, 10, 10);
+    dap_indexed_destroy(ix);
+}
+
+// frame capture, shapes captured to a file by the encoder thread and the
+// file loaded back and drawn beside them
+void scene_capture(void) {
+
+    char pattern[PATH_MAX], name[PATH_MAX];
+    DAP_CAPTURE *cap;
+    ALLEGRO_BITMAP *bmp;
+
+    dap_set_graph_style(&g, BORDER_DASH, FILL_PATTERN, 0xF0F0);
+    dap_set_circle(&g, 100, 100, 80);
+    dap_draw_circle(&g);
+    dap_set_graph_style(&g, BORDER_SOLID, FILL_VERTBARS, 0xFF00);
+    dap_set_rectangle(&g, 20, 150, 180, 190);
+    dap_draw_rectangle(&g);
+
+    snprintf(pattern, sizeof(pattern), "%s/dashline-capture-%d-%%u.png", P_tmpdir, (int)getpid());
+    cap = dap_capture_create(200, 200, 1, pattern, CAPTURE_DROP_NEWEST);
+    if (cap == NULL) {
+        printf("Could not create frame capture\n");
+        return;
+    }
+    dap_capture(cap);
+    dap_capture_stop(cap);
+    dap_capture_destroy(cap);
+
+    snprintf(name, sizeof(name), pattern, 0u);
+    bmp = al_load_bitmap(name);
+    if (bmp == NULL) {
+        printf("Could not load capture %s\n", name);
+        return;
+    }
+    al_draw_bitmap(bmp, 220, 0, 0);
+    al_destroy_bitmap(bmp);
+    remove(name);
+}
+
+// shapes around 100, 100 in a context, with a small square at the centre
+static void view_shapes(DAP_CTX *ctx) {
+
+    static float tri[] = {0, 0, 40, 10, 10, 40};
+    GRAPH_OBJ o;
+
+    dap_ctx_object(ctx, &o);
+    dap_set_graph_style(&o, BORDER_PATTERN, FILL_PATTERN, 0xF0F0);
+    dap_set_rectangle(&o, 10, 10, 90, 60);
+    dap_ctx_draw_rectangle(ctx, &o);
+    dap_set_graph_style(&o, BORDER_DASH, FILL_VERTBARS, 0xFF00);
+    dap_set_circle(&o, 150, 50, 35);
+    dap_ctx_draw_circle(ctx, &o);
+    dap_set_graph_style_border(&o, BORDER_PATTERN);
+    dap_set_line(&o, 10, 190, 190, 110);
+    dap_ctx_draw_line(ctx, &o);
+    dap_set_graph_style(&o, BORDER_SOLID, FILL_PATTERN, 0xCCCC);
+    dap_set_polygon(&o, 130, 130, tri, 3);
+    dap_ctx_draw_polygon(ctx, &o);
+    dap_set_graph_style(&o, BORDER_SOLID, FILL_SOLID, 0xFF00);
+    dap_set_rectangle(&o, 99.5, 99.5, 100.5, 100.5);
+    dap_ctx_draw_rectangle(ctx, &o);
+}
+
+// context views: the shapes as set, half size, and zoomed 400 times on their
+// centre, which moves all but the centre square past the fixed point range
+void scene_view(void) {
+
+    int i;
+    DAP_CTX *ctxs[3];
+    DAP_VIEW views[3] = {{0, 0, 1}, {250, 0, 0.5}, {600 - 100 * 400, 100 - 100 * 400, 400}};
+
+    for (i = 0; i < 3; i++) {
+        ctxs[i] = dap_ctx_create(NULL);
+        if (ctxs[i] == NULL) {
+            printf("Could not create context\n");
+            while (i-- > 0) {
+                dap_ctx_destroy(ctxs[i]);
+            }
+            return;
+        }
+        dap_ctx_set_view(ctxs[i], views[i].x, views[i].y, views[i].zoom);
+        view_shapes(ctxs[i]);
+    }
+    dap_ctx_submit(ctxs, 3);
+    for (i = 0; i < 3; i++) {
+        dap_ctx_destroy(ctxs[i]);
+    }
+}
+
+// shared memory output: three frames published with only their changed
+// regions, so each buffer is brought up to date from both frames, and the
+// front buffer read back through a second mapping, as a consumer would, and
+// drawn beside them
+void scene_shm(void) {
+
+    int r, fd;
+    char name[64];
+    uint8_t *base;
+    DAP_SHM *shm;
+    DAP_SHM_HEADER *hdr;
+    ALLEGRO_BITMAP *target, *bmp;
+    ALLEGRO_LOCKED_REGION *lr;
+
+    snprintf(name, sizeof(name), "/dashline-test-%d", (int)getpid());
+    shm = dap_shm_create(name, 200, 200);
+    if (shm == NULL) {
+        printf("Could not create shared memory output\n");
+        return;
+    }
+    target = al_get_target_bitmap();
+
+    // a circle, a rectangle added, then the circle moved down
+    dap_set_graph_style(&g, BORDER_DASH, FILL_PATTERN, 0xF0F0);
+    dap_set_circle(&g, 60, 60, 40);
+    dap_draw_circle(&g);
+    dap_shm_publish(shm, target, 0, 0, 200, 200);
+    dap_set_graph_style(&g, BORDER_SOLID, FILL_VERTBARS, 0xFF00);
+    dap_set_rectangle(&g, 110, 120, 190, 190);
+    dap_draw_rectangle(&g);
+    dap_shm_publish(shm, target, 110, 120, 81, 71);
+    al_draw_filled_rectangle(10, 10, 110, 110, BLACK);
+    dap_set_graph_style(&g, BORDER_DASH, FILL_PATTERN, 0xF0F0);
+    dap_set_circle(&g, 60, 150, 40);
+    dap_draw_circle(&g);
+    dap_shm_publish(shm, target, 10, 10, 100, 190);
+
+    fd = shm_open(name, O_RDONLY, 0);
+    base = fd == -1 ? MAP_FAILED : mmap(NULL, shm->length, PROT_READ, MAP_SHARED, fd, 0);
+    bmp = al_create_bitmap(200, 200);
+    if (base == MAP_FAILED || bmp == NULL) {
+        printf("Could not read shared memory output\n");
+    }
+    else {
+        hdr = (DAP_SHM_HEADER *)base;
+        lr = al_lock_bitmap(bmp, ALLEGRO_PIXEL_FORMAT_ARGB_8888, ALLEGRO_LOCK_WRITEONLY);
+        if (lr != NULL) {
+            for (r = 0; r < (int)hdr->height; r++) {
+                memcpy((uint8_t *)lr->data + (ptrdiff_t)r * lr->pitch,
+                       base + hdr->offset[hdr->front] + (size_t)r * hdr->pitch, hdr->pitch);
+            }
+            al_unlock_bitmap(bmp);
+            al_draw_bitmap(bmp, 220, 0, 0);
+        }
+    }
+    if (bmp != NULL) {
+        al_destroy_bitmap(bmp);
+    }
+    if (base != MAP_FAILED) {
+        munmap(base, shm->length);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    dap_shm_destroy(shm);
+}
+
+// shapes of the shader scene, dx to the right, drawn with the shaded kernels if shaded
+static void shader_shapes(float dx, bool shaded) {
+
+    static float tri[] = {0, 0, 70, 20, 20, 70};
+
+    dap_set_graph_style(&g, BORDER_DASH, FILL_PATTERN, 0xF0F0);
+    dap_set_rectangle(&g, 10 + dx, 10, 130 + dx, 70);
+    bind_kernels_shaded(&g, shaded);
+    dap_draw_rectangle(&g);
+    dap_set_graph_style(&g, BORDER_PATTERN, FILL_VERTBARS, 0xFF00);
+    dap_set_circle(&g, 70 + dx, 130, 45);
+    bind_kernels_shaded(&g, shaded);
+    dap_draw_circle(&g);
+    dap_set_graph_style(&g, BORDER_PATTERN, FILL_PATTERN, 0xCCCC);
+    dap_set_polygon(&g, 150 + dx, 20, tri, 3);
+    bind_kernels_shaded(&g, shaded);
+    dap_draw_polygon(&g);
+    dap_set_graph_style_border(&g, BORDER_DASH);
+    dap_set_line(&g, 10 + dx, 200, 240 + dx, 230);
+    bind_kernels_shaded(&g, shaded);
+    dap_draw_line(&g);
+    dap_set_graph_style_border(&g, BORDER_PATTERN);
+    dap_set_line(&g, 240 + dx, 250, 10 + dx, 280);
+    bind_kernels_shaded(&g, shaded);
+    dap_draw_line(&g);
+}
+
+// shaded kernels: the tests draw into memory bitmaps, where the shaded kernels
+// fall back to the CPU, so the shapes drawn with them on the left must match
+// the same shapes drawn with the CPU kernels on the right, a whole number of
+// pattern periods over. test_shader draws the same scene through the shader
+void scene_shader(void) {
+    shader_shapes(0, true);
+    shader_shapes(320, false);
+}
+
+// memoized geometry: each shape is drawn, then moved and resized and drawn
+// again, so geometry kept from the first draw would show in the wrong place
+void scene_memo(void) {
+
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        dap_set_graph_style(&g, BORDER_DASH, FILL_PATTERN, 0xF0F0);
+        dap_set_circle(&g, 60 + i * 150, 60, 40 + i * 10);
+        dap_draw_circle(&g);
+        dap_set_graph_style(&g, BORDER_PATTERN, FILL_SOLID, 0xFF00);
+        dap_set_circle(&g, 60 + i * 150, 170, 45 - i * 15);
+        dap_draw_circle(&g);
+        dap_set_graph_style_border(&g, BORDER_DASH);
+        dap_set_line(&g, 10, 240 + i * 20, 150 + i * 120, 250 + i * 40);
+        dap_draw_line(&g);
+        dap_set_graph_style_border(&g, BORDER_PATTERN);
+        dap_set_line(&g, 10, 320 + i * 20, 150 + i * 120, 330 + i * 40);
+        dap_draw_line(&g);
+    }
+}
+
+// scenes checked by the tests that are not part of the demo screen
+DEMO_SCENE test_scenes[] = {
+    {"indexed", scene_indexed},
+    {"capture", scene_capture, true},
+    {"view", scene_view},
+    {"memo", scene_memo},
+    {"shader", scene_shader},
+    {"shm", scene_shm, true},
+};
+
+#define NUM_OF_TEST_SCENES  (sizeof(test_scenes) / sizeof(test_scenes[0]))
+
+// best time in seconds to draw a scene into a bitmap, the bitmap is left holding the scene
+static double time_scene(DEMO_SCENE *s, ALLEGRO_BITMAP *bmp) {
+
+    int i;
+    double t0, t, best = DBL_MAX;
+
+    al_set_target_bitmap(bmp);
+    for (i = 0; i < TEST_RUNS; i++) {
+        al_clear_to_color(BLACK);
+        t0 = al_get_time();
+        demo_draw_scene(s);
+        t = al_get_time() - t0;
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
 
-    assert(go != NULL);
+// compare two bitmaps pixel for pixel
+// returns the number of pixels that differ and the first one in fx, fy,
+// -1 if the sizes differ, -2 if either bitmap cannot be locked
+static long compare_bitmaps(ALLEGRO_BITMAP *a, ALLEGRO_BITMAP *b, int *fx, int *fy) {
 
-    uint32_t i;
-    uint8_t m, rmask, pattern;
-    uint8_t *ptr;
-    float nx, ny;
-    float posx, posy;
+    int x, y, w, h;
+    long n = 0;
+    uint32_t *pa, *pb;
+    ALLEGRO_LOCKED_REGION *la, *lb;
 
-    if ((go->grast.width == 0) || (go->grast.fdlength == 0) || go->grast.rdataptr == NULL) {
-        // nothing to draw
+    w = al_get_bitmap_width(a);
+    h = al_get_bitmap_height(a);
+    if (w != al_get_bitmap_width(b) || h != al_get_bitmap_height(b)) {
         return -1;
     }
 
-    ptr = go->grast.rdataptr;
-    nx = 0;
-    ny = 0;
-    posx = go->grast.x;
-    posy = go->grast.y;
-    rmask = STARTING_RASTER_MASK;
-
-    for (i = 0; i < (go->grast.fdlength * (uint32_t)RASTER_BITS); i++) {
-
-        // check if time to get next byte from raster file and reset bit mask
-        m = i % (uint32_t)RASTER_BITS;
-        if (m == 0) {
-            pattern = *ptr;
-            ptr++;
-            rmask = STARTING_RASTER_MASK;
+    la = al_lock_bitmap(a, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    lb = al_lock_bitmap(b, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    if (la == NULL || lb == NULL) {
+        if (la != NULL) {
+            al_unlock_bitmap(a);
         }
-
-        if (pattern & rmask) {
-            al_draw_pixel(posx, posy, go->gc.fg);
+        if (lb != NULL) {
+            al_unlock_bitmap(b);
         }
-        else {
-            al_draw_pixel(posx, posy, go->gc.bg);
+        return -2;
+    }
+    for (y = 0; y < h; y++) {
+        pa = (uint32_t *)((uint8_t *)la->data + (intptr_t)y * la->pitch);
+        pb = (uint32_t *)((uint8_t *)lb->data + (intptr_t)y * lb->pitch);
+        if (memcmp(pa, pb, w * sizeof(uint32_t)) == 0) {
+            continue;
         }
-
-        nx++;
-        posx = nx + go->grast.x;
-        if (posx >= go->grast.width) {
-            nx = 0;
-            ny++;
-            posy = ny + go->grast.y;
+        for (x = 0; x < w; x++) {
+            if (pa[x] != pb[x]) {
+                if (n == 0) {
+                    *fx = x;
+                    *fy = y;
+                }
+                n++;
+            }
         }
-        rmask = rmask >> 1;
     }
-    return 0;
+    al_unlock_bitmap(b);
+    al_unlock_bitmap(a);
+    return n;
 }
 
-// draw a line
-void dap_draw_line(GRAPH_OBJ *go) {
+// draw scene_shader into a video bitmap of an OpenGL display with the pattern shader,
+// the shaded left half must match the CPU drawn right half within TEST_SHADER_TOLERANCE,
+// lines and circle edges are rasterized a little differently by the GPU
+// returns 0 if it matched or there is no OpenGL display, otherwise 1
+static int test_shader(void) {
+
+    int x, y, h, flags;
+    long ndiff = 0, nlit = 0;
+    uint32_t *p;
+    ALLEGRO_DISPLAY *display;
+    ALLEGRO_BITMAP *bmp;
+    ALLEGRO_LOCKED_REGION *lr;
+
+    flags = al_get_new_display_flags();
+    al_set_new_display_flags(ALLEGRO_OPENGL | ALLEGRO_PROGRAMMABLE_PIPELINE);
+    display = al_create_display(WIN_WIDTH, WIN_HEIGHT);
+    al_set_new_display_flags(flags);
+    if (display == NULL) {
+        printf("%-16s skip no OpenGL display\n", "shader_gpu");
+        return 0;
+    }
+    if (dap_shader_init() == -1) {
+        printf("%-16s FAIL could not build the pattern shader\n", "shader_gpu");
+        al_destroy_display(display);
+        return 1;
+    }
 
-    assert(go != NULL);
-    if (go->gtype == TYPE_LINE) {
+    al_set_new_bitmap_flags(ALLEGRO_VIDEO_BITMAP);
+    bmp = al_create_bitmap(WIN_WIDTH, WIN_HEIGHT);
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    if (bmp == NULL) {
+        printf("%-16s FAIL could not create a video bitmap\n", "shader_gpu");
+        dap_shader_destroy();
+        al_destroy_display(display);
+        return 1;
+    }
+    al_set_target_bitmap(bmp);
+    al_clear_to_color(BLACK);
+    scene_shader();
+    dap_shader_destroy();
+
+    // the shaded half is compared with the CPU half 320 pixels to its right
+    h = al_get_bitmap_height(bmp);
+    lr = al_lock_bitmap(bmp, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READONLY);
+    if (lr == NULL) {
+        printf("%-16s FAIL could not lock the image\n", "shader_gpu");
+        al_destroy_bitmap(bmp);
+        al_destroy_display(display);
+        return 1;
+    }
+    for (y = 0; y < h; y++) {
+        p = (uint32_t *)((uint8_t *)lr->data + (intptr_t)y * lr->pitch);
+        for (x = 0; x < 320; x++) {
+            nlit += (p[x + 320] & 0xFFFFFF) != 0;
+            ndiff += p[x] != p[x + 320];
+        }
+    }
+    al_unlock_bitmap(bmp);
+    al_destroy_bitmap(bmp);
+    al_destroy_display(display);
 
-        switch(go->gs.border)
-        {
-            case BORDER_SOLID:
-            line_solid(go);
-            break;
+    if (nlit == 0 || ndiff > nlit * TEST_SHADER_TOLERANCE) {
+        printf("%-16s FAIL %ld pixels of %ld differ\n", "shader_gpu", ndiff, nlit);
+        return 1;
+    }
+    printf("%-16s ok   %ld pixels of %ld differ\n", "shader_gpu", ndiff, nlit);
+    return 0;
+}
 
-            case BORDER_DASH:
-            line_dash(go);
-            break;
+// look up the budget of a scene in a budget file, lines of "scene milliseconds"
+// returns the budget in seconds, otherwise -1 if there is none
+static double scene_budget(char *budgetfile, char *name) {
 
-            case BORDER_PATTERN:
-            line_pattern(go);
-            break;
+    FILE *f;
+    char line[256], sname[128];
+    double ms, budget = -1;
 
-            default:
-            assert(go->gs.border < BORDER_MAX);
+    f = fopen(budgetfile, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+        if (sscanf(line, "%127s %lf", sname, &ms) == 2 && strcmp(sname, name) == 0) {
+            budget = ms / 1000.0;
             break;
         }
     }
+    fclose(f);
+    return budget;
 }
 
-// draw rectangle fill
-void dap_draw_rectangle_fill(GRAPH_OBJ *go) {
+// check, or with golden true write, the reference image and budget of every demo scene
+// returns 0 if every scene passed, otherwise 1
+int run_tests(char *dir, bool golden) {
+
+    size_t i;
+    int fx = 0, fy = 0, failed = 0;
+    long ndiff;
+    double t, budget;
+    char path[PATH_MAX], budgetfile[PATH_MAX];
+    FILE *bf = NULL;
+    DEMO_SCENE *s;
+    ALLEGRO_BITMAP *bmp, *ref;
+
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    bmp = al_create_bitmap(WIN_WIDTH, WIN_HEIGHT);
+    if (bmp == NULL) {
+        printf("Could not create test bitmap\n");
+        return 1;
+    }
 
-    assert(go != NULL);
-    if (go->gtype == TYPE_RECTANGLE) {
+    snprintf(budgetfile, sizeof(budgetfile), "%s/budget.txt", dir);
+    if (!golden && access(budgetfile, R_OK) != 0) {
+        printf("No references in %s, run make golden against the Allegro libraries, review and commit %s\n",
+               dir, dir);
+        al_destroy_bitmap(bmp);
+        return 1;
+    }
+    if (golden) {
+        bf = fopen(budgetfile, "w");
+        if (bf == NULL) {
+            printf("Could not write %s\n", budgetfile);
+            al_destroy_bitmap(bmp);
+            return 1;
+        }
+        fprintf(bf, "# scene  budget in milliseconds, written by dashline -G\n");
+    }
 
-        switch(go->gs.fill)
-        {
-            case FILL_SOLID:
-            rect_fill_solid(go);
-            break;
+    for (i = 0; i <= NUM_OF_DEMO_SCENES + NUM_OF_TEST_SCENES; i++) {
 
-            case FILL_VERTBARS:
-            rect_fill_vertbar(go);
-            break;
+        if (i < NUM_OF_DEMO_SCENES) {
+            s = &demo_scenes[i];
+        }
+        else if (i < NUM_OF_DEMO_SCENES + NUM_OF_TEST_SCENES) {
+            s = &test_scenes[i - NUM_OF_DEMO_SCENES];
+        }
+        else {
+            s = &demo_screen;
+        }
+        snprintf(path, sizeof(path), "%s/%s.png", dir, s->name);
+        t = time_scene(s, bmp);
 
-            case FILL_PATTERN:
-            rect_fill_pattern(go);
-            break;
+        if (golden) {
+            if (!al_save_bitmap(path, bmp)) {
+                printf("%-16s could not write %s\n", s->name, path);
+                failed = 1;
+            }
+            if (!s->untimed) {
+                budget = t * 1000.0 * TEST_BUDGET_MARGIN;
+                fprintf(bf, "%-16s %.3f\n", s->name, budget > TEST_BUDGET_MIN_MS ? budget : TEST_BUDGET_MIN_MS);
+            }
+            printf("%-16s %8.3f ms  written\n", s->name, t * 1000.0);
+            continue;
+        }
 
-            default:
-            assert(go->gs.fill < FILL_MAX);
-            break;
+        // visual regression
+        ref = al_load_bitmap(path);
+        if (ref == NULL) {
+            printf("%-16s FAIL no reference image %s, run make golden\n", s->name, path);
+            failed = 1;
+            continue;
+        }
+        ndiff = compare_bitmaps(bmp, ref, &fx, &fy);
+        al_destroy_bitmap(ref);
+        if (ndiff == -1) {
+            printf("%-16s FAIL reference image size differs\n", s->name);
+            failed = 1;
+            continue;
+        }
+        if (ndiff == -2) {
+            printf("%-16s FAIL could not lock the image or its reference\n", s->name);
+            failed = 1;
+            continue;
+        }
+        if (ndiff > 0) {
+            printf("%-16s FAIL %ld pixels differ, first at %d,%d\n", s->name, ndiff, fx, fy);
+            failed = 1;
+            continue;
+        }
+
+        // speed regression
+        if (s->untimed) {
+            printf("%-16s ok   %8.3f ms, not budgeted\n", s->name, t * 1000.0);
+            continue;
+        }
+        budget = scene_budget(budgetfile, s->name);
+        if (budget < 0) {
+            printf("%-16s FAIL no budget in %s\n", s->name, budgetfile);
+            failed = 1;
+            continue;
         }
+        budget = budget > TEST_BUDGET_MIN_MS / 1000.0 ? budget : TEST_BUDGET_MIN_MS / 1000.0;
+        if (t > budget) {
+            printf("%-16s FAIL %.3f ms over budget of %.3f ms\n", s->name, t * 1000.0, budget * 1000.0);
+            failed = 1;
+            continue;
+        }
+        printf("%-16s ok   %8.3f ms of %.3f ms\n", s->name, t * 1000.0, budget * 1000.0);
+    }
+
+    if (bf != NULL) {
+        fclose(bf);
+    }
+    al_destroy_bitmap(bmp);
+    if (!golden) {
+        failed |= test_shader();
     }
+    return failed;
+}
+
+void shutdown() {
+    // quit
 }
 
+void usage(char *name) {
+    printf("usage: %s [-t | -i] [-g] [-v] [-w] [-F] [-P] [-p threads] [-m name] [-c count [-o file]] [-s file]\n"
+           "       [-r trace] [-C pattern] [-f rate] [-n frames]\n"
+           "       %s -R trace\n"
+           "       %s -T dir | -G dir\n", name, name, name);
+    printf("  -t         draw on a render thread fed by a command queue\n");
+    printf("  -g         draw patterns and dashes with a GLSL shader\n");
+    printf("  -i         draw the demo screen into an 8 bit indexed framebuffer\n");
+    printf("  -p threads build random objects on this many threads every frame, in their own contexts\n");
+    printf("  -F         draw a grid and range ring overlay frozen into a vertex buffer\n");
+    printf("  -P         draw an oversized scene progressively, within half of each frame\n");
+    printf("  -m name    publish the demo screen to POSIX shared memory object name, e.g. /dashline\n");
+    printf("  -w         composite the demo screen from cached windows\n");
+    printf("  -c count   draw a compact scene of count random objects\n");
+    printf("  -o file    save the compact scene to a scene file\n");
+    printf("  -s file    draw a mapped scene file\n");
+    printf("  -r trace   record the dap_* calls to a trace file\n");
+    printf("  -R trace   replay a trace headless and time every call\n");
+    printf("  -C pattern capture a frame a second to files named by pattern, e.g. frame%%05u.png\n");
+    printf("  -v         wait for vsync when flipping\n");
+    printf("  -f rate    target frame rate, default %d\n", DEFAULT_FRAME_RATE);
+    printf("  -n frames  quit after drawing this many frames\n");
+    printf("  -T dir     test the demo scenes against the references in dir\n");
+    printf("  -G dir     write the reference images and budgets to dir\n");
+}
 
-// draw circle fill
-void dap_draw_circle_fill(GRAPH_OBJ *go) {
+int main(int argc, char **argv)  {
 
-    assert(go != NULL);
-    if (go->gtype == TYPE_CIRCLE) {
+    int opt, i;
+    bool running = true;
+    bool threaded = false;
+    bool shaded = false;
+    bool indexed = false;
+    bool redraw = true;
+    int alarm = 0;
+    bool vsync = false;
+    bool windowed = false;
+    bool progressive = false;
+    bool frozen = false;
+    size_t nobjects = 0;
+    char *savefile = NULL;
+    char *scenefile = NULL;
+    char *tracefile = NULL;
+    char *replayfile = NULL;
+    double rate = DEFAULT_FRAME_RATE;
+    uint32_t maxframes = 0;
+    char *testdir = NULL;
+    bool golden = false;
 
-        switch(go->gs.fill)
+    ALLEGRO_DISPLAY *display = NULL;
+    ALLEGRO_EVENT_QUEUE *q;
+    ALLEGRO_TIMER *timer;
+    ALLEGRO_EVENT event;
+    DAP_QUEUE *rq = NULL;
+    DAP_FRAME_PACER fp;
+    DAP_WINDOW *wins[2] = {NULL, NULL};
+    GRAPH_OBJ status;
+    DAP_SCENE *scene = NULL;
+    DAP_SCENE_FILE *sf = NULL;
+    DAP_INDEXED *ix = NULL;
+    DEMO_PART *parts = NULL;
+    int nparts = 0;
+    char *shmname = NULL;
+    DAP_SHM *shm = NULL;
+    ALLEGRO_BITMAP *shmframe = NULL;
+    char *capturefile = NULL;
+    DAP_CAPTURE *cap = NULL;
+    uint32_t capturestep = 1;
+    DAP_SCHED *sched = NULL;
+    DAP_FREEZE *fz = NULL;
+    ALLEGRO_BITMAP *canvas = NULL;
+    uint32_t drawn = 0;
+
+    while ((opt = getopt(argc, argv, "tgivwFPp:m:c:o:s:r:R:C:f:n:T:G:")) != -1) {
+        switch (opt)
         {
-            case FILL_SOLID:
-            circle_fill_solid(go);
+            case 't':
+            threaded = true;
             break;
 
-            case FILL_VERTBARS:
-            circle_fill_vertbar(go);
+            case 'g':
+            shaded = true;
             break;
 
-            case FILL_PATTERN:
-            circle_fill_pattern(go);
+            case 'i':
+            indexed = true;
             break;
 
-            default:
-            assert(go->gs.fill < FILL_MAX);
+            case 'v':
+            vsync = true;
             break;
-        }
-    }
-}
 
-// draw circle border
-void dap_draw_circle_border(GRAPH_OBJ *go) {
-
-    assert(go != NULL);
-    if (go->gtype == TYPE_CIRCLE) {
-
-        switch(go->gs.border)
-        {
-            case BORDER_SOLID:
-            circle_border_solid(go);
+            case 'w':
+            windowed = true;
             break;
 
-            case BORDER_DASH:
-            circle_border_dash(go);
+            case 'P':
+            progressive = true;
             break;
 
-            case BORDER_PATTERN:
-            circle_border_pattern(go);
+            case 'F':
+            frozen = true;
             break;
 
-            default:
-            assert(go->gs.fill < BORDER_MAX);
+            case 'p':
+            nparts = atoi(optarg);
+            if (nparts <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
             break;
-        }
-    }
-}
-
-// draw rectangle border
-void dap_draw_rectangle_border(GRAPH_OBJ *go) {
-
-    assert(go != NULL);
-    if (go->gtype == TYPE_RECTANGLE) {
 
-        switch(go->gs.border)
-        {
-            case BORDER_SOLID:
-            rect_border_solid(go);
+            case 'm':
+            shmname = optarg;
             break;
 
-            case BORDER_DASH:
-            rect_border_dash(go);
+            case 'c':
+            nobjects = strtoul(optarg, NULL, 0);
             break;
 
-            case BORDER_PATTERN:
-            rect_border_pattern(go);
+            case 'o':
+            savefile = optarg;
             break;
 
-            default:
-            assert(go->gs.fill < BORDER_MAX);
+            case 's':
+            scenefile = optarg;
             break;
-        }
-    }
-}
 
-// draw a circle
-void dap_draw_circle(GRAPH_OBJ *go) {
-    assert(go != NULL);
-    dap_draw_circle_fill(go);
-    dap_draw_circle_border(go);
-}
+            case 'r':
+            tracefile = optarg;
+            break;
 
-// draw a rectangle
-void dap_draw_rectangle(GRAPH_OBJ *go) {
-    assert(go != NULL);
-    dap_draw_rectangle_fill(go);
-    dap_draw_rectangle_border(go);
-}
+            case 'R':
+            replayfile = optarg;
+            break;
 
+            case 'C':
+            capturefile = optarg;
+            break;
 
+            case 'f':
+            rate = atof(optarg);
+            if (rate <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
 
+            case 'n':
+            maxframes = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
 
-void shutdown() {
-    // quit
-}
+            case 'G':
+            golden = true;
+            testdir = optarg;
+            break;
 
-int main()  {
+            case 'T':
+            testdir = optarg;
+            break;
 
-    int r;
-    bool running = true;
+            default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    ALLEGRO_DISPLAY *display = NULL;
-    ALLEGRO_EVENT_QUEUE *q;
-    ALLEGRO_TIMER *timer;
-    ALLEGRO_EVENT event;
+    // indexed, shared memory and progressive frames are drawn directly, not on the render thread
+    if (threaded && (indexed || shmname != NULL || progressive)) {
+        usage(argv[0]);
+        return 1;
+    }
 
     atexit(shutdown);
 
     al_init();
     al_init_primitives_addon();
     al_init_image_addon();
+
+    // traces are replayed headless, without a display
+    if (replayfile != NULL) {
+        if (dap_text_init() == -1) {
+            printf("Could not create text font\n");
+        }
+        return dap_trace_replay(replayfile) == 0 ? 0 : 1;
+    }
+
+    // tests are drawn headless, without a display
+    if (testdir != NULL) {
+        if (demo_init() == -1 || dap_raster_wait(&demo_raster) == -1) {
+            return 1;
+        }
+        return run_tests(testdir, golden);
+    }
+
     al_install_keyboard();
 
     al_set_new_window_position(WIN_LOC_X, WIN_LOC_Y);
-    al_set_new_display_flags(DEFAULT_WINDOW_FLAGS);
+    al_set_new_display_flags(DEFAULT_WINDOW_FLAGS |
+                             (shaded ? ALLEGRO_OPENGL | ALLEGRO_PROGRAMMABLE_PIPELINE : 0));
+    al_set_new_display_option(ALLEGRO_VSYNC, vsync ? 1 : 2, ALLEGRO_SUGGEST);
     display = al_create_display(WIN_WIDTH, WIN_HEIGHT);
 
+    // objects set up from here on bind the shader kernels
+    if (shaded && dap_shader_init() == -1) {
+        printf("Could not build pattern shader, drawing patterns on the CPU\n");
+    }
+
     q = al_create_event_queue();
     al_register_event_source(q, al_get_keyboard_event_source());
-    timer = al_create_timer(1.0 / 4);
+    dap_frame_init(&fp, rate);
+    timer = al_create_timer(fp.period);
     al_start_timer(timer);
 
     //al_register_event_source(q, al_get_display_event_source(display));
@@ -1163,110 +8730,126 @@ int main()  {
 
     printf("size of GRAPH_OBJ = %ld\n", sizeof(GRAPH_OBJ));
 
-    // set defaults
-    dap_set_graph_style_clip(&g, false);
-    dap_set_graph_type(&g, TYPE_RECTANGLE);
-    dap_set_graph_color(&g, false, C585NM, BLACK);
-    dap_set_graph_style(&g, BORDER_PATTERN, FILL_VERTBARS, 0xFF00);
-
-    // clear display
-    al_set_target_backbuffer(display);
-    al_clear_to_color(BLACK);
-
-    // draw a horizontal line
-    dap_set_graph_style_border(&g, LINE_PATTERN);
-    dap_set_line(&g, 10, 10, 200, 10);
-    dap_draw_line(&g);
-    // draw a vertical line
-    dap_set_line(&g, 200, 10, 200, 250);
-    dap_draw_line(&g);
-    // draw diagonal line
-    dap_set_line(&g, 200, 250, 10, 10);
-    dap_draw_line(&g);
-
-    // draw rectangle fill
-    dap_set_graph_style_fill(&g, FILL_VERTBARS);
-    dap_set_rectangle(&g, 10, 550, 200, 600);
-    dap_draw_rectangle_fill(&g);
-
-    dap_set_graph_style_fill(&g, FILL_PATTERN);
-    dap_set_rectangle(&g, 210, 550, 400, 600);
-    dap_draw_rectangle_fill(&g);
-
-    dap_set_graph_style_fill(&g, FILL_SOLID);
-    dap_set_rectangle(&g, 410, 550, 600, 600);
-    dap_draw_rectangle_fill(&g);
-
-    // draw circle fill
-    dap_set_graph_style_fill(&g, FILL_VERTBARS);
-    dap_set_circle(&g, 60, 300, 50);
-    dap_draw_circle_fill(&g);
-
-    dap_set_graph_style_fill(&g, FILL_PATTERN);
-    dap_set_circle(&g, 200, 300, 50);
-    dap_draw_circle_fill(&g);
-
-    dap_set_graph_style_fill(&g, FILL_SOLID);
-    dap_set_circle(&g, 350, 300, 50);
-    dap_draw_circle_fill(&g);
-
-    // draw circle borders
-    dap_set_graph_style_border(&g, BORDER_DASH);
-    dap_set_circle(&g, 60, 450, 50);
-    dap_draw_circle_border(&g);
-
-    dap_set_graph_style_border(&g, BORDER_SOLID);
-    dap_set_circle(&g, 200, 450, 50);
-    dap_draw_circle_border(&g);
+    if (tracefile != NULL && dap_trace_start(tracefile) == -1) {
+        printf("Could not record trace to %s\n", tracefile);
+    }
 
-    dap_set_graph_style_border(&g, BORDER_PATTERN);
-    dap_set_circle(&g, 350, 450, 50);
-    dap_draw_circle_border(&g);
+    demo_init();
+
+    // the demo screen is painted once, the status window every frame
+    if (windowed) {
+        memset(&status, 0, sizeof(GRAPH_OBJ));
+        wins[0] = dap_window_create(DEFAULT_WINDOW_HOME_X, DEFAULT_WINDOW_HOME_Y,
+                                    WIN_WIDTH, WIN_HEIGHT, demo_paint_screen, NULL);
+        wins[1] = dap_window_create(WIN_WIDTH - 8 - 104 * DEFAULT_WINDOW_SCALE, 8,
+                                    104, 12, demo_paint_status, &status);
+        if (wins[0] == NULL || wins[1] == NULL) {
+            printf("Could not create windows\n");
+            return 1;
+        }
+        dap_window_set_scale(wins[1], DEFAULT_WINDOW_SCALE);
+    }
 
-    // draw a solid rectangles
-    dap_set_graph_style_border(&g, BORDER_SOLID);
-    dap_set_rectangle(&g, 410, 650, 600, 700);
-    dap_draw_rectangle_border(&g);
+    if (nobjects > 0) {
+        scene = dap_scene_create();
+        if (scene == NULL || demo_build_scene(scene, nobjects) == -1) {
+            printf("Could not build scene\n");
+            return 1;
+        }
+        printf("scene of %zu objects in %zu bytes\n", dap_scene_count(scene), dap_scene_bytes(scene));
+        if (savefile != NULL && dap_scene_save(scene, savefile) == -1) {
+            printf("Could not save scene to %s\n", savefile);
+        }
+    }
 
-    dap_set_graph_style_border(&g, BORDER_DASH);
-    dap_set_rectangle(&g, 10, 650, 200, 700);
-    dap_draw_rectangle_border(&g);
+    if (scenefile != NULL) {
+        sf = dap_scene_map(scenefile);
+        if (sf == NULL) {
+            printf("Could not map scene file %s\n", scenefile);
+            return 1;
+        }
+    }
 
-    dap_set_graph_style_border(&g, BORDER_PATTERN);
-    dap_set_rectangle(&g, 210, 650, 400, 700);
-    dap_draw_rectangle_border(&g);
+    al_set_target_backbuffer(display);
 
-    // draw a rectangle
-    dap_set_graph_style(&g, BORDER_PATTERN, FILL_PATTERN, 0xFF00);
-    dap_set_rectangle(&g, 700, 400, 900, 500);
-    dap_draw_rectangle(&g);
+    if (indexed) {
+        ix = dap_indexed_create(WIN_WIDTH, WIN_HEIGHT);
+        if (ix == NULL) {
+            printf("Could not create indexed framebuffer\n");
+            return 1;
+        }
+        alarm = dap_indexed_color(ix, C585NM);
+    }
 
-    // draw a circle
-    dap_set_graph_style(&g, BORDER_PATTERN, FILL_PATTERN, 0xFF00);
-    dap_set_circle(&g, 700, 200, 150);
-    dap_draw_circle(&g);
+    if (shmname != NULL) {
+        shm = dap_shm_create(shmname, WIN_WIDTH, WIN_HEIGHT);
+        i = al_get_new_bitmap_flags();
+        al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+        shmframe = al_create_bitmap(WIN_WIDTH, WIN_HEIGHT);
+        al_set_new_bitmap_flags(i);
+        if (shm == NULL || shmframe == NULL) {
+            printf("Could not create shared memory output %s\n", shmname);
+            return 1;
+        }
+        memset(&status, 0, sizeof(GRAPH_OBJ));
+    }
 
-    // get raster data and map into memory
-    r = dap_set_raster_file(&g, RASTER_FILE, 0, 725, 512);
-    if (r == -1) {
-        printf("Could not open raster file\n");
+    if (progressive) {
+        sched = dap_sched_create();
+        canvas = al_create_bitmap(WIN_WIDTH, WIN_HEIGHT);
+        if (sched == NULL || canvas == NULL || demo_progressive(sched) == -1) {
+            printf("Could not create progressive scene\n");
+            return 1;
+        }
+        al_set_target_bitmap(canvas);
+        al_clear_to_color(BLACK);
+        al_set_target_backbuffer(display);
     }
 
-    // close the raster file, data is in memory
-    r =  dap_close_raster_file(&g);
-    if (r == -1) {
-        printf("Could not close raster file\n");
+    if (frozen) {
+        fz = dap_freeze_create();
+        if (fz == NULL || demo_freeze(fz) == -1) {
+            printf("Could not create overlay\n");
+            return 1;
+        }
     }
 
-    // draw raster pattern
-    r = dap_draw_raster(&g);
-    if (r == -1) {
-        printf("Nothing to draw\n");
+    if (capturefile != NULL) {
+        cap = dap_capture_create(WIN_WIDTH, WIN_HEIGHT, CAPTURE_BUFFERS, capturefile, CAPTURE_DROP_OLDEST);
+        if (cap == NULL) {
+            printf("Could not create frame capture, the pattern needs one integer conversion such as %%05u\n");
+            return 1;
+        }
+        // a frame a second at the frame rate in use
+        capturestep = rate >= 1 ? (uint32_t)lround(rate) : 1;
     }
 
+    if (nparts > 0) {
+        parts = calloc(nparts, sizeof(DEMO_PART));
+        if (parts == NULL) {
+            printf("Could not create contexts\n");
+            return 1;
+        }
+        for (i = 0; i < nparts; i++) {
+            parts[i].ctx = dap_ctx_create(NULL);
+            parts[i].n = DEMO_PART_OBJECTS;
+            if (parts[i].ctx == NULL) {
+                printf("Could not create contexts\n");
+                return 1;
+            }
+        }
+    }
 
-    // update display
-    al_flip_display();
+    // start the render thread, it owns the display from here on
+    if (threaded) {
+        al_set_target_bitmap(NULL);
+        rq = dap_queue_create(display, DEFAULT_QUEUE_SIZE);
+        if (rq == NULL) {
+            printf("Could not start render thread\n");
+            al_set_target_backbuffer(display);
+        }
+        dap_set_target_queue(rq);
+    }
 
     while (running) {
 
@@ -1279,10 +8862,106 @@ int main()  {
 
         if (event.type == ALLEGRO_EVENT_TIMER) {
 
+            if (dap_frame_due(&fp, q, &event)) {
+                if (windowed) {
+                    dap_window_invalidate(wins[1]);
+                    dap_compose(wins, 2);
+                }
+                else if (sf != NULL) {
+                    dap_clear(BLACK);
+                    dap_scene_file_draw(sf);
+                }
+                else if (scene != NULL) {
+                    dap_clear(BLACK);
+                    dap_scene_draw(scene);
+                }
+                else if (parts != NULL) {
+                    demo_draw_parts(parts, nparts);
+                }
+                else if (sched != NULL) {
+                    if (demo_draw_progressive(sched, canvas, fp.period / 2) == 0 && drawn == 0) {
+                        drawn = fp.nsubmitted + 1;
+                        printf("progressive scene drawn in %u frames\n", drawn);
+                    }
+                }
+                else if (shm != NULL) {
+                    demo_publish(shm, shmframe, &status, &redraw);
+                }
+                else if (ix != NULL) {
+                    // draw once, until the raster is loaded, then only flash the palette
+                    if (redraw) {
+                        dap_indexed_begin(ix);
+                        demo_draw();
+                        dap_indexed_end();
+                        redraw = demo_raster.grast.load != NULL;
+                    }
+                    dap_indexed_set_palette(ix, alarm, (fp.nsubmitted / 30) & 1 ? RED : C585NM);
+                    dap_indexed_present(ix, 0, 0);
+                }
+                else {
+                    demo_draw();
+                }
+                if (fz != NULL) {
+                    dap_freeze_draw(fz);
+                }
+                if (cap != NULL && fp.nsubmitted % capturestep == 0) {
+                    dap_capture(cap);
+                }
+                dap_flip_frame(&fp);
+                if (maxframes > 0 && fp.nsubmitted >= maxframes) {
+                    running = false;
+                }
+            }
         }
     }
 
     // quit
+    if (rq != NULL) {
+        dap_set_target_queue(NULL);
+        dap_queue_destroy(rq);
+        al_set_target_backbuffer(display);
+    }
+    if (windowed) {
+        printf("screen window painted %u times, status window %u times\n",
+               wins[0]->npaints, wins[1]->npaints);
+        dap_window_destroy(wins[0]);
+        dap_window_destroy(wins[1]);
+    }
+    if (scene != NULL) {
+        dap_scene_destroy(scene);
+    }
+    if (sf != NULL) {
+        dap_scene_unmap(sf);
+    }
+    if (ix != NULL) {
+        dap_indexed_destroy(ix);
+    }
+    if (shm != NULL) {
+        dap_shm_destroy(shm);
+        al_destroy_bitmap(shmframe);
+    }
+    if (fz != NULL) {
+        printf("overlay recorded %u times\n", fz->nbuilds);
+        dap_freeze_destroy(fz);
+    }
+    if (sched != NULL) {
+        dap_sched_destroy(sched);
+        al_destroy_bitmap(canvas);
+    }
+    if (cap != NULL) {
+        dap_capture_stop(cap);
+        printf("frames captured %u, saved %u, dropped %u, failed %u\n",
+               cap->next, cap->nsaved, cap->ndropped, cap->nfailed);
+        dap_capture_destroy(cap);
+    }
+    for (i = 0; parts != NULL && i < nparts; i++) {
+        dap_ctx_destroy(parts[i].ctx);
+    }
+    free(parts);
+    if (tracefile != NULL && trace_rec != NULL && dap_trace_stop() == -1) {
+        printf("Could not write trace to %s\n", tracefile);
+    }
+    dap_frame_report(&fp);
     al_destroy_timer(timer);
     al_destroy_event_queue(q);
     al_destroy_display(display);